@@ -0,0 +1,293 @@
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA for speedy distributed
+ *  in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS), Shanghai Jiao Tong University
+ *     All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+/*
+ *  Pieces shared by the transaction drivers: random numbers, the lease
+ *  clock, the region holding the tables and message buffers of a partition,
+ *  the connection of the partitions and the statistics partition 0 prints.
+ *  A driver defines the globals of the db layer (total_partition,
+ *  current_partition, nthreads and timestamp).
+ */
+
+#ifndef DRTM_BENCH_BENCH_H
+#define DRTM_BENCH_BENCH_H
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "db/dbsstx.h"
+#include "microbench/rdma/latency_hist.h"
+#include "microbench/rtmRegion.h"
+
+#define TX_COMMIT   0
+#define TX_ABORT    1 //conflict, the transaction is retried
+#define TX_ROLLBACK 2 //given up by the transaction logic, not retried
+
+#define BENCH_MAX_TYPES 8
+
+static inline uint64_t now_ns() {
+  //leases are compared across hosts, so the clock has to be the synchronized one
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME,&ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//keeps timestamp, the clock of the leases, up to date
+static void *TimestampThread(void *arg) {
+  while(true) {
+    timestamp = now_ns();
+    usleep(10);
+  }
+  return NULL;
+}
+
+static void StartTimestamp() {
+  pthread_t tid;
+  timestamp = now_ns();
+  pthread_create(&tid,NULL,TimestampThread,NULL);
+}
+
+typedef struct bench_rand {
+  uint64_t state;
+} bench_rand;
+
+static inline void RandomInit(bench_rand *r,uint64_t seed) {
+  r->state = seed * 0x9e3779b97f4a7c15ULL + 1;
+}
+
+static inline uint64_t RandomNext(bench_rand *r) {
+  r->state ^= r->state >> 12;
+  r->state ^= r->state << 25;
+  r->state ^= r->state >> 27;
+  return r->state * 2685821657736338717ULL;
+}
+
+static inline int RandomNumber(bench_rand *r,int min,int max) {
+  return min + RandomNext(r) % (max - min + 1);
+}
+
+//a transaction type drawn from a mix in percent
+static inline int PickType(bench_rand *r,const int *mix) {
+  int p = RandomNumber(r,1,100);
+  int type = 0;
+  while(p > mix[type]) {
+    p -= mix[type];
+    type++;
+  }
+  return type;
+}
+
+//rdma tables copy entries of vlen + 64 bytes, the record gets the same room
+static void LoadRecord(RAWTables *tables,int tableid,uint64_t key,const void *row,int len) {
+  char *rec = (char *)calloc(1,META_LENGTH + len + 64);
+  memcpy(rec + VALUE_OFFSET,row,len);
+  tables->Put(tableid,key,(uint64_t *)rec);
+  if(tables->rdma_table[tableid])
+    free(rec);
+}
+
+//entries of an rdma table for rows rows, with room for cuckoo hashing
+static inline int HashSize(int rows) {
+  return rows * 3 / 2 + 1024;
+}
+
+//The row of a local record, NULL if the key is missing. Returns false when a
+//remote transaction holds the lock, or a lease while we are writing.
+static bool LocalRow(DBSSTX *tx,int tableid,uint64_t key,bool write,char **row) {
+  uint64_t *val;
+  int status = NONE;
+  if(!GetAt(tx,tableid,key,&val,write,NULL,&status)) {
+    *row = NULL;
+    return true;
+  }
+  *row = (char *)val;
+  return status != LOCK && !(write && status == READ_LEASE);
+}
+
+/* partitions */
+
+typedef struct bench_env {
+  const char *name; //of the shared memory regions
+  bool soft;        //partitions are processes of this host
+  char *region;
+  uint64_t region_size;
+  uint64_t data_size; //the tables, the message buffers follow
+  uint64_t slot;      //message buffers of a thread
+  int nid;            //of the driver, next to the rpc handler at nthreads
+  Network_Node *node;
+  RdmaResource *rdma;
+} bench_env;
+
+//the region of partition pid in shared memory, created by its owner
+static char *ShmRegion(bench_env *env,int pid,bool create) {
+  char name[64];
+  snprintf(name,sizeof(name),"/drtm_%s_%d",env->name,pid);
+  int fd = shm_open(name,create ? O_CREAT | O_RDWR : O_RDWR,0600);
+  if(fd < 0 || (create && ftruncate(fd,env->region_size) != 0)) {
+    perror("shm_open");
+    exit(1);
+  }
+  char *addr = (char *)mmap(NULL,env->region_size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if(addr == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return addr;
+}
+
+//every partition reports to partition 0, which answers to all
+static void Barrier(bench_env *env) {
+  int len;
+  char c = 0;
+  if(current_partition == 0) {
+    for(int i = 1;i < total_partition;++i)
+      Network_Node_Recv(env->node,&len,NULL,NULL);
+    for(int i = 1;i < total_partition;++i)
+      Network_Node_Send(env->node,i,env->nid,&c,1);
+  }else {
+    Network_Node_Send(env->node,0,env->nid,&c,1);
+    Network_Node_Recv(env->node,&len,NULL,NULL);
+  }
+}
+
+//One region for the tables and the message buffers of the threads, called
+//before the schemas are added. The rpc handler is thread nthreads.
+static void BenchRegion(bench_env *env,RAWTables *tables,const char *name,bool soft) {
+  env->name = name;
+  env->soft = soft;
+  env->slot = MSG_RESERVED + 2 * 1024 * 1024;
+  env->data_size = tables->rdma_size;
+  env->region_size = env->data_size + (nthreads + 1) * env->slot;
+  env->region = soft ? ShmRegion(env,current_partition,true) : (char *)malloc(env->region_size);
+  free(tables->start_rdma);
+  tables->start_rdma = tables->end_rdma = env->region;
+}
+
+//connect the partitions once the tables are loaded
+static void BenchConnect(bench_env *env,RAWTables *tables,const char *peers) {
+  assert(tables->end_rdma <= env->region + env->data_size);
+  env->nid = nthreads + 1;
+  env->node = Network_Node_new(current_partition,env->nid,peers);
+  Network_Node *rpc_node = Network_Node_new(current_partition,nthreads,peers);
+  env->rdma = new RdmaResource(total_partition,nthreads + 1,current_partition,env->region,
+			       env->region_size,env->slot,env->data_size,1,env->soft);
+  env->rdma->node = env->node;
+  env->rdma->Servicing();
+  Barrier(env);
+  if(env->soft) {
+    for(int i = 0;i < total_partition;++i) {
+      if(i != current_partition)
+	env->rdma->SoftMap(i,ShmRegion(env,i,false));
+    }
+  }
+  env->rdma->Connect();
+  StartRpcHandler(tables,env->rdma,rpc_node);
+  Barrier(env);
+}
+
+//the name of the region goes away, mappings of the peers stay valid
+static void BenchFinish(bench_env *env) {
+  if(env->soft) {
+    char name[64];
+    snprintf(name,sizeof(name),"/drtm_%s_%d",env->name,(int)current_partition);
+    shm_unlink(name);
+  }
+}
+
+/* statistics */
+
+typedef struct bench_stats {
+  uint64_t commits[BENCH_MAX_TYPES];
+  uint64_t aborts[BENCH_MAX_TYPES];
+  uint64_t rollbacks;
+  LatencyHist hist[BENCH_MAX_TYPES]; //from the first attempt to the commit, ns
+} bench_stats;
+
+static void BenchStats_merge(bench_stats *dst,const bench_stats *src) {
+  for(int t = 0;t < BENCH_MAX_TYPES;++t) {
+    dst->commits[t] += src->commits[t];
+    dst->aborts[t] += src->aborts[t];
+    LatencyHist_merge(&dst->hist[t],&src->hist[t]);
+  }
+  dst->rollbacks += src->rollbacks;
+}
+
+//the statistics of every partition are merged into s of partition 0, returns
+//true there
+static bool BenchGather(bench_env *env,bench_stats *s) {
+  const int counters = 2 * BENCH_MAX_TYPES + 1;
+  if(current_partition != 0) {
+    char *msg = (char *)malloc(sizeof(uint64_t) * counters + BENCH_MAX_TYPES * HIST_SERIAL_MAX);
+    char *p = msg;
+    memcpy(p,s->commits,sizeof(s->commits));
+    p += sizeof(s->commits);
+    memcpy(p,s->aborts,sizeof(s->aborts));
+    p += sizeof(s->aborts);
+    memcpy(p,&s->rollbacks,sizeof(uint64_t));
+    p += sizeof(uint64_t);
+    for(int t = 0;t < BENCH_MAX_TYPES;++t)
+      p += LatencyHist_serialize(&s->hist[t],p);
+    Network_Node_Send(env->node,0,env->nid,msg,p - msg);
+    free(msg);
+    return false;
+  }
+  for(int i = 1;i < total_partition;++i) {
+    int len;
+    const char *p = Network_Node_Recv(env->node,&len,NULL,NULL);
+    uint64_t v[counters];
+    memcpy(v,p,sizeof(v));
+    p += sizeof(v);
+    for(int t = 0;t < BENCH_MAX_TYPES;++t) {
+      s->commits[t] += v[t];
+      s->aborts[t] += v[BENCH_MAX_TYPES + t];
+      p += LatencyHist_merge_serialized(&s->hist[t],p);
+    }
+    s->rollbacks += v[2 * BENCH_MAX_TYPES];
+  }
+  return true;
+}
+
+//throughput, then the abort rate and latencies of each type
+static void BenchPrint(const bench_stats *s,int ntypes,const char **names,int duration) {
+  uint64_t commits = 0;
+  for(int t = 0;t < ntypes;++t)
+    commits += s->commits[t];
+  printf("%.0f txns/s, %lu rollbacks, local part in %s\n",commits * 1.0 / duration,
+	 s->rollbacks,rtm_enabled() ? "rtm" : "lock fallback");
+  for(int t = 0;t < ntypes;++t) {
+    uint64_t tries = s->commits[t] + s->aborts[t];
+    printf("%s\tabort rate\t%.4f\t",names[t],tries ? s->aborts[t] * 1.0 / tries : 0);
+    LatencyHist_print(&s->hist[t],names[t],stdout);
+  }
+}
+
+#endif
@@ -0,0 +1,477 @@
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA for speedy distributed
+ *  in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS), Shanghai Jiao Tong University
+ *     All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+/*
+ *  SmallBank over DBSSTX and RAWTables. Every partition loads its accounts
+ *  and its worker threads run the mix of six short transactions. The first
+ *  account of a transaction is local and drawn from a skewed distribution,
+ *  the second one of amalgamate and send-payment lives on another partition
+ *  for -remote % of them and is locked with the one-sided operations of
+ *  DBSSTX. The local part runs in an RTM region.
+ */
+
+#include "bench.h"
+#include "microbench/rdma/keygen.h"
+#include "microbench/rdma/rdma_coroutine.h"
+#include "microbench/rtmRegion.h"
+#include "smallbank.h"
+
+size_t total_partition = 1;
+size_t current_partition = 0;
+size_t nthreads = 1;
+uint64_t timestamp = 0;
+
+int accounts = BANK_ACCOUNTS;   //per partition
+const char *dist = "hotspot:0.01:0.9";
+int remote_ratio = 1;           //% of two-account transactions across partitions
+int interleave = 1;             //transactions per worker thread
+int duration = 10;              //seconds
+bool soft = false;
+
+//percent of each type in the mix
+const int tx_mix[TX_TYPES] = {15,15,15,25,15,15};
+const char *tx_names[TX_TYPES] = {"amalgamate","balance","deposit-checking","send-payment",
+				  "transact-savings","write-check"};
+
+volatile bool running = false;
+
+RAWTables *tables;
+RdmaResource *rdma;
+bench_env env;
+
+static inline int acct_partition(uint64_t id) {
+  return id / accounts;
+}
+
+/* loader */
+
+struct load_arg {
+  int id;
+};
+
+//loader thread id loads the accounts id, id + nthreads ... of the partition
+void *LoadThread(void *arg) {
+  int id = ((load_arg *)arg)->id;
+  bench_rand r;
+  RandomInit(&r,current_partition * nthreads + id);
+  account_row acct;
+  savings_row sav;
+  checking_row chk;
+  for(uint64_t i = id;i < accounts;i += nthreads) {
+    uint64_t a = current_partition * (uint64_t)accounts + i;
+    memset(&acct,0,sizeof(acct));
+    snprintf(acct.a_name,sizeof(acct.a_name),"%lu",a);
+    LoadRecord(tables,ACCT,a,&acct,sizeof(acct));
+    sav.s_balance = RandomNumber(&r,BANK_MIN_BALANCE,BANK_MAX_BALANCE);
+    LoadRecord(tables,SAV,a,&sav,sizeof(sav));
+    chk.c_balance = RandomNumber(&r,BANK_MIN_BALANCE,BANK_MAX_BALANCE);
+    LoadRecord(tables,CHECK,a,&chk,sizeof(chk));
+  }
+  return NULL;
+}
+
+/* transactions */
+
+#define REMOTE_SLOT_SIZE (META_LENGTH + sizeof(checking_row) + 64)
+
+struct bank_worker {
+  int t_id;
+  bench_stats *stats; //shared by the transactions of the thread
+  RTMRegionProfile prof;
+  float results; //what Balance returns, summed
+};
+
+//state of one interleaved transaction slot
+struct bank_ctx {
+  bank_worker *w;
+  DBSSTX *tx;
+  bench_rand r;
+  KeyGen keys; //over the accounts of a partition
+  char remote[REMOTE_SLOT_SIZE];
+};
+
+static inline uint64_t LocalAccount(bank_ctx *c) {
+  return current_partition * (uint64_t)accounts + KeyGen_next(&c->keys);
+}
+
+//the second account of amalgamate and send-payment, another one than a
+static uint64_t OtherAccount(bank_ctx *c,uint64_t a) {
+  uint64_t pid = current_partition;
+  if(total_partition > 1 && RandomNumber(&c->r,1,100) <= remote_ratio) {
+    pid = RandomNumber(&c->r,0,total_partition - 2);
+    if(pid >= current_partition)
+      pid++;
+  }
+  uint64_t b;
+  do {
+    b = pid * accounts + KeyGen_next(&c->keys);
+  } while(b == a && accounts > 1);
+  return b;
+}
+
+//the checking balance of account b, locked and read by PrefetchAllRemote when
+//it is remote. A local one is looked up in the RTM region, *dst is NULL then.
+//False when the remote row cannot be found, the transaction aborts.
+static bool RemoteChecking(bank_ctx *c,uint64_t b,checking_row **dst) {
+  int pid = acct_partition(b);
+  *dst = NULL;
+  if(pid == current_partition)
+    return true;
+  AddToRemoteWriteSet(c->tx,CHECK,b,pid,(uint64_t *)c->remote);
+  if(!PrefetchAllRemote(c->tx,timestamp + DEFAULT_INTERVAL)) {
+    ClearRwset(c->tx);
+    return false;
+  }
+  *dst = (checking_row *)(c->remote + VALUE_OFFSET);
+  return true;
+}
+
+//the account row stands for the name lookup every SmallBank transaction starts with
+static inline bool LocalAccountRow(DBSSTX *tx,uint64_t a) {
+  char *acct;
+  return LocalRow(tx,ACCT,a,false,&acct) && acct != NULL;
+}
+
+static int Finish(DBSSTX *tx,int ret) {
+  if(ret != TX_COMMIT) {
+    ReleaseAllRemote(tx);
+    ClearRwset(tx);
+    return ret;
+  }
+  RemoteWriteBack(tx);
+  End(tx);
+  return TX_COMMIT;
+}
+
+//moves both balances of a to the checking account of b
+int Amalgamate(bank_ctx *c) {
+  DBSSTX *tx = c->tx;
+  uint64_t a = LocalAccount(c);
+  uint64_t b = OtherAccount(c,a);
+
+  Begin(tx,false);
+  GetSS(tx);
+  checking_row *dst;
+  if(!RemoteChecking(c,b,&dst))
+    return TX_ABORT;
+  int ret = TX_COMMIT;
+  {
+    RTMRegion rtm(&c->w->prof);
+    //a hardware region resumes here after Abort, Aborted() keeps it from
+    //running the body again and tells the abort from a commit
+    if(!rtm.Aborted()) {
+      savings_row *sav;
+      checking_row *chk;
+      bool ok = LocalAccountRow(tx,a) && LocalRow(tx,SAV,a,true,(char **)&sav) &&
+	LocalRow(tx,CHECK,a,true,(char **)&chk);
+      if(ok && dst == NULL)
+	ok = LocalAccountRow(tx,b) && LocalRow(tx,CHECK,b,true,(char **)&dst);
+      if(!ok) {
+	rtm.Abort();
+      } else {
+	float total = sav->s_balance + chk->c_balance;
+	sav->s_balance = 0;
+	chk->c_balance = 0;
+	dst->c_balance += total;
+      }
+    }
+    if(rtm.Aborted())
+      ret = TX_ABORT;
+  }
+  return Finish(tx,ret);
+}
+
+int Balance(bank_ctx *c) {
+  DBSSTX *tx = c->tx;
+  uint64_t a = LocalAccount(c);
+
+  Begin(tx,true);
+  int ret = TX_COMMIT;
+  {
+    RTMRegion rtm(&c->w->prof);
+    if(!rtm.Aborted()) {
+      savings_row *sav;
+      checking_row *chk;
+      if(!LocalAccountRow(tx,a) || !LocalRow(tx,SAV,a,false,(char **)&sav) ||
+	 !LocalRow(tx,CHECK,a,false,(char **)&chk)) {
+	rtm.Abort();
+      } else {
+	c->w->results += sav->s_balance + chk->c_balance;
+      }
+    }
+    if(rtm.Aborted())
+      ret = TX_ABORT;
+  }
+  return Finish(tx,ret);
+}
+
+int DepositChecking(bank_ctx *c) {
+  DBSSTX *tx = c->tx;
+  uint64_t a = LocalAccount(c);
+
+  Begin(tx,false);
+  GetSS(tx);
+  int ret = TX_COMMIT;
+  {
+    RTMRegion rtm(&c->w->prof);
+    if(!rtm.Aborted()) {
+      checking_row *chk;
+      if(!LocalAccountRow(tx,a) || !LocalRow(tx,CHECK,a,true,(char **)&chk)) {
+	rtm.Abort();
+      } else {
+	chk->c_balance += 1.3;
+      }
+    }
+    if(rtm.Aborted())
+      ret = TX_ABORT;
+  }
+  return Finish(tx,ret);
+}
+
+//rolls back when the checking balance of a does not cover the payment
+int SendPayment(bank_ctx *c) {
+  DBSSTX *tx = c->tx;
+  uint64_t a = LocalAccount(c);
+  uint64_t b = OtherAccount(c,a);
+
+  Begin(tx,false);
+  GetSS(tx);
+  checking_row *dst;
+  if(!RemoteChecking(c,b,&dst))
+    return TX_ABORT;
+  int ret = TX_COMMIT;
+  {
+    RTMRegion rtm(&c->w->prof);
+    if(!rtm.Aborted()) {
+      checking_row *chk;
+      bool ok = LocalAccountRow(tx,a) && LocalRow(tx,CHECK,a,true,(char **)&chk);
+      if(ok && dst == NULL)
+	ok = LocalAccountRow(tx,b) && LocalRow(tx,CHECK,b,true,(char **)&dst);
+      if(!ok) {
+	rtm.Abort();
+      } else if(chk->c_balance < 5.0) {
+	ret = TX_ROLLBACK;
+      } else {
+	chk->c_balance -= 5.0;
+	dst->c_balance += 5.0;
+      }
+    }
+    if(rtm.Aborted())
+      ret = TX_ABORT;
+  }
+  return Finish(tx,ret);
+}
+
+//rolls back when the savings balance would become negative
+int TransactSavings(bank_ctx *c) {
+  DBSSTX *tx = c->tx;
+  uint64_t a = LocalAccount(c);
+
+  Begin(tx,false);
+  GetSS(tx);
+  int ret = TX_COMMIT;
+  {
+    RTMRegion rtm(&c->w->prof);
+    if(!rtm.Aborted()) {
+      savings_row *sav;
+      if(!LocalAccountRow(tx,a) || !LocalRow(tx,SAV,a,true,(char **)&sav)) {
+	rtm.Abort();
+      } else if(sav->s_balance + 20.20 < 0) {
+	ret = TX_ROLLBACK;
+      } else {
+	sav->s_balance += 20.20;
+      }
+    }
+    if(rtm.Aborted())
+      ret = TX_ABORT;
+  }
+  return Finish(tx,ret);
+}
+
+//an overdraft costs a penalty of 1
+int WriteCheck(bank_ctx *c) {
+  DBSSTX *tx = c->tx;
+  uint64_t a = LocalAccount(c);
+
+  Begin(tx,false);
+  GetSS(tx);
+  int ret = TX_COMMIT;
+  {
+    RTMRegion rtm(&c->w->prof);
+    if(!rtm.Aborted()) {
+      savings_row *sav;
+      checking_row *chk;
+      if(!LocalAccountRow(tx,a) || !LocalRow(tx,SAV,a,false,(char **)&sav) ||
+	 !LocalRow(tx,CHECK,a,true,(char **)&chk)) {
+	rtm.Abort();
+      } else if(sav->s_balance + chk->c_balance < 5.0) {
+	chk->c_balance -= 5.0 + 1;
+      } else {
+	chk->c_balance -= 5.0;
+      }
+    }
+    if(rtm.Aborted())
+      ret = TX_ABORT;
+  }
+  return Finish(tx,ret);
+}
+
+typedef int (*tx_func)(bank_ctx *c);
+const tx_func tx_funcs[TX_TYPES] = {Amalgamate,Balance,DepositChecking,SendPayment,
+				    TransactSavings,WriteCheck};
+
+void BankSlot(DBSSTX *tx,int cor_id,void *arg) {
+  bank_worker *w = (bank_worker *)arg;
+  bank_ctx *c = new bank_ctx;
+  c->w = w;
+  c->tx = tx;
+  uint64_t seed = (current_partition * nthreads + w->t_id) * MAX_COR + cor_id;
+  RandomInit(&c->r,seed);
+  KeyGen_parse(&c->keys,dist);
+  KeyGen_init(&c->keys,accounts,seed);
+
+  while(running) {
+    int type = PickType(&c->r,tx_mix);
+    uint64_t start = now_ns();
+    int ret;
+    //the accounts are drawn again on a retry
+    while((ret = tx_funcs[type](c)) == TX_ABORT)
+      w->stats->aborts[type]++;
+    if(ret == TX_ROLLBACK) {
+      w->stats->rollbacks++;
+      continue;
+    }
+    w->stats->commits[type]++;
+    LatencyHist_record(&w->stats->hist[type],now_ns() - start);
+  }
+  delete c;
+}
+
+void *WorkerThread(void *arg) {
+  bank_worker *w = (bank_worker *)arg;
+  RunInterleaved(tables,rdma,w->t_id,interleave,BankSlot,w);
+  return NULL;
+}
+
+void usage() {
+  fprintf(stderr,"usage: smallbank <partition> <partitions> [peer list] [options]\n");
+  fprintf(stderr,"  -thr=N        worker threads (default 1)\n");
+  fprintf(stderr,"  -accounts=N   accounts per partition (default %d)\n",BANK_ACCOUNTS);
+  fprintf(stderr,"  -dist=SPEC    skew of the accounts, one of %s (default %s)\n",KEYGEN_NAMES,dist);
+  fprintf(stderr,"  -remote=N     %% of amalgamate and send-payment across partitions (default 1)\n");
+  fprintf(stderr,"  -k=N          interleaved transactions per thread (default 1)\n");
+  fprintf(stderr,"  -dur=N        seconds (default 10)\n");
+  fprintf(stderr,"  -soft         partitions are processes of this host\n");
+  exit(1);
+}
+
+int main(int argc,char **argv) {
+  const char *peers = NULL;
+  int positional = 0;
+  for(int i = 1;i < argc;i++) {
+    int n;
+    char junk;
+    if(sscanf(argv[i],"-thr=%d%c",&n,&junk) == 1) {
+      nthreads = n;
+    }else if(sscanf(argv[i],"-accounts=%d%c",&n,&junk) == 1) {
+      accounts = n;
+    }else if(strncmp(argv[i],"-dist=",6) == 0) {
+      dist = argv[i] + 6;
+    }else if(sscanf(argv[i],"-remote=%d%c",&n,&junk) == 1) {
+      remote_ratio = n;
+    }else if(sscanf(argv[i],"-k=%d%c",&n,&junk) == 1) {
+      interleave = n;
+    }else if(sscanf(argv[i],"-dur=%d%c",&n,&junk) == 1) {
+      duration = n;
+    }else if(strcmp(argv[i],"-soft") == 0) {
+      soft = true;
+    }else if(argv[i][0] == '-') {
+      usage();
+    }else if(positional == 0) {
+      current_partition = atoi(argv[i]);
+      positional++;
+    }else if(positional == 1) {
+      total_partition = atoi(argv[i]);
+      positional++;
+    }else {
+      peers = argv[i];
+    }
+  }
+  KeyGen g;
+  if(positional < 2 || current_partition >= total_partition || total_partition > MAX_RPC_PARTITION ||
+     accounts < 1 || interleave < 1 || interleave > MAX_COR || !KeyGen_parse(&g,dist))
+    usage();
+
+  StartTimestamp();
+
+  tables = new RAWTables(nthreads,BENCH_BANK);
+  tables->rdmatablesize[SAV] = HashSize(accounts);
+  tables->rdmatablesize[CHECK] = HashSize(accounts);
+  BenchRegion(&env,tables,"smallbank",soft);
+  tables->AddSchema(ACCT,sizeof(uint64_t),0,0,sizeof(account_row),true);
+  tables->AddSchema(SAV,sizeof(uint64_t),0,0,sizeof(savings_row),true);
+  tables->AddSchema(CHECK,sizeof(uint64_t),0,0,sizeof(checking_row),true);
+
+  uint64_t start = now_ns();
+  pthread_t *threads = new pthread_t[nthreads];
+  load_arg *largs = new load_arg[nthreads];
+  for(int i = 0;i < nthreads;++i) {
+    largs[i].id = i;
+    pthread_create(&threads[i],NULL,LoadThread,&largs[i]);
+  }
+  for(int i = 0;i < nthreads;++i)
+    pthread_join(threads[i],NULL);
+  fprintf(stdout,"loaded %d accounts in %.1f s\n",accounts,(now_ns() - start) / 1e9);
+
+  BenchConnect(&env,tables,peers);
+  rdma = env.rdma;
+
+  bank_worker *workers = new bank_worker[nthreads];
+  running = true;
+  for(int i = 0;i < nthreads;++i) {
+    workers[i].t_id = i;
+    workers[i].results = 0;
+    workers[i].stats = new bench_stats;
+    memset(workers[i].stats,0,sizeof(bench_stats));
+    pthread_create(&threads[i],NULL,WorkerThread,&workers[i]);
+  }
+  sleep(duration);
+  running = false;
+  for(int i = 0;i < nthreads;++i)
+    pthread_join(threads[i],NULL);
+  //no partition serves remote operations after this
+  Barrier(&env);
+
+  bench_stats total;
+  memset(&total,0,sizeof(total));
+  for(int i = 0;i < nthreads;++i)
+    BenchStats_merge(&total,workers[i].stats);
+  if(BenchGather(&env,&total)) {
+    printf("%d partitions x %d accounts, %s, %d%% remote, %d threads x %d interleaved, %d s\n",
+	   (int)total_partition,accounts,dist,remote_ratio,(int)nthreads,interleave,duration);
+    BenchPrint(&total,TX_TYPES,tx_names,duration);
+  }
+  BenchFinish(&env);
+  return 0;
+}
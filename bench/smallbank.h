@@ -0,0 +1,63 @@
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA for speedy distributed
+ *  in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS), Shanghai Jiao Tong University
+ *     All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+/*
+ *  SmallBank rows and keys. An account has a row in ACCT and a balance in
+ *  each of SAV and CHECK, all keyed by the account id. Ids are global, the
+ *  accounts of partition p are p * accounts .. (p + 1) * accounts - 1.
+ */
+
+#ifndef DRTM_BENCH_SMALLBANK_H
+#define DRTM_BENCH_SMALLBANK_H
+
+#include <stdint.h>
+
+#include "memtable/rawtables.h"
+
+#define BANK_ACCOUNTS    100000 //per partition
+#define BANK_MIN_BALANCE 10000
+#define BANK_MAX_BALANCE 50000
+
+//transaction types, also the index of their statistics
+#define TX_AMALGAMATE       0
+#define TX_BALANCE          1
+#define TX_DEPOSIT_CHECKING 2
+#define TX_SEND_PAYMENT     3
+#define TX_TRANSACT_SAVINGS 4
+#define TX_WRITE_CHECK      5
+#define TX_TYPES            6
+
+typedef struct account_row {
+  char a_name[64];
+} account_row;
+
+typedef struct savings_row {
+  float s_balance;
+} savings_row;
+
+typedef struct checking_row {
+  float c_balance;
+} checking_row;
+
+#endif
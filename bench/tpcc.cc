@@ -0,0 +1,828 @@
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA for speedy distributed
+ *  in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS), Shanghai Jiao Tong University
+ *     All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+/*
+ *  TPC-C over DBSSTX and RAWTables. Every partition loads its warehouses
+ *  and a full copy of ITEM, and its worker threads run the standard mix
+ *  against their home warehouses. A New-Order line supplied by another
+ *  partition and the customer of a remote Payment are accessed with the
+ *  one-sided operations of DBSSTX, the local part of a transaction runs in
+ *  an RTM region.
+ *
+ *  With -soft the partitions run as processes of one host: the region of
+ *  each one lives in shared memory and the software transport of
+ *  RdmaResource reads and writes the region of the target directly.
+ */
+
+#include "bench.h"
+#include "microbench/rdma/rdma_coroutine.h"
+#include "microbench/rtmRegion.h"
+#include "tpcc.h"
+
+size_t total_partition = 1;
+size_t current_partition = 0;
+size_t nthreads = 1;
+uint64_t timestamp = 0;
+
+int ware_per_part = 1;
+int num_items = NUM_ITEMS;
+int remote_new_order = 1; //% of New-Order lines supplied by another warehouse
+int remote_payment = 15;  //% of Payments for a customer of another warehouse
+int interleave = 1;       //transactions per worker thread
+int duration = 10;        //seconds
+bool soft = false;
+
+//percent of each type in the mix
+const int tx_mix[TX_TYPES] = {45,43,4,4,4};
+const char *tx_names[TX_TYPES] = {"new-order","payment","order-status","delivery","stock-level"};
+
+volatile bool running = false;
+
+RAWTables *tables;
+RdmaResource *rdma;
+bench_env env;
+
+/* random numbers of the TPC-C spec */
+
+//the C constants of NURand, the same for loading and running
+#define C_LAST_LOAD 157
+#define C_LAST_RUN  223
+#define C_ID        259
+#define C_OL_I_ID   7911
+
+static inline int NonUniformRandom(bench_rand *r,int A,int C,int min,int max) {
+  return (((RandomNumber(r,0,A) | RandomNumber(r,min,max)) + C) % (max - min + 1)) + min;
+}
+
+static void RandomString(bench_rand *r,char *s,int min,int max) {
+  int len = RandomNumber(r,min,max);
+  for(int i = 0;i < len;++i)
+    s[i] = 'a' + RandomNumber(r,0,25);
+  s[len] = '\0';
+}
+
+static void RandomNString(bench_rand *r,char *s,int min,int max) {
+  int len = RandomNumber(r,min,max);
+  for(int i = 0;i < len;++i)
+    s[i] = '0' + RandomNumber(r,0,9);
+  s[len] = '\0';
+}
+
+static void LastName(int num,char *s) {
+  static const char *syl[10] = {"BAR","OUGHT","ABLE","PRI","PRES","ESE","ANTI","CALLY","ATION","EING"};
+  strcpy(s,syl[num / 100]);
+  strcat(s,syl[(num / 10) % 10]);
+  strcat(s,syl[num % 10]);
+}
+
+static inline int ware_partition(int w_id) {
+  return (w_id - 1) / ware_per_part;
+}
+
+static inline int total_ware() {
+  return ware_per_part * total_partition;
+}
+
+//a warehouse other than w_id, the same one when it is the only warehouse
+static inline int OtherWarehouse(bench_rand *r,int w_id) {
+  if(total_ware() == 1)
+    return w_id;
+  int o = RandomNumber(r,1,total_ware() - 1);
+  return o >= w_id ? o + 1 : o;
+}
+
+/* loader */
+
+static void LoadItems(bench_rand *r) {
+  item_row item;
+  for(int i = 1;i <= num_items;++i) {
+    memset(&item,0,sizeof(item));
+    item.i_im_id = RandomNumber(r,1,10000);
+    item.i_price = RandomNumber(r,100,10000) / 100.0;
+    RandomString(r,item.i_name,14,24);
+    RandomString(r,item.i_data,26,50);
+    if(RandomNumber(r,1,100) <= 10)
+      memcpy(item.i_data + RandomNumber(r,0,strlen(item.i_data) - 8),"ORIGINAL",8);
+    LoadRecord(tables,ITEM,i,&item,sizeof(item));
+  }
+}
+
+static void LoadWarehouse(bench_rand *r,int w_id) {
+  warehouse_row ware;
+  memset(&ware,0,sizeof(ware));
+  ware.w_tax = RandomNumber(r,0,2000) / 10000.0;
+  ware.w_ytd = 300000;
+  RandomString(r,ware.w_name,6,10);
+  RandomString(r,ware.w_street_1,10,20);
+  RandomString(r,ware.w_street_2,10,20);
+  RandomString(r,ware.w_city,10,20);
+  RandomString(r,ware.w_state,2,2);
+  RandomNString(r,ware.w_zip,9,9);
+  LoadRecord(tables,WARE,w_id,&ware,sizeof(ware));
+
+  stock_row stock;
+  for(int i = 1;i <= num_items;++i) {
+    memset(&stock,0,sizeof(stock));
+    stock.s_quantity = RandomNumber(r,10,100);
+    for(int d = 0;d < DIST_PER_WARE;++d)
+      RandomString(r,stock.s_dist[d],24,24);
+    RandomString(r,stock.s_data,26,50);
+    if(RandomNumber(r,1,100) <= 10)
+      memcpy(stock.s_data + RandomNumber(r,0,strlen(stock.s_data) - 8),"ORIGINAL",8);
+    LoadRecord(tables,STOC,makeStockKey(w_id,i),&stock,sizeof(stock));
+  }
+
+  for(int d = 1;d <= DIST_PER_WARE;++d) {
+    district_row dist;
+    memset(&dist,0,sizeof(dist));
+    dist.d_tax = RandomNumber(r,0,2000) / 10000.0;
+    dist.d_ytd = 30000;
+    dist.d_next_o_id = CUST_PER_DIST + 1;
+    RandomString(r,dist.d_name,6,10);
+    RandomString(r,dist.d_street_1,10,20);
+    RandomString(r,dist.d_street_2,10,20);
+    RandomString(r,dist.d_city,10,20);
+    RandomString(r,dist.d_state,2,2);
+    RandomNString(r,dist.d_zip,9,9);
+    LoadRecord(tables,DIST,makeDistrictKey(w_id,d),&dist,sizeof(dist));
+
+    customer_row *cust = (customer_row *)malloc(sizeof(customer_row));
+    for(int c = 1;c <= CUST_PER_DIST;++c) {
+      memset(cust,0,sizeof(customer_row));
+      int last = c <= 1000 ? c - 1 : NonUniformRandom(r,255,C_LAST_LOAD,0,999);
+      LastName(last,cust->c_last);
+      RandomString(r,cust->c_first,8,16);
+      strcpy(cust->c_middle,"OE");
+      strcpy(cust->c_credit,RandomNumber(r,1,100) <= 10 ? "BC" : "GC");
+      cust->c_credit_lim = 50000;
+      cust->c_discount = RandomNumber(r,0,5000) / 10000.0;
+      cust->c_balance = -10;
+      cust->c_ytd_payment = 10;
+      cust->c_payment_cnt = 1;
+      cust->c_since = time(NULL);
+      RandomString(r,cust->c_street_1,10,20);
+      RandomString(r,cust->c_street_2,10,20);
+      RandomString(r,cust->c_city,10,20);
+      RandomString(r,cust->c_state,2,2);
+      RandomNString(r,cust->c_zip,9,9);
+      RandomNString(r,cust->c_phone,16,16);
+      RandomString(r,cust->c_data,300,500);
+      LoadRecord(tables,CUST,makeCustomerKey(w_id,d,c),cust,sizeof(customer_row));
+
+      index_row idx;
+      idx.id = c;
+      LoadRecord(tables,CUST_INDEX,makeCustIndexKey(w_id,d,last,c),&idx,sizeof(idx));
+
+      history_row hist;
+      memset(&hist,0,sizeof(hist));
+      hist.h_c_id = hist.h_c_d_id = c;
+      hist.h_c_w_id = hist.h_w_id = w_id;
+      hist.h_d_id = d;
+      hist.h_date = time(NULL);
+      hist.h_amount = 10;
+      RandomString(r,hist.h_data,12,24);
+      LoadRecord(tables,HIST,makeCustomerKey(w_id,d,c),&hist,sizeof(hist));
+    }
+    free(cust);
+
+    //orders go to a random permutation of the customers
+    int perm[CUST_PER_DIST];
+    for(int i = 0;i < CUST_PER_DIST;++i)
+      perm[i] = i + 1;
+    for(int i = CUST_PER_DIST - 1;i > 0;--i) {
+      int j = RandomNumber(r,0,i);
+      int t = perm[i];
+      perm[i] = perm[j];
+      perm[j] = t;
+    }
+    for(int o = 1;o <= CUST_PER_DIST;++o) {
+      bool delivered = o < NEW_ORDER_START;
+      order_row order;
+      memset(&order,0,sizeof(order));
+      order.o_c_id = perm[o - 1];
+      order.o_carrier_id = delivered ? RandomNumber(r,1,10) : 0;
+      order.o_ol_cnt = RandomNumber(r,5,MAX_OL_CNT);
+      order.o_all_local = 1;
+      order.o_entry_d = time(NULL);
+      LoadRecord(tables,ORDE,makeOrderKey(w_id,d,o),&order,sizeof(order));
+
+      index_row idx;
+      idx.id = o;
+      LoadRecord(tables,ORDER_INDEX,makeOrderIndexKey(w_id,d,order.o_c_id,o),&idx,sizeof(idx));
+      if(!delivered) {
+	new_order_row no;
+	no.no_dummy = 0;
+	LoadRecord(tables,NEWO,makeOrderKey(w_id,d,o),&no,sizeof(no));
+      }
+
+      for(int l = 1;l <= order.o_ol_cnt;++l) {
+	order_line_row line;
+	memset(&line,0,sizeof(line));
+	line.ol_i_id = RandomNumber(r,1,num_items);
+	line.ol_supply_w_id = w_id;
+	line.ol_quantity = 5;
+	line.ol_delivery_d = delivered ? order.o_entry_d : 0;
+	line.ol_amount = delivered ? 0 : RandomNumber(r,1,999999) / 100.0;
+	RandomString(r,line.ol_dist_info,24,24);
+	LoadRecord(tables,ORLI,makeOrderLineKey(w_id,d,o,l),&line,sizeof(line));
+      }
+    }
+  }
+}
+
+struct load_arg {
+  int id;
+};
+
+//loader thread id loads the local warehouses id, id + nthreads ...
+void *LoadThread(void *arg) {
+  int id = ((load_arg *)arg)->id;
+  bench_rand r;
+  RandomInit(&r,current_partition * nthreads + id);
+  if(id == 0)
+    LoadItems(&r);
+  for(int i = id;i < ware_per_part;i += nthreads)
+    LoadWarehouse(&r,current_partition * ware_per_part + i + 1);
+  return NULL;
+}
+
+/* transactions */
+
+//buffers of the remote records of one transaction
+#define REMOTE_SLOTS (MAX_OL_CNT + 1)
+#define REMOTE_SLOT_SIZE (META_LENGTH + sizeof(customer_row) + 64)
+
+struct tpcc_worker {
+  int t_id;
+  bench_stats *stats; //shared by the transactions of the thread
+  RTMRegionProfile prof;
+  uint64_t hist_seq;
+  float results; //what the read-only transactions return, summed
+};
+
+//state of one interleaved transaction slot
+struct tpcc_ctx {
+  tpcc_worker *w;
+  DBSSTX *tx;
+  bench_rand r;
+  int home; //warehouse of the terminal
+  char remote[REMOTE_SLOTS][REMOTE_SLOT_SIZE];
+};
+
+//a remote record to lock, PrefetchAllRemote reads it into the returned row
+static char *RemoteRow(tpcc_ctx *c,int slot,int tableid,uint64_t key,int pid) {
+  char *buf = c->remote[slot];
+  AddToRemoteWriteSet(c->tx,tableid,key,pid,(uint64_t *)buf);
+  return buf + VALUE_OFFSET;
+}
+
+//customers of a district with the given last name, sorted by first name,
+//the spec takes the one in the middle
+static int CustomerByName(DBSSTX *tx,int w_id,int d_id,int last) {
+  uint64_t start = makeCustIndexKey(w_id,d_id,last,0);
+  uint64_t bound = makeCustIndexKey(w_id,d_id,last + 1,0);
+  int ids[64];
+  int n = 0;
+  DBSSTX_Iterator *iter = GetIterator(tx,CUST_INDEX);
+  for(Seek(iter,start);Valid(iter) && Key(iter) < bound && n < 64;Next(iter))
+    ids[n++] = ((index_row *)Value(iter))->id;
+  delete iter;
+  if(n == 0)
+    return 0;
+  //insertion sort, a name is shared by a few customers only
+  char *first[64];
+  for(int i = 0;i < n;++i) {
+    uint64_t *val;
+    GetAt(tx,CUST,makeCustomerKey(w_id,d_id,ids[i]),&val,false,NULL);
+    first[i] = ((customer_row *)val)->c_first;
+    for(int j = i;j > 0 && strcmp(first[j - 1],first[j]) > 0;--j) {
+      char *f = first[j]; first[j] = first[j - 1]; first[j - 1] = f;
+      int id = ids[j]; ids[j] = ids[j - 1]; ids[j - 1] = id;
+    }
+  }
+  return ids[(n - 1) / 2];
+}
+
+static void UpdateStock(stock_row *stock,int quantity,bool remote) {
+  if(stock->s_quantity >= quantity + 10)
+    stock->s_quantity -= quantity;
+  else
+    stock->s_quantity += 91 - quantity;
+  stock->s_ytd += quantity;
+  stock->s_order_cnt++;
+  if(remote)
+    stock->s_remote_cnt++;
+}
+
+int NewOrder(tpcc_ctx *c) {
+  DBSSTX *tx = c->tx;
+  int w_id = c->home;
+  int d_id = RandomNumber(&c->r,1,DIST_PER_WARE);
+  int c_id = NonUniformRandom(&c->r,1023,C_ID,1,CUST_PER_DIST);
+  int ol_cnt = RandomNumber(&c->r,5,MAX_OL_CNT);
+  bool rollback = RandomNumber(&c->r,1,100) == 1;
+
+  int item[MAX_OL_CNT],supply[MAX_OL_CNT],quantity[MAX_OL_CNT];
+  int all_local = 1;
+  for(int i = 0;i < ol_cnt;++i) {
+    item[i] = NonUniformRandom(&c->r,8191,C_OL_I_ID,1,num_items);
+    supply[i] = w_id;
+    if(RandomNumber(&c->r,1,100) <= remote_new_order)
+      supply[i] = OtherWarehouse(&c->r,w_id);
+    if(supply[i] != w_id)
+      all_local = 0;
+    quantity[i] = RandomNumber(&c->r,1,10);
+  }
+  //the last line would name an unused item, ITEM is read only so the
+  //rollback is known before anything is accessed
+  if(rollback)
+    return TX_ROLLBACK;
+
+  Begin(tx,false);
+  GetSS(tx);
+  stock_row *stock[MAX_OL_CNT];
+  for(int i = 0;i < ol_cnt;++i) {
+    int pid = ware_partition(supply[i]);
+    stock[i] = NULL;
+    if(pid != current_partition)
+      stock[i] = (stock_row *)RemoteRow(c,i,STOC,makeStockKey(supply[i],item[i]),pid);
+  }
+  //a record the lookup cannot find aborts before anything is locked
+  if(!PrefetchAllRemote(tx,timestamp + DEFAULT_INTERVAL)) {
+    ClearRwset(tx);
+    return TX_ABORT;
+  }
+
+  bool ok = true;
+  {
+    RTMRegion rtm(&c->w->prof);
+    //Abort rolls a hardware region back, ok included, and resumes here
+    //with Aborted() set, so the body must not run a second time
+    if(!rtm.Aborted()) {
+      char *ware,*dist,*cust,*items[MAX_OL_CNT];
+      ok = LocalRow(tx,WARE,w_id,false,&ware) &&
+	LocalRow(tx,DIST,makeDistrictKey(w_id,d_id),true,&dist) &&
+	LocalRow(tx,CUST,makeCustomerKey(w_id,d_id,c_id),false,&cust);
+      for(int i = 0;ok && i < ol_cnt;++i) {
+	ok = LocalRow(tx,ITEM,item[i],false,&items[i]);
+	if(ok && stock[i] == NULL)
+	  ok = LocalRow(tx,STOC,makeStockKey(supply[i],item[i]),true,(char **)&stock[i]);
+      }
+      //nothing is written before every check passed, the lock-based path of
+      //RTMRegion cannot roll back
+      if(!ok) {
+	rtm.Abort();
+      } else {
+	district_row *d = (district_row *)dist;
+	int o_id = d->d_next_o_id++;
+	order_row order;
+	order.o_c_id = c_id;
+	order.o_carrier_id = 0;
+	order.o_ol_cnt = ol_cnt;
+	order.o_all_local = all_local;
+	order.o_entry_d = timestamp / 1000000000;
+	Add(tx,ORDE,makeOrderKey(w_id,d_id,o_id),(uint64_t *)&order);
+	new_order_row no;
+	no.no_dummy = 0;
+	Add(tx,NEWO,makeOrderKey(w_id,d_id,o_id),(uint64_t *)&no);
+	index_row idx;
+	idx.id = o_id;
+	Add(tx,ORDER_INDEX,makeOrderIndexKey(w_id,d_id,c_id,o_id),(uint64_t *)&idx);
+
+	float total = 0;
+	for(int i = 0;i < ol_cnt;++i) {
+	  //remote stocks are updated in their buffers and written back later
+	  UpdateStock(stock[i],quantity[i],supply[i] != w_id);
+	  order_line_row line;
+	  line.ol_i_id = item[i];
+	  line.ol_supply_w_id = supply[i];
+	  line.ol_quantity = quantity[i];
+	  line.ol_delivery_d = 0;
+	  line.ol_amount = quantity[i] * ((item_row *)items[i])->i_price;
+	  memcpy(line.ol_dist_info,stock[i]->s_dist[d_id - 1],sizeof(line.ol_dist_info));
+	  Add(tx,ORLI,makeOrderLineKey(w_id,d_id,o_id,i + 1),(uint64_t *)&line);
+	  total += line.ol_amount;
+	}
+	total *= (1 - ((customer_row *)cust)->c_discount) *
+	  (1 + ((warehouse_row *)ware)->w_tax + d->d_tax);
+      }
+    }
+    ok = !rtm.Aborted();
+  }
+  if(!ok) {
+    ReleaseAllRemote(tx);
+    ClearRwset(tx);
+    return TX_ABORT;
+  }
+  RemoteWriteBack(tx);
+  End(tx);
+  return TX_COMMIT;
+}
+
+int Payment(tpcc_ctx *c) {
+  DBSSTX *tx = c->tx;
+  int w_id = c->home;
+  int d_id = RandomNumber(&c->r,1,DIST_PER_WARE);
+  int c_w_id = w_id,c_d_id = d_id;
+  if(RandomNumber(&c->r,1,100) <= remote_payment) {
+    c_w_id = OtherWarehouse(&c->r,w_id);
+    c_d_id = RandomNumber(&c->r,1,DIST_PER_WARE);
+  }
+  int pid = ware_partition(c_w_id);
+  //CUST_INDEX is not an rdma table, customers of other partitions are
+  //chosen by id
+  bool by_name = pid == current_partition && RandomNumber(&c->r,1,100) <= 60;
+  int c_id = NonUniformRandom(&c->r,1023,C_ID,1,CUST_PER_DIST);
+  int last = NonUniformRandom(&c->r,255,C_LAST_RUN,0,999);
+  float amount = RandomNumber(&c->r,100,500000) / 100.0;
+
+  Begin(tx,false);
+  GetSS(tx);
+  customer_row *cust = NULL;
+  if(pid != current_partition) {
+    cust = (customer_row *)RemoteRow(c,0,CUST,makeCustomerKey(c_w_id,c_d_id,c_id),pid);
+    if(!PrefetchAllRemote(tx,timestamp + DEFAULT_INTERVAL)) {
+      ClearRwset(tx);
+      return TX_ABORT;
+    }
+  }
+
+  bool ok = true;
+  {
+    RTMRegion rtm(&c->w->prof);
+    if(!rtm.Aborted()) {
+      char *ware,*dist;
+      if(by_name)
+	c_id = CustomerByName(tx,c_w_id,c_d_id,last);
+      ok = c_id != 0 && LocalRow(tx,WARE,w_id,true,&ware) &&
+	LocalRow(tx,DIST,makeDistrictKey(w_id,d_id),true,&dist);
+      if(ok && pid == current_partition)
+	ok = LocalRow(tx,CUST,makeCustomerKey(c_w_id,c_d_id,c_id),true,(char **)&cust) && cust != NULL;
+      if(!ok) {
+	rtm.Abort();
+      } else {
+	((warehouse_row *)ware)->w_ytd += amount;
+	((district_row *)dist)->d_ytd += amount;
+	cust->c_balance -= amount;
+	cust->c_ytd_payment += amount;
+	cust->c_payment_cnt++;
+	if(strcmp(cust->c_credit,"BC") == 0) {
+	  char info[64];
+	  int len = snprintf(info,sizeof(info),"%d %d %d %d %d %.2f ",c_id,c_d_id,c_w_id,d_id,w_id,amount);
+	  memmove(cust->c_data + len,cust->c_data,sizeof(cust->c_data) - len - 1);
+	  memcpy(cust->c_data,info,len);
+	}
+	history_row hist;
+	memset(&hist,0,sizeof(hist));
+	hist.h_c_id = c_id;
+	hist.h_c_d_id = c_d_id;
+	hist.h_c_w_id = c_w_id;
+	hist.h_d_id = d_id;
+	hist.h_w_id = w_id;
+	hist.h_date = timestamp / 1000000000;
+	hist.h_amount = amount;
+	//unique over the threads of the partition, above the loaded keys
+	uint64_t hkey = (1ULL << 63) | ((uint64_t)c->w->t_id << 48) | c->w->hist_seq++;
+	Add(tx,HIST,hkey,(uint64_t *)&hist);
+      }
+    }
+    ok = !rtm.Aborted();
+  }
+  if(!ok) {
+    ReleaseAllRemote(tx);
+    ClearRwset(tx);
+    return TX_ABORT;
+  }
+  RemoteWriteBack(tx);
+  End(tx);
+  return TX_COMMIT;
+}
+
+int OrderStatus(tpcc_ctx *c) {
+  DBSSTX *tx = c->tx;
+  int w_id = c->home;
+  int d_id = RandomNumber(&c->r,1,DIST_PER_WARE);
+  bool by_name = RandomNumber(&c->r,1,100) <= 60;
+  int c_id = NonUniformRandom(&c->r,1023,C_ID,1,CUST_PER_DIST);
+  int last = NonUniformRandom(&c->r,255,C_LAST_RUN,0,999);
+
+  Begin(tx,true);
+  bool ok = true;
+  {
+    RTMRegion rtm(&c->w->prof);
+    if(!rtm.Aborted()) {
+      char *cust,*order = NULL;
+      if(by_name)
+	c_id = CustomerByName(tx,w_id,d_id,last);
+      ok = c_id != 0 && LocalRow(tx,CUST,makeCustomerKey(w_id,d_id,c_id),false,&cust);
+      if(!ok) {
+	rtm.Abort();
+      } else {
+	//the last order of the customer is the first entry a backward scan
+	//from the next customer meets
+	uint64_t key;
+	uint64_t *val;
+	DBSSTX_Iterator *iter = GetIterator(tx,ORDER_INDEX);
+	Seek(iter,makeOrderIndexKey(w_id,d_id,c_id + 1,0));
+	if(Valid(iter))
+	  Prev(iter);
+	else
+	  SeekToLast(iter);
+	int n = PrevBatch(iter,makeOrderIndexKey(w_id,d_id,c_id,0),1,&key,&val);
+	delete iter;
+	if(n == 1) {
+	  int o_id = key & 0xffffffff;
+	  GetAt(tx,ORDE,makeOrderKey(w_id,d_id,o_id),(uint64_t **)&order,false,NULL);
+	  //the lines of an order are consecutive in ORLI
+	  uint64_t keys[MAX_OL_CNT];
+	  uint64_t *lines[MAX_OL_CNT];
+	  iter = GetIterator(tx,ORLI);
+	  Seek(iter,makeOrderLineKey(w_id,d_id,o_id,1));
+	  n = NextBatch(iter,makeOrderLineKey(w_id,d_id,o_id + 1,0),MAX_OL_CNT,keys,lines);
+	  delete iter;
+	  for(int l = 0;l < n;++l)
+	    c->w->results += ((order_line_row *)lines[l])->ol_amount;
+	}
+      }
+    }
+    ok = !rtm.Aborted();
+  }
+  End(tx);
+  return ok ? TX_COMMIT : TX_ABORT;
+}
+
+//the oldest undelivered order of a district, false on a conflict
+static bool DeliverDistrict(tpcc_ctx *c,int w_id,int d_id,int carrier,uint32_t now) {
+  DBSSTX *tx = c->tx;
+  Begin(tx,false);
+  GetSS(tx);
+  bool ok = true;
+  {
+    RTMRegion rtm(&c->w->prof);
+    if(!rtm.Aborted()) {
+      DBSSTX_Iterator *iter = GetIterator(tx,NEWO);
+      Seek(iter,makeOrderKey(w_id,d_id,0));
+      uint64_t no_key = 0;
+      if(Valid(iter) && Key(iter) < makeOrderKey(w_id,d_id + 1,0))
+	no_key = Key(iter);
+      delete iter;
+
+      if(no_key != 0) {
+	int o_id = no_key & 0xffffffff;
+	char *order,*cust = NULL;
+	ok = LocalRow(tx,ORDE,no_key,true,&order) && order != NULL &&
+	  LocalRow(tx,CUST,makeCustomerKey(w_id,d_id,((order_row *)order)->o_c_id),true,&cust);
+	if(!ok) {
+	  rtm.Abort();
+	} else {
+	  Delete(tx,NEWO,no_key);
+	  ((order_row *)order)->o_carrier_id = carrier;
+	  float total = 0;
+	  for(int l = 1;l <= ((order_row *)order)->o_ol_cnt;++l) {
+	    order_line_row *line;
+	    if(!GetAt(tx,ORLI,makeOrderLineKey(w_id,d_id,o_id,l),(uint64_t **)&line,true,NULL))
+	      continue;
+	    line->ol_delivery_d = now;
+	    total += line->ol_amount;
+	  }
+	  ((customer_row *)cust)->c_balance += total;
+	  ((customer_row *)cust)->c_delivery_cnt++;
+	}
+      }
+    }
+    ok = !rtm.Aborted();
+  }
+  End(tx);
+  return ok;
+}
+
+//each district is delivered by its own transaction as the spec allows, a
+//conflict only retries the district
+int Delivery(tpcc_ctx *c) {
+  int carrier = RandomNumber(&c->r,1,10);
+  uint32_t now = timestamp / 1000000000;
+  for(int d_id = 1;d_id <= DIST_PER_WARE;++d_id) {
+    while(!DeliverDistrict(c,c->home,d_id,carrier,now))
+      c->w->stats->aborts[TX_DELIVERY]++;
+  }
+  return TX_COMMIT;
+}
+
+//Stock-Level only needs read committed, the rows are read outside of an RTM
+//region and the counts may be off under concurrent New-Orders
+int StockLevel(tpcc_ctx *c) {
+  DBSSTX *tx = c->tx;
+  int w_id = c->home;
+  int d_id = RandomNumber(&c->r,1,DIST_PER_WARE);
+  int threshold = RandomNumber(&c->r,10,20);
+
+  Begin(tx,true);
+  char *dist;
+  GetAt(tx,DIST,makeDistrictKey(w_id,d_id),(uint64_t **)&dist,false,NULL);
+  int next = ((district_row *)dist)->d_next_o_id;
+
+  //the lines of the last orders are consecutive in ORLI, one batch scan
+  //reads all of them
+  uint64_t keys[STOCK_LEVEL_ORDERS * MAX_OL_CNT];
+  uint64_t *lines[STOCK_LEVEL_ORDERS * MAX_OL_CNT];
+  DBSSTX_Iterator *iter = GetIterator(tx,ORLI);
+  Seek(iter,makeOrderLineKey(w_id,d_id,next - STOCK_LEVEL_ORDERS,0));
+  int cnt = NextBatch(iter,makeOrderLineKey(w_id,d_id,next,0),STOCK_LEVEL_ORDERS * MAX_OL_CNT,keys,lines);
+  delete iter;
+
+  int items[STOCK_LEVEL_ORDERS * MAX_OL_CNT];
+  int n = 0;
+  for(int l = 0;l < cnt;++l) {
+    int id = ((order_line_row *)lines[l])->ol_i_id;
+    int i = 0;
+    while(i < n && items[i] != id)
+      i++;
+    if(i == n)
+      items[n++] = id;
+  }
+  int low = 0;
+  for(int i = 0;i < n;++i) {
+    stock_row *stock;
+    if(GetAt(tx,STOC,makeStockKey(w_id,items[i]),(uint64_t **)&stock,false,NULL) &&
+       stock->s_quantity < threshold)
+      low++;
+  }
+  c->w->results += low;
+  End(tx);
+  return TX_COMMIT;
+}
+
+typedef int (*tx_func)(tpcc_ctx *c);
+const tx_func tx_funcs[TX_TYPES] = {NewOrder,Payment,OrderStatus,Delivery,StockLevel};
+
+void TpccSlot(DBSSTX *tx,int cor_id,void *arg) {
+  tpcc_worker *w = (tpcc_worker *)arg;
+  tpcc_ctx *c = new tpcc_ctx;
+  c->w = w;
+  c->tx = tx;
+  RandomInit(&c->r,(current_partition * nthreads + w->t_id) * MAX_COR + cor_id);
+  c->home = current_partition * ware_per_part + 1 + (w->t_id * interleave + cor_id) % ware_per_part;
+
+  while(running) {
+    int type = PickType(&c->r,tx_mix);
+    uint64_t start = now_ns();
+    int ret;
+    //the inputs are drawn again on a retry
+    while((ret = tx_funcs[type](c)) == TX_ABORT)
+      w->stats->aborts[type]++;
+    if(ret == TX_ROLLBACK) {
+      w->stats->rollbacks++;
+      continue;
+    }
+    w->stats->commits[type]++;
+    LatencyHist_record(&w->stats->hist[type],now_ns() - start);
+  }
+  delete c;
+}
+
+void *WorkerThread(void *arg) {
+  tpcc_worker *w = (tpcc_worker *)arg;
+  RunInterleaved(tables,rdma,w->t_id,interleave,TpccSlot,w);
+  return NULL;
+}
+
+void usage() {
+  fprintf(stderr,"usage: tpcc <partition> <partitions> [peer list] [options]\n");
+  fprintf(stderr,"  -thr=N        worker threads (default 1)\n");
+  fprintf(stderr,"  -w=N          warehouses per partition (default 1)\n");
+  fprintf(stderr,"  -k=N          interleaved transactions per thread (default 1)\n");
+  fprintf(stderr,"  -remote-no=N  %% of New-Order lines from another warehouse (default 1)\n");
+  fprintf(stderr,"  -remote-pay=N %% of Payments for another warehouse (default 15)\n");
+  fprintf(stderr,"  -items=N      items, less than %d for small hosts (default)\n",NUM_ITEMS);
+  fprintf(stderr,"  -dur=N        seconds (default 10)\n");
+  fprintf(stderr,"  -soft         partitions are processes of this host\n");
+  exit(1);
+}
+
+int main(int argc,char **argv) {
+  const char *peers = NULL;
+  int positional = 0;
+  for(int i = 1;i < argc;i++) {
+    int n;
+    char junk;
+    if(sscanf(argv[i],"-thr=%d%c",&n,&junk) == 1) {
+      nthreads = n;
+    }else if(sscanf(argv[i],"-w=%d%c",&n,&junk) == 1) {
+      ware_per_part = n;
+    }else if(sscanf(argv[i],"-k=%d%c",&n,&junk) == 1) {
+      interleave = n;
+    }else if(sscanf(argv[i],"-remote-no=%d%c",&n,&junk) == 1) {
+      remote_new_order = n;
+    }else if(sscanf(argv[i],"-remote-pay=%d%c",&n,&junk) == 1) {
+      remote_payment = n;
+    }else if(sscanf(argv[i],"-items=%d%c",&n,&junk) == 1) {
+      num_items = n;
+    }else if(sscanf(argv[i],"-dur=%d%c",&n,&junk) == 1) {
+      duration = n;
+    }else if(strcmp(argv[i],"-soft") == 0) {
+      soft = true;
+    }else if(argv[i][0] == '-') {
+      usage();
+    }else if(positional == 0) {
+      current_partition = atoi(argv[i]);
+      positional++;
+    }else if(positional == 1) {
+      total_partition = atoi(argv[i]);
+      positional++;
+    }else {
+      peers = argv[i];
+    }
+  }
+  if(positional < 2 || current_partition >= total_partition || total_partition > MAX_RPC_PARTITION ||
+     ware_per_part < 1 || interleave < 1 || interleave > MAX_COR || num_items < 1 || num_items > NUM_ITEMS)
+    usage();
+
+  StartTimestamp();
+
+  tables = new RAWTables(nthreads,BENCH_TPCC);
+  //remote Payments lock customers with one-sided operations
+  tables->rdma_table[CUST] = true;
+  tables->rdmatablesize[CUST] = HashSize(ware_per_part * DIST_PER_WARE * CUST_PER_DIST);
+  tables->rdmatablesize[WARE] = HashSize(ware_per_part);
+  tables->rdmatablesize[DIST] = HashSize(ware_per_part * DIST_PER_WARE);
+  tables->rdmatablesize[STOC] = HashSize(ware_per_part * num_items);
+
+  BenchRegion(&env,tables,"tpcc",soft);
+
+  tables->AddSchema(WARE,sizeof(uint64_t),0,0,sizeof(warehouse_row),true);
+  tables->AddSchema(DIST,sizeof(uint64_t),0,0,sizeof(district_row),true);
+  tables->AddSchema(CUST,sizeof(uint64_t),0,0,sizeof(customer_row),true);
+  tables->AddSchema(HIST,sizeof(uint64_t),0,0,sizeof(history_row),false);
+  tables->AddSchema(NEWO,sizeof(uint64_t),0,0,sizeof(new_order_row),false);
+  tables->AddSchema(ORDE,sizeof(uint64_t),0,0,sizeof(order_row),false);
+  tables->AddSchema(ORLI,sizeof(uint64_t),0,0,sizeof(order_line_row),false);
+  tables->AddSchema(ITEM,sizeof(uint64_t),0,0,sizeof(item_row),true);
+  tables->AddSchema(STOC,sizeof(uint64_t),0,0,sizeof(stock_row),true);
+  tables->AddSchema(ORDER_INDEX,sizeof(uint64_t),0,0,sizeof(index_row),false);
+  tables->AddSchema(CUST_INDEX,sizeof(uint64_t),0,0,sizeof(index_row),false);
+
+  uint64_t start = now_ns();
+  pthread_t *threads = new pthread_t[nthreads];
+  load_arg *largs = new load_arg[nthreads];
+  for(int i = 0;i < nthreads;++i) {
+    largs[i].id = i;
+    pthread_create(&threads[i],NULL,LoadThread,&largs[i]);
+  }
+  for(int i = 0;i < nthreads;++i)
+    pthread_join(threads[i],NULL);
+  fprintf(stdout,"loaded %d warehouses in %.1f s\n",ware_per_part,(now_ns() - start) / 1e9);
+
+  BenchConnect(&env,tables,peers);
+  rdma = env.rdma;
+
+  tpcc_worker *workers = new tpcc_worker[nthreads];
+  running = true;
+  for(int i = 0;i < nthreads;++i) {
+    workers[i].t_id = i;
+    workers[i].hist_seq = 0;
+    workers[i].results = 0;
+    workers[i].stats = new bench_stats;
+    memset(workers[i].stats,0,sizeof(bench_stats));
+    pthread_create(&threads[i],NULL,WorkerThread,&workers[i]);
+  }
+  sleep(duration);
+  running = false;
+  for(int i = 0;i < nthreads;++i)
+    pthread_join(threads[i],NULL);
+  //no partition serves remote operations after this
+  Barrier(&env);
+
+  bench_stats total;
+  memset(&total,0,sizeof(total));
+  for(int i = 0;i < nthreads;++i)
+    BenchStats_merge(&total,workers[i].stats);
+  if(BenchGather(&env,&total)) {
+    printf("%d partitions x %d warehouses, %d threads x %d interleaved, %d s\n",
+	   (int)total_partition,ware_per_part,(int)nthreads,interleave,duration);
+    printf("tpmC %.0f\n",total.commits[TX_NEW_ORDER] * 60.0 / duration);
+    BenchPrint(&total,TX_TYPES,tx_names,duration);
+  }
+  BenchFinish(&env);
+  return 0;
+}
@@ -0,0 +1,182 @@
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA for speedy distributed
+ *  in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS), Shanghai Jiao Tong University
+ *     All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+/*
+ *  TPC-C rows and keys. A record of a table is META_LENGTH bytes of lock
+ *  and lease word followed by the row. Warehouse ids start at 1 and are
+ *  split evenly over the partitions.
+ */
+
+#ifndef DRTM_BENCH_TPCC_H
+#define DRTM_BENCH_TPCC_H
+
+#include <stdint.h>
+
+#include "memtable/rawtables.h"
+
+#define DIST_PER_WARE   10
+#define CUST_PER_DIST   3000
+#define NUM_ITEMS       100000
+#define NEW_ORDER_START 2101 //the last 900 orders of a district are not delivered
+#define MAX_OL_CNT      15
+#define STOCK_LEVEL_ORDERS 20
+
+//transaction types, also the index of their statistics
+#define TX_NEW_ORDER    0
+#define TX_PAYMENT      1
+#define TX_ORDER_STATUS 2
+#define TX_DELIVERY     3
+#define TX_STOCK_LEVEL  4
+#define TX_TYPES        5
+
+typedef struct warehouse_row {
+  float w_tax;
+  float w_ytd;
+  char w_name[11];
+  char w_street_1[21];
+  char w_street_2[21];
+  char w_city[21];
+  char w_state[3];
+  char w_zip[10];
+} warehouse_row;
+
+typedef struct district_row {
+  float d_tax;
+  float d_ytd;
+  int32_t d_next_o_id;
+  char d_name[11];
+  char d_street_1[21];
+  char d_street_2[21];
+  char d_city[21];
+  char d_state[3];
+  char d_zip[10];
+} district_row;
+
+typedef struct customer_row {
+  float c_discount;
+  float c_credit_lim;
+  float c_balance;
+  float c_ytd_payment;
+  int32_t c_payment_cnt;
+  int32_t c_delivery_cnt;
+  uint32_t c_since;
+  char c_credit[3];
+  char c_last[17];
+  char c_first[17];
+  char c_middle[3];
+  char c_street_1[21];
+  char c_street_2[21];
+  char c_city[21];
+  char c_state[3];
+  char c_zip[10];
+  char c_phone[17];
+  char c_data[501];
+} customer_row;
+
+typedef struct history_row {
+  int32_t h_c_id;
+  int32_t h_c_d_id;
+  int32_t h_c_w_id;
+  int32_t h_d_id;
+  int32_t h_w_id;
+  uint32_t h_date;
+  float h_amount;
+  char h_data[25];
+} history_row;
+
+typedef struct new_order_row {
+  int32_t no_dummy;
+} new_order_row;
+
+typedef struct order_row {
+  int32_t o_c_id;
+  int32_t o_carrier_id;
+  int32_t o_ol_cnt;
+  int32_t o_all_local;
+  uint32_t o_entry_d;
+} order_row;
+
+typedef struct order_line_row {
+  int32_t ol_i_id;
+  int32_t ol_supply_w_id;
+  int32_t ol_quantity;
+  uint32_t ol_delivery_d;
+  float ol_amount;
+  char ol_dist_info[25];
+} order_line_row;
+
+typedef struct item_row {
+  int32_t i_im_id;
+  float i_price;
+  char i_name[25];
+  char i_data[51];
+} item_row;
+
+typedef struct stock_row {
+  int32_t s_quantity;
+  int32_t s_ytd;
+  int32_t s_order_cnt;
+  int32_t s_remote_cnt;
+  char s_dist[DIST_PER_WARE][25];
+  char s_data[51];
+} stock_row;
+
+//ORDER_INDEX and CUST_INDEX only need their keys
+typedef struct index_row {
+  int32_t id;
+} index_row;
+
+inline uint64_t makeDistrictKey(int w_id,int d_id) {
+  return (uint64_t)w_id * DIST_PER_WARE + d_id;
+}
+
+inline uint64_t makeCustomerKey(int w_id,int d_id,int c_id) {
+  return makeDistrictKey(w_id,d_id) * CUST_PER_DIST + c_id;
+}
+
+//orders of a district are consecutive and ordered by id
+inline uint64_t makeOrderKey(int w_id,int d_id,int o_id) {
+  return (makeDistrictKey(w_id,d_id) << 32) | (uint32_t)o_id;
+}
+
+inline uint64_t makeOrderLineKey(int w_id,int d_id,int o_id,int number) {
+  return (makeOrderKey(w_id,d_id,o_id) << 4) | number;
+}
+
+inline uint64_t makeStockKey(int w_id,int i_id) {
+  return (uint64_t)w_id * NUM_ITEMS + i_id;
+}
+
+//the orders of a customer, the last one sorts last
+inline uint64_t makeOrderIndexKey(int w_id,int d_id,int c_id,int o_id) {
+  return (makeCustomerKey(w_id,d_id,c_id) << 32) | (uint32_t)o_id;
+}
+
+//customers of a district with the same last name, c_last is generated from a
+//number below 1000 so the number stands for the name
+inline uint64_t makeCustIndexKey(int w_id,int d_id,int last,int c_id) {
+  return ((makeDistrictKey(w_id,d_id) * 1000 + last) << 12) | c_id;
+}
+
+#endif
@@ -30,6 +30,7 @@
 
 #include "c_std/string/string.h"
 #include "dbsstx.h"
+#include "microbench/rdma/rdma_coroutine.h"
 #include <utility>
 
 #include <iostream>
@@ -65,10 +66,20 @@
 
   DBSSTX* DBSSTX_new(RAWTables* store,RdmaResource *r,int t_id)
   {
+    return DBSSTX_new(store,r,t_id,NULL,0);
+  }
+
+  DBSSTX* DBSSTX_new(RAWTables* store,RdmaResource *r,int t_id,RdmaScheduler *s,int cor)
+  {
+    assert(cor < MAX_COR);
     DBSSTX* dbsstx = (DBSSTX*)malloc(sizeof(DBSSTX));
     dbsstx->txdb_ = store;
     dbsstx->rdma = r;
     dbsstx->thread_id = t_id;
+    dbsstx->sched = s;
+    dbsstx->cor_id = cor;
+    //the coroutines of a thread share its pool
+    r->InitBufPool(t_id,MSG_RESERVED);
     /*
     cache_miss=0;
     cache_hit=0;
@@ -79,6 +90,10 @@
     local_cas=0;*/
     //VECTOR,MAP 的初始化 WEIGAI
     rw_set.reserve(15); //WEIGAI VECTOR
+    for(int i = 0;i < MAX_RPC_PARTITION;++i) {
+      ((rpc_batch_header *)dbsstx->GetRpcBuf(i))->count = 0;
+      dbsstx->rpc_reply_cnt[i] = 0;
+    }
     lastsn = GetLocalSS(txdb_->ssman_);
     return dbsstx;
   }
@@ -205,7 +220,8 @@
 #elif USING_HASH_EXT
       hashext_travel(item);
 #else
-      cuckoo_travel(item);
+      if(!cuckoo_travel(item))
+	return 0;
 #endif
     }
     return item.loc;
@@ -234,7 +250,8 @@
 #elif USING_HASH_EXT
       hashext_travel(item);
 #else
-      cuckoo_travel(item);
+      if(!cuckoo_travel(item))
+	return 0;
 #endif
     }
 
@@ -265,6 +282,7 @@
     item.pid = _pid;
     item.addr= addr;
     item.ro = true;
+    item.locked = false;
 
     rw_set.push_back(item);
   }
@@ -277,6 +295,7 @@
     item.pid = _pid;
     item.addr= addr;
     item.ro = true;
+    item.locked = false;
 
     rw_set.push_back(item);
   }
@@ -290,6 +309,7 @@
     item.pid = _pid;
     item.addr= addr;
     item.ro = false;
+    item.locked = false;
 
     rw_set.push_back(item);
   }
@@ -302,6 +322,7 @@
     item.pid = _pid;
     item.addr= addr;
     item.ro = false;
+    item.locked = false;
 
     rw_set.push_back(item);
   }
@@ -310,7 +331,7 @@
     if(item.pid == current_partition){ // local travel
       uint64_t index;
       uint64_t loc;
-      uint64_t *local_buffer = (uint64_t *)rdma->GetMsgAddr(thread_id);
+      uint64_t *local_buffer = (uint64_t *)GetMsgBuf();
       index = txdb_->rdmachainhash[item.tableid]->GetHash(item.key);
       while(true){
         loc = index * txdb_->rdmachainhash[item.tableid]->slotsize;
@@ -329,11 +350,11 @@
     } else {
       uint64_t index;
       uint64_t loc;
-      uint64_t *local_buffer = (uint64_t *)rdma->GetMsgAddr(thread_id);
+      uint64_t *local_buffer = (uint64_t *)GetMsgBuf();
       index = txdb_->rdmachainhash[item.tableid]->GetHash(item.key);
       while(true){
 	loc = index * txdb_->rdmachainhash[item.tableid]->slotsize + txdb_->rdma_off_mapping[item.tableid] ;
-        rdma->RdmaRead(thread_id,item.pid,(char *)local_buffer,sizeof(RdmaChainHash::RdmaArrayNode),loc  );
+        RemoteRead(item.pid,(char *)local_buffer,sizeof(RdmaChainHash::RdmaArrayNode),loc  );
 
 	//        rdma_travel++;
         RdmaChainHash::RdmaArrayNode* node =  (RdmaChainHash::RdmaArrayNode *) local_buffer;
@@ -376,10 +397,10 @@
       }
     } else {
       uint64_t index;
-      uint64_t *local_buffer = (uint64_t *)rdma->GetMsgAddr(thread_id);
+      uint64_t *local_buffer = (uint64_t *)GetMsgBuf();
       index = txdb_->rdmahashext[item.tableid]->GetHash(item.key);
       uint64_t loc = txdb_->rdmahashext[item.tableid]->getHeaderNode_loc(index)+txdb_->rdma_off_mapping[item.tableid];
-      rdma->RdmaRead(thread_id,item.pid,(char *)local_buffer,sizeof(RdmaHashExt::HeaderNode),loc);
+      RemoteRead(item.pid,(char *)local_buffer,sizeof(RdmaHashExt::HeaderNode),loc);
       RdmaHashExt::HeaderNode* node= (RdmaHashExt::HeaderNode*)local_buffer;
       while(true){
 	for(int i=0;i<CLUSTER_H;i++){
@@ -392,7 +413,7 @@
 	}
 	if(node->next !=NULL){
 	  loc = txdb_->rdmahashext[item.tableid]->getHeaderNode_loc(node->next) + txdb_->rdma_off_mapping[item.tableid];
-	  rdma->RdmaRead(thread_id,item.pid,(char *)local_buffer,sizeof(RdmaHashExt::HeaderNode),loc);
+	  RemoteRead(item.pid,(char *)local_buffer,sizeof(RdmaHashExt::HeaderNode),loc);
 	  node= (RdmaHashExt::HeaderNode*)local_buffer;
 	}
 	else{
@@ -404,12 +425,12 @@
     }
   }
 
-  void DBSSTX::cuckoo_travel(rwset_item &item) {
+  bool DBSSTX::cuckoo_travel(rwset_item &item) {
     if(item.pid == current_partition){ // local travel
 
       uint64_t index[2];
       uint64_t loc;
-      uint64_t *local_buffer = (uint64_t *)rdma->GetMsgAddr(thread_id);
+      uint64_t *local_buffer = (uint64_t *)GetMsgBuf();
       index[0] = txdb_->rdmacuckoohash[item.tableid]->GetHash(item.key);
       index[1] = txdb_->rdmacuckoohash[item.tableid]->GetHash2(item.key);
       char success=false;
@@ -425,35 +446,45 @@
 	if(success)
 	  break;
       }
-      assert(success);
+      if(!success)
+	return false;
       item.loc=loc+ txdb_->rdma_off_mapping[item.tableid] ;
     } else {
       uint64_t index[2];
       uint64_t loc;
-      uint64_t *local_buffer = (uint64_t *)rdma->GetMsgAddr(thread_id);
+      uint64_t *local_buffer = (uint64_t *)GetMsgBuf();
       index[0] = txdb_->rdmacuckoohash[item.tableid]->GetHash(item.key);
       index[1] = txdb_->rdmacuckoohash[item.tableid]->GetHash2(item.key);
       char success=false;
-      for(int i=0;i<2;i++){
-	uint64_t read_length=txdb_->rdmacuckoohash[item.tableid]->bucketsize;
-	loc = index[i] * read_length  + txdb_->rdma_off_mapping[item.tableid] ;
-	rdma->RdmaRead(thread_id,item.pid,(char *)local_buffer,read_length,loc);
-	//      rdma_travel++;
-	for(int j=0;j<SLOT_PER_BUCKET;j++){
-	  RdmaCuckooHash::RdmaArrayNode* node =  ((RdmaCuckooHash::RdmaArrayNode *) local_buffer) +j;
-	  if(node->key==item.key){
-          loc  = txdb_->rdmacuckoohash[item.tableid]->get_dataloc(node->index);
-          loc += txdb_->rdma_off_mapping[item.tableid];
-          success=true;
-          break;
+      //A concurrent insert may move the key along its cuckoo path between
+      //the reads of the two buckets, or be writing the entry we read, which
+      //then fails its checksum. Both buckets are read again in either case.
+      for(int tries=0;!success && tries < CUCKOO_READ_RETRY;tries++){
+	for(int i=0;i<2 && !success;i++){
+	  uint64_t read_length=txdb_->rdmacuckoohash[item.tableid]->bucketsize;
+	  loc = index[i] * read_length  + txdb_->rdma_off_mapping[item.tableid] ;
+	  RemoteRead(item.pid,(char *)local_buffer,read_length,loc);
+	  //      rdma_travel++;
+	  for(int j=0;j<SLOT_PER_BUCKET;j++){
+	    RdmaCuckooHash::RdmaArrayNode* node =  ((RdmaCuckooHash::RdmaArrayNode *) local_buffer) +j;
+	    if(node->valid && node->key==item.key){
+	      if(!entry_ok(node))
+		break;
+	      loc  = txdb_->rdmacuckoohash[item.tableid]->get_dataloc(node->index);
+	      loc += txdb_->rdma_off_mapping[item.tableid];
+	      success=true;
+	      break;
+	    }
 	  }
 	}
-	if(success)
-	  break;
       }
-      assert(success);
+      //the key is gone, or kept moving under us: the caller aborts and the
+      //transaction runs again
+      if(!success)
+	return false;
       item.loc=loc;
     }
+    return true;
   }
 
   void DBSSTX::ReleaseAllLocal(){
@@ -467,8 +498,34 @@
   }
 
   void DBSSTX::RdmaFetchAdd ( uint64_t off,int pid,uint64_t value) {
-    uint64_t *local_buffer = (uint64_t*)rdma->GetMsgAddr(thread_id,2);
-    rdma->RdmaFetchAdd(thread_id,pid,(char *)local_buffer,value,off);
+    uint64_t *local_buffer = (uint64_t*)rdma->AcquireBuf(thread_id);
+    assert(local_buffer != NULL);
+    if(sched == NULL)
+      rdma->RdmaFetchAdd(thread_id,pid,(char *)local_buffer,value,off);
+    else
+      sched->FetchAdd(pid,(char *)local_buffer,value,off);
+    rdma->ReleaseBuf(thread_id,(char *)local_buffer);
+  }
+
+  int DBSSTX::RemoteRead(int pid,char *local,uint64_t size,uint64_t off) {
+    if(sched == NULL)
+      return rdma->RdmaRead(thread_id,pid,local,size,off);
+    sched->Read(pid,local,size,off);
+    return 0;
+  }
+
+  int DBSSTX::RemoteCmpSwap(int pid,char *local,uint64_t compare,uint64_t swap,uint64_t size,uint64_t off) {
+    if(sched == NULL)
+      return rdma->RdmaCmpSwap(thread_id,pid,local,compare,swap,size,off);
+    sched->CmpSwap(pid,local,compare,swap,off);
+    return 0;
+  }
+
+  int DBSSTX::RemoteOps(int pid,normal_op_req *reqs,int n) {
+    if(sched == NULL)
+      return rdma->RdmaOps(thread_id,pid,reqs,n);
+    sched->Wait(pid,rdma->PostOpsAsync(thread_id,pid,reqs,n));
+    return 0;
   }
 
   char DBSSTX::AllLeasesAreValid() {
@@ -499,17 +556,27 @@
     return true;
   }
 
-  void DBSSTX::PrefetchAllRemote(uint64_t endtime) {
+  bool DBSSTX::PrefetchAllRemote(uint64_t endtime) {
       sort(rw_set.begin(), rw_set.end(), _rw_item_cmp);
       for (int i = 0; i < rw_set.size(); ++i) {
+	bool found = true;
 	if (!rw_set[i].ro && rw_set[i].pid!=current_partition)
-	  Lock(rw_set[i]);
+	  found = Lock(rw_set[i]);
 	else if (rw_set[i].ro && rw_set[i].pid != current_partition)
-	  GetLease(rw_set[i], endtime);
+	  found = GetLease(rw_set[i], endtime);
+	if (!found) {
+	  //leases run out by themselves, only the locks are given back
+	  for (int j = 0; j < i; ++j) {
+	    if (!rw_set[j].ro && rw_set[j].pid!=current_partition)
+	      Release(rw_set[j],false);
+	  }
+	  return false;
+	}
       }
+      return true;
   }
 
-  void DBSSTX::GetLocalLease(int tableid,uint64_t key,uint64_t *loc, uint64_t endtime) {
+  bool DBSSTX::GetLocalLease(int tableid,uint64_t key,uint64_t *loc, uint64_t endtime) {
     rwset_item item;
 
     item.pid = current_partition;
@@ -518,12 +585,14 @@
     item.ro = true;
     item.addr = loc;
 
-    GetLease(item, endtime);
+    if(!GetLease(item, endtime))
+      return false;
     readonly_set.push_back(item);
+    return true;
   }
 
 
-  void DBSSTX::GetLease(rwset_item &item, uint64_t endtime) {
+  bool DBSSTX::GetLease(rwset_item &item, uint64_t endtime) {
 
     int pid = item.pid;
     int tableid = item.tableid;
@@ -546,7 +615,8 @@
 #elif USING_HASH_EXT
       hashext_travel(item);
 #else
-      cuckoo_travel(item);
+      if(!cuckoo_travel(item))
+	return false;
 #endif
     }
 
@@ -560,7 +630,7 @@
 
     uint64_t index;
     uint64_t loc = item.loc;
-    uint64_t *local_buffer = (uint64_t *) rdma->GetMsgAddr(thread_id);
+    uint64_t *local_buffer = (uint64_t *) GetMsgBuf();
 
     int count = 0;
     uint64_t init_flag = 0;
@@ -573,7 +643,7 @@
 	//to avoid deads
 	exit(0);
       }
-      rdma->RdmaCmpSwap(thread_id,pid,(char *)local_buffer, init_flag, endtime,sizeof(uint64_t),loc + TIME_OFFSET);
+      RemoteCmpSwap(pid,(char *)local_buffer, init_flag, endtime,sizeof(uint64_t),loc + TIME_OFFSET);
       uint64_t ret_flag = *local_buffer;
       if (ret_flag == init_flag) {
 	// successfully get the lease
@@ -591,14 +661,14 @@
 
     if (pid != current_partition) {
       int length = txdb_->schemas[item.tableid].vlen + VALUE_OFFSET;
-      rdma->RdmaRead(thread_id,pid,(char *)local_buffer, length, loc);
+      RemoteRead(pid,(char *)local_buffer, length, loc);
       //          rdma_read++;
       memcpy((char *)item.addr,(char *)local_buffer,length);
     }
-    return;
+    return true;
   }
 
-  void DBSSTX::Lock(rwset_item &item) {
+  bool DBSSTX::Lock(rwset_item &item) {
     int pid = item.pid;
     int tableid = item.tableid;
     uint64_t key = item.key;
@@ -621,7 +691,8 @@
 #elif USING_HASH_EXT
     hashext_travel(item);
 #else
-    cuckoo_travel(item);
+    if(!cuckoo_travel(item))
+      return false;
 #endif
     }
 
@@ -635,7 +706,7 @@
 
     uint64_t index;
     uint64_t loc  = item.loc;
-    uint64_t *local_buffer = (uint64_t *)rdma->GetMsgAddr(thread_id);
+    uint64_t *local_buffer = (uint64_t *)GetMsgBuf();
     int ret;
 
     int count = 0;
@@ -651,7 +722,7 @@
         exit(0);
       }
       int ret;
-      ret = rdma->RdmaCmpSwap(thread_id,pid,(char *)local_buffer, init_flag, (1UL << 63),sizeof(uint64_t),loc + TIME_OFFSET);
+      ret = RemoteCmpSwap(pid,(char *)local_buffer, init_flag, (1UL << 63),sizeof(uint64_t),loc + TIME_OFFSET);
       assert(ret == 0);
       /*
       if(pid != current_partition)
@@ -680,13 +751,13 @@
     //if remote,read the value
     if(pid != current_partition) {
       int length = txdb_->schemas[item.tableid].vlen;
-      ret = rdma->RdmaRead(thread_id,pid,(char *)local_buffer + VALUE_OFFSET,length,loc + VALUE_OFFSET);
+      ret = RemoteRead(pid,(char *)local_buffer + VALUE_OFFSET,length,loc + VALUE_OFFSET);
       assert(ret == 0);
       //      rdma_read++;
       //!!Donot write the meta data of the item!this is important
       memcpy((char *)item.addr + VALUE_OFFSET,(char *)local_buffer + VALUE_OFFSET,length);
     }
-    return;
+    return true;
   }
 
   void DBSSTX::Release(rwset_item &item,char flag) {
@@ -698,39 +769,31 @@
 
     //    uint64_t loc = RdmaArray::GetHash(key) * txdb_->rdmastore->slotsize + sizeof(RdmaArray::RdmaArrayNode);
     uint64_t loc = item.loc;
-    uint64_t *local_buffer = (uint64_t *)rdma->GetMsgAddr(thread_id,0);
+    //lock word first, then room to stage the value
+    uint64_t *local_buffer = (uint64_t *)rdma->AcquireBuf(thread_id);
+    assert(local_buffer != NULL);
 
 
     if(flag && pid != current_partition) {
-      //write back
+      //write back, then clear the lock with a plain write: we hold the lock so
+      //the CAS is not needed, and writes of one QP are placed in order, so the
+      //lock is never seen free before the new value
       int length = txdb_->schemas[item.tableid].vlen;
-      memcpy((char *)local_buffer + VALUE_OFFSET,(char *)item.addr + VALUE_OFFSET,length);
-      //      assert(rdma->RdmaWrite(thread_id,pid,(char *)local_buffer + VALUE_OFFSET,length,loc + VALUE_OFFSET) == 0);
-      uint64_t *lock_buffer = (uint64_t *)rdma->GetMsgAddr(thread_id,1);
       normal_op_req reqs[2];
-      reqs[0].opcode = IBV_WR_RDMA_WRITE;
-      reqs[0].local_buf = (char *)local_buffer + VALUE_OFFSET;
-      reqs[0].size    = length;
-      reqs[0].remote_offset = loc + VALUE_OFFSET;
-
-      reqs[1].opcode = IBV_WR_ATOMIC_CMP_AND_SWP;
-      reqs[1].local_buf = (char *)lock_buffer;
-      reqs[1].size = sizeof(uint64_t);
-      reqs[1].remote_offset = loc + TIME_OFFSET;
-      reqs[1].compare_and_add = (1UL << 63);
-      reqs[1].swap = 0;
-
-      ret = rdma->RdmaOps(thread_id,pid,reqs,2);
+      int n = rdma->FillWritePair(thread_id,pid,reqs,(char *)item.addr + VALUE_OFFSET,length,
+				  loc + VALUE_OFFSET,0,loc + TIME_OFFSET,(char *)local_buffer);
+      ret = RemoteOps(pid,reqs,n);
       assert(ret == 0);
 
     }else {
       //release lock
-      ret = rdma->RdmaCmpSwap(thread_id,pid,(char *)local_buffer,(1UL << 63),0,sizeof(uint64_t),loc + TIME_OFFSET);
+      ret = RemoteCmpSwap(pid,(char *)local_buffer,(1UL << 63),0,sizeof(uint64_t),loc + TIME_OFFSET);
       assert(ret == 0);
       if(*local_buffer != (1UL << 63))
 	fprintf(stderr,"key: %lld val: %ulld\n",key,*local_buffer);
       assert(*local_buffer == (1UL << 63));
     }
+    rdma->ReleaseBuf(thread_id,(char *)local_buffer);
     return;
   }
 
@@ -750,7 +813,7 @@
 
   }
 
-  void DBSSTX::Fallback_LockAll(SpinLock** sl, int numOfLocks, uint64_t endtime) {
+  bool DBSSTX::Fallback_LockAll(SpinLock** sl, int numOfLocks, uint64_t endtime) {
     // release all locks
     int i = 0, j = 0;
 
@@ -773,16 +836,24 @@
       // record the oldest lease at the same time
       uint64_t oldest_lease = UINT_MAX;
       for (int i = 0; i < rw_set.size(); ++i) {
+	bool found = true;
 	if (rw_set[i].ro) {
 	  uint64_t *value = rw_set[i].addr;
 	  uint64_t lease = *(uint64_t *)((uint64_t)value + TIME_OFFSET);
 	  if (!VALID(lease)) {
-	    GetLease(rw_set[i], endtime);
+	    found = GetLease(rw_set[i], endtime);
 	    lease = *(uint64_t *)((uint64_t)value + TIME_OFFSET);
 	  }
 	  if (lease < oldest_lease) oldest_lease = lease;
 	} else {
-	  Lock(rw_set[i]);
+	  found = Lock(rw_set[i]);
+	}
+	if (!found) {
+	  for (int j = 0; j < i; ++j) {
+	    if (!rw_set[j].ro)
+	      Release(rw_set[j],false);
+	  }
+	  return false;
 	}
       }
 
@@ -804,6 +875,7 @@
 	sl[i]->Lock();
       }
     }
+    return true;
   }
 
   void DBSSTX::ClearRwset(){
@@ -812,6 +884,9 @@
 
   void DBSSTX::LocalLockSpin(char *loc) {
     while(!__sync_char_compare_and_swap((uint64_t *)(loc + TIME_OFFSET),0,1UL<<63)) {
+      //the holder may be another transaction of this thread
+      if(sched != NULL)
+        sched->Yield();
     }
   }
 
@@ -864,23 +939,96 @@
     return false;
   }
 
-  bool DBSSTX::ReleaseLockRemote(rwset_item item,Network_Node *node) {
+  //Requests are appended to a per destination batch living in our registered
+  //message buffer and only sent on RpcFlush, so a transaction touching several
+  //records of one partition pays one round trip.
+  int DBSSTX::RpcAppend(int pid,const char *req,int size,const char *payload,int length) {
 
-    msg_struct unlock_msg;
-    unlock_msg.tableid = item.tableid;
-    unlock_msg.key = item.key;
-    unlock_msg.optype=RELEASE_REQ;
+    assert(pid < MAX_RPC_PARTITION);
+    char *buf = GetRpcBuf(pid);
+    rpc_batch_header *header = (rpc_batch_header *)buf;
+    if(header->count == 0)
+      header->length = sizeof(rpc_batch_header);
 
-    std::string temp((char*)(&unlock_msg),sizeof(unlock_msg));
+    int total = RPC_ALIGN(size + length);
+    assert(header->count < RPC_MAX_BATCH);
+    assert(header->length + total <= RPC_BUF_SIZE);
 
-    int length = ((item.addr == NULL)? 0:(txdb_->schemas[item.tableid].vlen + META_LENGTH));
+    memcpy(buf + header->length,req,size);
     if(length)
-      temp+=std::string((char *)item.addr,length);
+      memcpy(buf + header->length + size,payload,length);
+    header->length += total;
+    return header->count++;
+  }
 
-    node->Send(item.pid,nthreads,temp);
-    temp = node->Recv().substr(2);
+  int DBSSTX::RpcAppend(int pid,int optype,int tableid,uint64_t key,const char *payload,int length) {
+    msg_struct msg;
+    msg.tableid = tableid;
+    msg.optype = optype;
+    msg.key = key;
+    msg.length = length;
+    return RpcAppend(pid,(char *)&msg,sizeof(msg),payload,length);
+  }
+
+  void DBSSTX::RpcFlush(Network_Node *node) {
+
+    int pending = 0;
+    for(int pid = 0;pid < total_partition;++pid) {
+      rpc_batch_header *header = (rpc_batch_header *)GetRpcBuf(pid);
+      rpc_reply_cnt[pid] = 0;
+      if(header->count == 0)
+	continue;
+      Network_Node_Send(node,pid,nthreads,(char *)header,header->length);
+      pending++;
+    }
 
-    if(temp[0] == 0) {
+    //replies may come back in any order, route them by the sender
+    while(pending > 0) {
+      int len,pid;
+      char *msg = Network_Node_Recv(node,&len,&pid,NULL);
+      char *reply = GetRpcReplyBuf(pid);
+      assert(len <= RPC_BUF_SIZE);
+      memcpy(reply,msg,len);
+
+      rpc_batch_header *header = (rpc_batch_header *)reply;
+      char *ptr = reply + sizeof(rpc_batch_header);
+      for(int i = 0;i < header->count;++i) {
+	rpc_reply_ptr[pid][i] = ptr;
+	ptr += RPC_ALIGN(sizeof(rpc_reply_struct) + ((rpc_reply_struct *)ptr)->length);
+      }
+      rpc_reply_cnt[pid] = header->count;
+      ((rpc_batch_header *)GetRpcBuf(pid))->count = 0;
+      pending--;
+    }
+  }
+
+  rpc_reply_struct *DBSSTX::RpcReply(int pid,int idx) {
+    assert(idx < rpc_reply_cnt[pid]);
+    return (rpc_reply_struct *)rpc_reply_ptr[pid][idx];
+  }
+
+  bool DBSSTX::LockRemote(rwset_item item,Network_Node *node) {
+
+    int idx = RpcAppend(item.pid,WRITE_REQ,item.tableid,item.key,NULL,0);
+    RpcFlush(node);
+    rpc_reply_struct *reply = RpcReply(item.pid,idx);
+    if(reply->status == 0)
+      return false;
+
+    //!!Donot write the meta data of the item
+    if(item.addr != NULL)
+      memcpy((char *)item.addr + VALUE_OFFSET,(char *)(reply + 1) + VALUE_OFFSET,
+	     txdb_->schemas[item.tableid].vlen);
+    return true;
+  }
+
+  bool DBSSTX::ReleaseLockRemote(rwset_item item,Network_Node *node) {
+
+    int length = ((item.addr == NULL)? 0:(txdb_->schemas[item.tableid].vlen + META_LENGTH));
+    int idx = RpcAppend(item.pid,RELEASE_REQ,item.tableid,item.key,(char *)item.addr,length);
+    RpcFlush(node);
+
+    if(RpcReply(item.pid,idx)->status == 0) {
       assert(false) ;//!!must release a held lock!
       return false;
     }
@@ -888,64 +1036,330 @@
     return true;
   }
 
-  std::string DBSSTX::HandleMsg(std::string &req){
+  //Lock every remote write of the rw set, one batch per destination
+  bool DBSSTX::RpcLockAllRemote(Network_Node *node) {
 
-    assert(req.size() >= sizeof(msg_struct));
+    int idx[RPC_MAX_BATCH * MAX_RPC_PARTITION];
+    int n = 0;
+    for(int i = 0;i < rw_set.size();++i) {
+      if(!rw_set[i].ro && rw_set[i].pid != current_partition)
+	idx[n++] = RpcAppend(rw_set[i].pid,WRITE_REQ,rw_set[i].tableid,rw_set[i].key,NULL,0);
+    }
+    RpcFlush(node);
+
+    bool success = true;
+    n = 0;
+    for(int i = 0;i < rw_set.size();++i) {
+      if(rw_set[i].ro || rw_set[i].pid == current_partition)
+	continue;
+      rpc_reply_struct *reply = RpcReply(rw_set[i].pid,idx[n++]);
+      if(reply->status == 0) {
+	success = false;
+	continue;
+      }
+      rw_set[i].locked = true;
+      if(rw_set[i].addr != NULL)
+	memcpy((char *)rw_set[i].addr + VALUE_OFFSET,(char *)(reply + 1) + VALUE_OFFSET,
+	       txdb_->schemas[rw_set[i].tableid].vlen);
+    }
+    if(success)
+      return true;
 
-    std::string res;
-    const char *ptr = req.c_str();
-    msg_struct msg;
-    memcpy(&msg,ptr,sizeof(msg_struct));
+    //give back only the locks this call took, the others belong to someone else
+    for(int i = 0;i < rw_set.size();++i) {
+      if(!rw_set[i].locked)
+	continue;
+      RpcAppend(rw_set[i].pid,RELEASE_REQ,rw_set[i].tableid,rw_set[i].key,NULL,0);
+      rw_set[i].locked = false;
+    }
+    RpcFlush(node);
+    return false;
+  }
 
+  //Write back and unlock the remote writes RpcLockAllRemote locked
+  void DBSSTX::RpcReleaseAllRemote(Network_Node *node) {
 
-    char *res_buf = NULL;
-    /*
-    uint64_t *loc;
-    if(!GetLoc(msg.tableid,msg.key,&loc))
-      assert(false);//should not happen!
-    */
-    //    int length  = txdb_->schemas[msg.tableid].vlen + META_LENGTH;
-
-    if ( msg.optype == WRITE_REQ) {
-      //now we only handle the write requests
-      /*
-      res_buf = new char[1 + length];
+    for(int i = 0;i < rw_set.size();++i) {
+      if(!rw_set[i].locked)
+	continue;
+      int length = (release_flag && rw_set[i].addr != NULL) ?
+	txdb_->schemas[rw_set[i].tableid].vlen + META_LENGTH : 0;
+      RpcAppend(rw_set[i].pid,RELEASE_REQ,rw_set[i].tableid,rw_set[i].key,(char *)rw_set[i].addr,length);
+      rw_set[i].locked = false;
+    }
+    RpcFlush(node);
+  }
+
+  int DBSSTX::ScanRemote(int tableid,uint64_t start,uint64_t bound,int count,bool reverse,
+			 int pid,Network_Node *node,uint64_t *keys,char *vals,uint64_t *next_key) {
+
+    scan_msg_struct scan_msg;
+    scan_msg.tableid = tableid;
+    scan_msg.optype = SCAN_REQ;
+    scan_msg.key = start;
+    scan_msg.length = 0;
+    scan_msg.bound = bound;
+    //the owner scans with our snapshot, same as a local scan would
+    scan_msg.sn = localsn;
+    scan_msg.count = count;
+    scan_msg.reverse = reverse;
+
+    int idx = RpcAppend(pid,(char *)&scan_msg,sizeof(scan_msg),NULL,0);
+    RpcFlush(node);
+
+    if(RpcReply(pid,idx)->status == 0) {
+      //the reply batch was full, nothing scanned yet
+      if(next_key != NULL)
+	*next_key = start;
+      return 0;
+    }
+    scan_reply_struct reply;
+    memcpy(&reply,(char *)(RpcReply(pid,idx) + 1),sizeof(reply));
+
+    int vlen = txdb_->schemas[tableid].vlen;
+    const char *ptr = (char *)(RpcReply(pid,idx) + 1) + sizeof(reply);
+    for(int i = 0;i < reply.count;++i) {
+      keys[i] = *(uint64_t *)ptr;
+      memcpy(vals + i * vlen,ptr + sizeof(uint64_t),vlen);
+      ptr += sizeof(uint64_t) + vlen;
+    }
+    if(next_key != NULL)
+      *next_key = reply.more ? reply.next_key : bound;
+    return reply.count;
+  }
+
+  //space is what is left of the reply buffer, entries that do not fit are
+  //left to the next request of the scanner through more/next_key
+  int DBSSTX::HandleScan(scan_msg_struct &scan,char *res,int space) {
+
+    int vlen = txdb_->schemas[scan.tableid].vlen;
+    int n = scan.count < MAX_SCAN_BATCH ? scan.count : MAX_SCAN_BATCH;
+    int fit = (space - (int)sizeof(scan_reply_struct)) / (int)(sizeof(uint64_t) + vlen);
+    if(fit < 0)
+      fit = 0;
+    if(n > fit)
+      n = fit;
+    uint64_t keys[MAX_SCAN_BATCH];
+    uint64_t *vals[MAX_SCAN_BATCH];
+
+    //use the requester's snapshot for the versions we return
+    uint64_t oldsn = localsn;
+    bool oldro = readonly;
+    localsn = scan.sn;
+    readonly = true;
+
+    DBSSTX::Iterator iter(this,scan.tableid,false);
+    if(scan.reverse) {
+      iter.Seek(scan.key);
+      if(!iter.Valid())
+	iter.SeekToLast();
+      else if(iter.Key() > scan.key)
+	iter.Prev();
+      n = iter.PrevBatch(scan.bound,n,keys,vals);
+    }else {
+      iter.Seek(scan.key);
+      n = iter.NextBatch(scan.bound,n,keys,vals);
+    }
 
-      uint64_t origin = 0UL << 63;
-      uint64_t target = 1UL << 63;
+    scan_reply_struct *reply = (scan_reply_struct *)res;
+    reply->count = n;
+    reply->more = iter.Valid();
+    reply->next_key = reply->more ? iter.Key() : 0;
 
-      //!!TODO assume that loc will be the original offset
-      //bug?
-      if(__sync_bool_compare_and_swap( (uint64_t *)((uint64_t)loc + TIME_OFFSET),origin,target) ) {
-		res_buf[0] = 1;
-		memcpy(res_buf + 1,(char *)((uint64_t)loc),length);
-      }else {
-		res_buf[0] = 0;
+    localsn = oldsn;
+    readonly = oldro;
+
+    char *ptr = res + sizeof(scan_reply_struct);
+    for(int i = 0;i < n;++i) {
+      *(uint64_t *)ptr = keys[i];
+      memcpy(ptr + sizeof(uint64_t),(char *)vals[i],vlen);
+      ptr += sizeof(uint64_t) + vlen;
+    }
+    return ptr - res;
+  }
+
+  //Handle a batch of requests in req, the replies are written to the reply
+  //buffer in the same order. Returns the length of the reply batch.
+  int DBSSTX::HandleMsg(const char *req,int len,char *reply_buf){
+
+    assert(len >= sizeof(rpc_batch_header));
+    const rpc_batch_header *header = (const rpc_batch_header *)req;
+    const char *ptr = req + sizeof(rpc_batch_header);
+
+    rpc_batch_header *res_header = (rpc_batch_header *)reply_buf;
+    res_header->count = header->count;
+    char *res = reply_buf + sizeof(rpc_batch_header);
+
+    for(int i = 0;i < header->count;++i) {
+
+      msg_struct msg;
+      memcpy(&msg,ptr,sizeof(msg_struct));
+      const char *payload = ptr + sizeof(msg_struct);
+      int size = (msg.optype == SCAN_REQ) ? sizeof(scan_msg_struct) : sizeof(msg_struct) + msg.length;
+      assert(ptr + size <= req + len);
+
+      rpc_reply_struct *r = (rpc_reply_struct *)res;
+      char *res_buf = (char *)(r + 1);
+      r->status = 1;
+      r->length = 0;
+
+      uint64_t *loc = NULL;
+      int length  = txdb_->schemas[msg.tableid].vlen + META_LENGTH;
+      if(msg.optype == READ_REQ || msg.optype == WRITE_REQ || msg.optype == RELEASE_REQ) {
+	if(!GetLoc(msg.tableid,msg.key,&loc))
+	  assert(false);//should not happen!
       }
-      res = std::string(res_buf,length + 1);
-      delete res_buf;
-      //endif
-      */
 
-    }else if(msg.optype == RELEASE_REQ) {
-      /*
-      //write back the message
-      if(req.size() == 64)
-		memcpy((char *)((uint64_t)loc + VALUE_OFFSET),ptr + 64 + VALUE_OFFSET,length - META_LENGTH);//idle release
+      if(msg.optype == READ_REQ) {
+	memcpy(res_buf,(char *)loc,length);
+	r->length = length;
 
-      	uint64_t origin = 1UL << 63;
-      	uint64_t target = 0UL << 63;
+      }else if ( msg.optype == WRITE_REQ) {
+	uint64_t origin = 0UL << 63;
+	uint64_t target = 1UL << 63;
 
-      //!!TODO assume that loc will be the original offset
-      if(__sync_bool_compare_and_swap( (uint64_t *)((uint64_t)loc + TIME_OFFSET),origin,target) ) {
-		char r_c = 1;
-		res = std::string(&r_c,1);
+	//!!TODO assume that loc will be the original offset
+	if(__sync_bool_compare_and_swap( (uint64_t *)((uint64_t)loc + TIME_OFFSET),origin,target) ) {
+	  memcpy(res_buf,(char *)loc,length);
+	  r->length = length;
+	}else {
+	  r->status = 0;
+	}
+
+      }else if(msg.optype == RELEASE_REQ) {
+	uint64_t origin = 1UL << 63;
+	uint64_t target = 0UL << 63;
+	volatile uint64_t *lock = (uint64_t *)((uint64_t)loc + TIME_OFFSET);
+
+	//a record that is not locked is never written
+	if(*lock != origin) {
+	  r->status = 0;
+	}else {
+	  //write back the value, an empty payload is an idle release
+	  if(msg.length > 0)
+	    memcpy((char *)((uint64_t)loc + VALUE_OFFSET),payload + VALUE_OFFSET,length - META_LENGTH);
+	  //the value is in place before the lock is cleared
+	  if(!__sync_bool_compare_and_swap(lock,origin,target))
+	    r->status = 0;
+	}
+
+      }else if(msg.optype == REGION_REQ) {
+	region_msg_struct m;
+	memcpy(&m,payload,sizeof(m));
+	rdma->SetRegion(m.pid,m.r_id,&m.region);
+	txdb_->rdma_off_mapping[msg.tableid] = RDMA_REGION_OFF(m.r_id,0);
+
+      }else if(msg.optype == INSERT_REQ) {
+	localsn = GetSS();
+	Add(msg.tableid,msg.key,(uint64_t *)payload);
+
+      }else if(msg.optype == DELETE_REQ) {
+	Delete(msg.tableid,msg.key);
+
+      }else if(msg.optype == SCAN_REQ) {
+	scan_msg_struct scan;
+	memcpy(&scan,ptr,sizeof(scan_msg_struct));
+	int space = RPC_BUF_SIZE - (res_buf - reply_buf);
+	if(space < (int)sizeof(scan_reply_struct))
+	  r->status = 0; //no room left, the scanner asks again
+	else
+	  r->length = HandleScan(scan,res_buf,space);
       }else {
-		assert(false);
-		} */
-      //end else handle release req
+	r->status = 0;
+      }
+
+      ptr += RPC_ALIGN(size);
+      res += RPC_ALIGN(sizeof(rpc_reply_struct) + r->length);
+      assert(res - reply_buf <= RPC_BUF_SIZE);
     }
-    return res;
+
+    res_header->length = res - reply_buf;
+    return res_header->length;
+  }
+
+  struct interleave_arg {
+    DBSSTX *tx;
+    tx_worker_func fn;
+    void *arg;
+  };
+
+  static void InterleaveEntry(RdmaScheduler *sched,int cid,void *arg) {
+    interleave_arg *a = (interleave_arg *)arg;
+    a->fn(a->tx,cid,a->arg);
+  }
+
+  //Every slot gets its own DBSSTX, so rw-sets and message buffers are not
+  //shared, while the slots take turns whenever one waits for the NIC.
+  void DBSSTX::RunInterleaved(RAWTables *tables,RdmaResource *rdma,int t_id,int k,tx_worker_func fn,void *arg) {
+    assert(k > 0 && k <= MAX_COR);
+    RdmaScheduler sched(rdma,t_id);
+    interleave_arg args[MAX_COR];
+    for(int i = 0;i < k;++i) {
+      args[i].tx = DBSSTX_new(tables,rdma,t_id,&sched,i);
+      args[i].fn = fn;
+      args[i].arg = arg;
+      sched.Spawn(InterleaveEntry,&args[i]);
+    }
+    sched.Run();
+    for(int i = 0;i < k;++i)
+      DBSSTX_free(args[i].tx);
+  }
+
+  struct rpc_handler_arg {
+    RAWTables *tables;
+    RdmaResource *rdma;
+    Network_Node *node;
+    DBSSTX *tx;
+    char *reply;
+  };
+
+  //requests are handled in place in the receive buffer
+  static void RpcDispatch(void *arg,Network_Node *node,char *req,int len,int pid,int nid) {
+    rpc_handler_arg *a = (rpc_handler_arg *)arg;
+    len = a->tx->HandleMsg(req,len,a->reply);
+    Network_Node_Send(node,pid,nid,a->reply,len);
+  }
+
+  void DBSSTX::RegisterTable(int tableid,int r_id,Network_Node *node) {
+    RdmaCuckooHash *t = txdb_->rdmacuckoohash[tableid];
+    if(rdma->RegisterRegion(r_id,t->array,t->size))
+      assert(false);
+    txdb_->rdma_off_mapping[tableid] = RDMA_REGION_OFF(r_id,0);
+
+    region_msg_struct m;
+    m.pid = current_partition;
+    m.r_id = r_id;
+    rdma->GetRegion(r_id,&m.region);
+    for(int pid = 0;pid < total_partition;++pid) {
+      if(pid != current_partition)
+	RpcAppend(pid,REGION_REQ,tableid,r_id,(char *)&m,sizeof(m));
+    }
+    RpcFlush(node);
+  }
+
+  //The per partition handler thread, it serves the requests of all remote
+  //workers. It runs as thread nthreads, which is where workers send requests.
+  void *DBSSTX::RpcHandlerThread(void *arg) {
+
+    rpc_handler_arg *a = (rpc_handler_arg *)arg;
+    a->tx = DBSSTX_new(a->tables,a->rdma,nthreads);
+    a->reply = (char *)malloc(RPC_BUF_SIZE);
+
+    //spin while batches keep coming, sleep once the partition goes idle
+    Net_Loop *loop = Net_Loop_new(RPC_SPIN_US);
+    Net_Loop_Register(loop,a->node,RpcDispatch,a);
+    Net_Loop_Run(loop);
+    return NULL;
+  }
+
+  void DBSSTX::StartRpcHandler(RAWTables *tables,RdmaResource *rdma,Network_Node *node) {
+    rpc_handler_arg *arg = new rpc_handler_arg;
+    arg->tables = tables;
+    arg->rdma = rdma;
+    arg->node = node;
+
+    pthread_t tid;
+    pthread_create(&tid,NULL,RpcHandlerThread,(void *)arg);
   }
 
   //status is used for detect lock and read lease
@@ -1237,7 +1651,75 @@
     }
 
     val_ = NULL;
-    return true;
+    return false;
+  }
+
+  //Second pass of a batched scan: the records of the cnt collected entries
+  //were prefetched by the walk, keep the visible ones and point at their values
+  int DBSSTX::Iterator::ResolveBatch(int cnt,uint64_t *keys,uint64_t **vals)
+  {
+    int res = 0;
+    for(int i = 0;i < cnt;++i) {
+      register uint64_t* temp;
+#ifdef _DB_RDMA
+      temp = vals[i];
+#else
+      temp = GetWithSnapshot(vals[i]);
+#endif
+      if(temp != NULL) {
+	keys[res] = keys[i];
+	vals[res] = (uint64_t *)((uint64_t)temp + VALUE_OFFSET);
+	res++;
+      }
+    }
+    return res;
+  }
+
+  //Batched scan: first walk the index and prefetch every record of the batch,
+  //then resolve the records, so DRAM misses of one batch overlap each other.
+  //The index nodes themselves are read by the walk as usual.
+  int DBSSTX::Iterator::NextBatch(uint64_t bound,int n,uint64_t *keys,uint64_t **vals)
+  {
+    int cnt = 0;
+    while(cnt < n && iter_->Valid()) {
+      if (iter_->Key() >= bound) break;
+      keys[cnt] = iter_->Key();
+      vals[cnt] = iter_->Value();
+      __builtin_prefetch(vals[cnt],0,3);
+      cnt++;
+      iter_->Next();
+    }
+    int res = ResolveBatch(cnt,keys,vals);
+
+    //keep the single step interface consistent with the batch
+    if(iter_->Valid() && iter_->Key() < bound) {
+      key_ = iter_->Key();
+      val_ = iter_->Value();
+    }else
+      val_ = NULL;
+    return res;
+  }
+
+  //Reverse batched scan, returns entries with key >= bound in descending order
+  int DBSSTX::Iterator::PrevBatch(uint64_t bound,int n,uint64_t *keys,uint64_t **vals)
+  {
+    int cnt = 0;
+    while(cnt < n && iter_->Valid()) {
+      if (iter_->Key() < bound) break;
+      keys[cnt] = iter_->Key();
+      vals[cnt] = iter_->Value();
+      __builtin_prefetch(vals[cnt],0,3);
+      cnt++;
+      iter_->Prev();
+    }
+    int res = ResolveBatch(cnt,keys,vals);
+
+    if(iter_->Valid() && iter_->Key() >= bound) {
+      key_ = iter_->Key();
+      val_ = iter_->Value();
+    }else
+      val_ = NULL;
+    return res;
   }
 
 
@@ -1319,7 +1801,25 @@
   // Final state of iterator is Valid() iff list is not empty.
   void DBSSTX::Iterator::SeekToLast()
   {
-    //TODO
-    assert(0);
+    iter_->SeekToLast();
+    while(iter_->Valid()) {
+
+      register uint64_t* temp;
+
+#ifdef _DB_RDMA
+      temp = iter_->Value();
+#else
+      temp = GetWithSnapshot(iter_->Value());
+#endif
+
+      if(temp != NULL ) {
+	key_ = iter_->Key();
+	val_ = temp;
+	return;
+      }
+
+      iter_->Prev();
+    }
+    val_ = NULL;
   }
 
@@ -33,6 +33,8 @@
 #include "db/network_node.h"
 #include "memstore/rdma_resource.h"
 
+class RdmaScheduler;
+
 
 #define VALUE_OFFSET 8
 #define TIME_OFFSET  0
@@ -40,6 +42,10 @@
 
 
 #define RELEASE_REQ 2
+#define SCAN_REQ    3
+#define INSERT_REQ  4
+#define DELETE_REQ  5
+#define REGION_REQ  6
 #define WRITE_REQ  1
 #define READ_REQ   0
 
@@ -57,6 +63,9 @@
 #define DEFAULT_INTERVAL 400000   // 0.4ms
 #define DELTA 200000 // 0.2ms
 
+//rounds of reading both cuckoo buckets before a remote lookup gives up
+#define CUCKOO_READ_RETRY 64
+
 
 #define LOG_SIZE (10 * 1024) //10k for log size
 
@@ -65,8 +74,67 @@ typedef struct msg_struct {
   int tableid;
   int optype;
   uint64_t key;
+  int length; //bytes of payload following the message
 } msg_struct;
 
+//rpc batching, requests to one partition are sent together in a buffer
+//carved from the registered message area of the thread
+#define MAX_RPC_PARTITION 16
+#define RPC_MAX_BATCH     64
+#define RPC_BUF_SIZE      (64 * 1024)
+//request area starts after the space used by one-sided operations
+#define RPC_BUF_OFFSET    (64 * 1024)
+#define RPC_ALIGN(x)      ((((x) - 1) / 8 + 1) * 8)
+//idle time (us) the handler busy polls before sleeping in epoll
+#define RPC_SPIN_US       50
+
+//interleaved transactions, a worker thread runs up to MAX_COR transactions as
+//coroutines, each owning one COR_BUF_SIZE slice of the thread's message area
+#define MAX_COR           16
+#define COR_BUF_SIZE      (RPC_BUF_OFFSET + 2 * MAX_RPC_PARTITION * RPC_BUF_SIZE)
+//the rest of the thread's message area is its pool of registered buffers
+#define MSG_RESERVED      (MAX_COR * COR_BUF_SIZE)
+
+typedef struct rpc_batch_header {
+  int count;
+  int length; //including the header
+} rpc_batch_header;
+
+//every request gets a reply, followed by length bytes of data
+typedef struct rpc_reply_struct {
+  int status;
+  int length;
+} rpc_reply_struct;
+
+//announces the memory region of a table created at runtime
+typedef struct region_msg_struct {
+  int pid;
+  int r_id;
+  struct rdma_region region;
+} region_msg_struct;
+
+//max entries returned by one remote scan request
+#define MAX_SCAN_BATCH 64
+
+//shares the msg_struct prefix so HandleMsg can dispatch on optype
+typedef struct scan_msg_struct {
+  int tableid;
+  int optype;
+  uint64_t key;   //start key
+  int length;
+  uint64_t bound; //[key,bound) forward, [bound,key] reverse
+  uint64_t sn;    //snapshot of the requester
+  int count;
+  int reverse;
+} scan_msg_struct;
+
+//reply: header followed by count * (key,value)
+typedef struct scan_reply_struct {
+  int count;
+  int more;      //the range has more entries after next_key
+  uint64_t next_key;
+} scan_reply_struct;
+
 extern uint64_t timestamp;
 
 typedef struct rwset_item{
@@ -76,6 +144,7 @@ typedef struct rwset_item{
   uint64_t* addr;
   int pid;
   char ro;
+  char locked;//held through RpcLockAllRemote
 } rwset_item;
 
 //实现pair数组
@@ -112,6 +181,14 @@ void Next(DBSSTX_Iterator *this);
 // <bound
 char Next(DBSSTX_Iterator *this,uint64_t bound);
 
+// Fill up to n (key,value) pairs with key < bound from the current position,
+// return the number of pairs. The iterator is left after the last one.
+int NextBatch(DBSSTX_Iterator *this,uint64_t bound,int n,uint64_t *keys,uint64_t **vals);
+// Same as NextBatch but scans backward, returning keys >= bound
+int PrevBatch(DBSSTX_Iterator *this,uint64_t bound,int n,uint64_t *keys,uint64_t **vals);
+// Shared by the two above, compacts the cnt entries to the visible records
+int ResolveBatch(DBSSTX_Iterator *this,int cnt,uint64_t *keys,uint64_t **vals);
+
 void Prev(DBSSTX_Iterator *this);
 void Seek(DBSSTX_Iterator *this,uint64_t key);
 
@@ -141,6 +218,8 @@ class DBSSTX {
     RAWTables *txdb_;
     RdmaResource *rdma;
     int thread_id;//TODO!!init
+    RdmaScheduler *sched; //NULL if the thread runs one transaction at a time
+    int cor_id; //slot of this transaction in its worker thread
     uint64_t localsn;
     uint64_t lastsn; //to check whether another epoch has passed
 
@@ -150,12 +229,17 @@ class DBSSTX {
     uint64_t *emptySS[20];
     int emptySSLen;
 
+    //rpc replies of the last flush, per destination
+    char *rpc_reply_ptr[MAX_RPC_PARTITION][RPC_MAX_BATCH];
+    int rpc_reply_cnt[MAX_RPC_PARTITION];
+
     //methods for logging
   };
 
 
 DBSSTX_new(DBSSTX *dbsstx,RAWTables* tables);
 DBSSTX_new(DBSSTX *dbsstx,RAWTables* tables,RdmaResource *rdma,int t_id);
+DBSSTX_new(DBSSTX *dbsstx,RAWTables* tables,RdmaResource *rdma,int t_id,RdmaScheduler *sched,int cor_id);
 
 DBSSTX_free(DBSSTX *dbsstx);
 
@@ -186,22 +270,58 @@ char GetRemote(DBSSTX *dbsstx,int tableid,uint64_t key,String *,Network_Node *no
 
 void chain_travel(DBSSTX *dbsstx,rwset_item &item);
 void hashext_travel(DBSSTX *dbsstx,rwset_item &item);
-void cuckoo_travel(DBSSTX *dbsstx,rwset_item &item);
+//false when the key is not in the table, or a remote lookup still fails
+//after CUCKOO_READ_RETRY rounds, item.loc is not set then
+char cuckoo_travel(DBSSTX *dbsstx,rwset_item &item);
 
 
 
 //void PrintAllLocks();
 //Rdma methods
-void PrefetchAllRemote(DBSSTX *dbsstx,uint64_t endtime);
+//false when a record of the rw set cannot be found, the locks taken so far
+//are given back and the caller aborts with ClearRwset
+char PrefetchAllRemote(DBSSTX *dbsstx,uint64_t endtime);
 void ReleaseAllRemote(DBSSTX *dbsstx);
-void Fallback_LockAll(DBSSTX *dbsstx,SpinLock** sl, int numOfLocks, uint64_t endtime);
+char Fallback_LockAll(DBSSTX *dbsstx,SpinLock** sl, int numOfLocks, uint64_t endtime);
 void RemoteWriteBack(DBSSTX *dbsstx);
 
 char LockRemote(DBSSTX *dbsstx,rwset_item item,Network_Node *node);
 char ReleaseLockRemote(DBSSTX *dbsstx,rwset_item item,Network_Node *node);
+
+//registered buffer of this transaction, a request needing a buffer of its
+//own takes one from the thread's pool (AcquireBuf)
+inline char *GetMsgBuf(DBSSTX *dbsstx) {
+  return dbsstx->rdma->GetMsgAddr(dbsstx->thread_id) + dbsstx->cor_id * COR_BUF_SIZE;
+}
+//one-sided operations, they yield to the other transactions of the thread
+//until completion when running interleaved
+int RemoteRead(DBSSTX *dbsstx,int pid,char *local,uint64_t size,uint64_t off);
+int RemoteCmpSwap(DBSSTX *dbsstx,int pid,char *local,uint64_t compare,uint64_t swap,uint64_t size,uint64_t off);
+//a chain of requests posted with one doorbell
+int RemoteOps(DBSSTX *dbsstx,int pid,normal_op_req *reqs,int n);
+
+//batched rpc, requests are queued per destination and sent on flush
+inline char *GetRpcBuf(DBSSTX *dbsstx,int pid) {
+  return GetMsgBuf(dbsstx) + RPC_BUF_OFFSET + pid * 2 * RPC_BUF_SIZE;
+}
+inline char *GetRpcReplyBuf(DBSSTX *dbsstx,int pid) {
+  return GetRpcBuf(dbsstx,pid) + RPC_BUF_SIZE;
+}
+int RpcAppend(DBSSTX *dbsstx,int pid,const char *req,int size,const char *payload,int length);
+int RpcAppend(DBSSTX *dbsstx,int pid,int optype,int tableid,uint64_t key,const char *payload,int length);
+void RpcFlush(DBSSTX *dbsstx,Network_Node *node);
+rpc_reply_struct *RpcReply(DBSSTX *dbsstx,int pid,int idx);
+char RpcLockAllRemote(DBSSTX *dbsstx,Network_Node *node);
+void RpcReleaseAllRemote(DBSSTX *dbsstx,Network_Node *node);
+//scan of a table owned by pid, vals holds count * vlen bytes. May return
+//fewer entries than count while the range goes on, the scan continues
+//from *next_key, which is bound once it is done.
+int ScanRemote(DBSSTX *dbsstx,int tableid,uint64_t start,uint64_t bound,int count,char reverse,
+               int pid,Network_Node *node,uint64_t *keys,char *vals,uint64_t *next_key = NULL);
 char LockLocal(DBSSTX *dbsstx,rwset_item item);
 char ReleaseLocal(DBSSTX *dbsstx,rwset_item item);
 
+//0 when the record cannot be found, no record starts at offset 0
 uint64_t GetLocalLoc(DBSSTX *dbsstx,int tableid,uint64_t key);
 uint64_t GetRdmaLoc(DBSSTX *dbsstx,int tableid,uint64_t key,int pid);
 
@@ -214,8 +334,8 @@ void AddToLocalReadOnlySet(DBSSTX *dbsstx,int tableid,uint64_t key,uint64_t *loc
 
 void ReleaseAllLocal(DBSSTX *dbsstx);
 void RdmaFetchAdd (DBSSTX *dbsstx, uint64_t off,int pid,uint64_t value);
-//The general lock operation
-void Lock(DBSSTX *dbsstx,rwset_item &item);
+//The general lock operation, false when the record cannot be found
+char Lock(DBSSTX *dbsstx,rwset_item &item);
 void Release(DBSSTX *dbsstx,rwset_item &item,char flag = false);
 void LocalLockSpin(DBSSTX *dbsstx,char *loc);
 void LocalReleaseSpin(DBSSTX *dbsstx,char *loc);
@@ -225,17 +345,30 @@ void _LocalLock(DBSSTX *dbsstx,rwset_item &item);
 void _LocalRelease(DBSSTX *dbsstx,rwset_item &item);
 
 
-void GetLease(DBSSTX *dbsstx,rwset_item &item, uint64_t endtime);
+char GetLease(DBSSTX *dbsstx,rwset_item &item, uint64_t endtime);
 
 char AllLeasesAreValid(DBSSTX *dbsstx);
 
-void GetLocalLease(DBSSTX *dbsstx,int tableid,uint64_t key,uint64_t *loc,uint64_t endtime);
+char GetLocalLease(DBSSTX *dbsstx,int tableid,uint64_t key,uint64_t *loc,uint64_t endtime);
 
 char AllLocalLeasesValid(DBSSTX *dbsstx);
 
 void ClearRwset(DBSSTX *dbsstx);
 
-String HandleMsg(DBSSTX *dbsstx,String &req);
+int HandleMsg(DBSSTX *dbsstx,const char *req,int len,char *reply);
+int HandleScan(DBSSTX *dbsstx,scan_msg_struct &scan,char *reply,int space);
+//worker mode running k transactions concurrently on thread t_id, fn is
+//called once per transaction slot and returns when the slot is done
+typedef void (*tx_worker_func)(DBSSTX *tx,int cor_id,void *arg);
+void RunInterleaved(RAWTables *tables,RdmaResource *rdma,int t_id,int k,tx_worker_func fn,void *arg);
+
+//register a table added with AddRegionSchema as region r_id and announce it
+//to the other partitions, each of them creates the table with the same r_id
+void RegisterTable(DBSSTX *dbsstx,int tableid,int r_id,Network_Node *node);
+
+//start the thread serving rpc requests of this partition
+void StartRpcHandler(RAWTables *tables,RdmaResource *rdma,Network_Node *node);
+void *RpcHandlerThread(void *arg);
 
 RAWStore_Iterator *GetRawIterator(DBSSTX *dbsstx,int tableid);
 
@@ -1,145 +1,553 @@
-#include <zmq.h>
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA
+ * for speedy distributed in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+/*
+ *  Control plane transport between partitions.
+ *  Every message is a fixed binary header followed by the payload, sent over
+ *  plain TCP. Sends are vectored (header and payload are never copied into a
+ *  temporary message), small messages can be batched per peer, and received
+ *  frames are returned in place from a preallocated per-connection buffer.
+ *  Connections are multiplexed with epoll; Net_Loop serves several nodes of
+ *  this partition from one thread and dispatches frames by the receiving nid.
+ */
+
+#ifndef NETWORK_NODE_H
+#define NETWORK_NODE_H
+
 #include <string.h>
 #include <stdio.h>
-#include <unistd.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include "uthash.h"
 
-#define MUL
-
 extern size_t total_partition;
 extern size_t current_partition;
 
-typedef struct {
-    int pid;
-    int nid;
-    void *context;
-    void *receiver;
-    char **net_def;
-    int net_def_count;
-    struct SocketMapEntry *socket_map;
-} Network_Node;
+#define NET_BASE_PORT 5500
+#define NET_MAX_CONNS 256
+// size of the per-peer send batch and per-connection receive buffers
+#define NET_BUF_SIZE (4 * 1024 * 1024)
+// messages up to this size are packed into the batch buffer
+#define NET_SMALL_MSG 256
+// events fetched per epoll_wait
+#define NET_MAX_EVENTS 64
+
+typedef struct __attribute__((packed)) {
+    uint32_t len;   // payload bytes
+    uint16_t pid;   // sender partition
+    uint16_t nid;   // sender thread
+} net_frame_hdr;
 
 typedef struct SocketMapEntry {
     int id;
-    void *socket;
+    int fd;
+    char *batch;        // pending small frames, sent on flush
+    size_t batch_len;
     UT_hash_handle hh;
 } SocketMapEntry;
 
-int hash(int _pid, int _nid) {
+typedef struct {
+    int fd;
+    char *buf;
+    size_t head;        // first unconsumed byte
+    size_t tail;        // end of received bytes
+} net_conn;
+
+typedef struct {
+    int pid;
+    int nid;
+    int listen_fd;
+    char **net_def;     // host of each partition
+    int *net_port;      // base port of each partition
+    int net_def_count;
+    SocketMapEntry *socket_map;
+    int epoll_fd;       // listen fd and all accepted connections
+    net_conn *conns[NET_MAX_CONNS];
+    int conn_count;
+    int next_conn;      // round robin start, so one busy peer can not starve others
+} Network_Node;
+
+inline int hash(int _pid, int _nid) {
     return _pid * 200 + _nid;
 }
 
-Network_Node* Network_Node_new(int _pid, int _nid, const char *conf) {
-    Network_Node *node = malloc(sizeof(Network_Node));
+/*
+ * The config file has one line per partition, "host" or "host port" where
+ * port is the base port of that partition (default NET_BASE_PORT), so several
+ * partitions can run on localhost with different base ports.
+ */
+static void net_load_config(Network_Node *node, const char *conf) {
+    FILE *ist = (conf != NULL) ? fopen(conf, "r") : NULL;
+    if (ist) {
+        char line[256];
+        while (fgets(line, sizeof(line), ist)) {
+            char host[200];
+            int port = NET_BASE_PORT;
+            if (sscanf(line, "%199s %d", host, &port) < 1 || host[0] == '#')
+                continue;
+            node->net_def = (char **)realloc(node->net_def, sizeof(char *) * (node->net_def_count + 1));
+            node->net_port = (int *)realloc(node->net_port, sizeof(int) * (node->net_def_count + 1));
+            node->net_def[node->net_def_count] = strdup(host);
+            node->net_port[node->net_def_count] = port;
+            node->net_def_count++;
+        }
+        fclose(ist);
+    }
+    if (node->net_def_count == 0) {
+        // every partition on this host
+        int count = (total_partition > 0) ? total_partition : 1;
+        printf("using default network fun %d %d, %d partitions on localhost\n", node->pid, node->nid, count);
+        node->net_def = (char **)malloc(sizeof(char *) * count);
+        node->net_port = (int *)malloc(sizeof(int) * count);
+        for (int i = 0; i < count; i++) {
+            node->net_def[i] = strdup("127.0.0.1");
+            node->net_port[i] = NET_BASE_PORT;
+        }
+        node->net_def_count = count;
+    }
+}
+
+inline Network_Node* Network_Node_new(int _pid, int _nid, const char *conf) {
+    Network_Node *node = (Network_Node *)malloc(sizeof(Network_Node));
     node->nid = _nid;
     node->pid = _pid;
-    node->context = zmq_ctx_new();
     node->net_def = NULL;
+    node->net_port = NULL;
     node->net_def_count = 0;
     node->socket_map = NULL;
+    node->conn_count = 0;
+    node->next_conn = 0;
 
     printf("start %d %d listening...\n", _pid, _nid);
-    FILE *ist = fopen(conf, "r");
-    if (ist) {
-        char mac[100];
-        while (fgets(mac, sizeof(mac), ist)) {
-            mac[strcspn(mac, "\n")] = 0; // Remove newline
-            node->net_def = realloc(node->net_def, sizeof(char*) * (node->net_def_count + 1));
-            node->net_def[node->net_def_count] = strdup(mac);
-            node->net_def_count++;
-        }
-    } else {
-        printf("using default network fun %d %d\n", _pid, _nid);
-        const char *defaults[] = {"10.0.0.100", "10.0.0.101", "10.0.0.102", "10.0.0.103", "10.0.0.104", "10.0.0.105"};
-        int defaults_count = sizeof(defaults) / sizeof(defaults[0]);
-        node->net_def = malloc(sizeof(char*) * defaults_count);
-        for (int i = 0; i < defaults_count; i++) {
-            node->net_def[i] = strdup(defaults[i]);
-        }
-        node->net_def_count = defaults_count;
+    net_load_config(node, conf);
+    assert(_pid < node->net_def_count);
+
+    node->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(node->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(node->net_port[_pid] + hash(node->pid, node->nid));
+    printf("tcp binding port %d\n", ntohs(addr.sin_port));
+    if (bind(node->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(node->listen_fd, NET_MAX_CONNS) < 0) {
+        fprintf(stderr, "bind with error %s\n", strerror(errno));
+        exit(-1);
     }
-    fclose(ist);
+    fcntl(node->listen_fd, F_SETFL, O_NONBLOCK);
 
-    node->receiver = zmq_socket(node->context, ZMQ_PULL);
-    char address[30] = "";
-    sprintf(address, "tcp://*:%d", 5500 + hash(node->pid, node->nid));
-    printf("tcp binding address %s\n", address);
-    zmq_bind(node->receiver, address);
+    node->epoll_fd = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;     // NULL marks the listen fd
+    epoll_ctl(node->epoll_fd, EPOLL_CTL_ADD, node->listen_fd, &ev);
 
     return node;
 }
 
-void Network_Node_destroy(Network_Node *node) {
+inline void Network_Node_destroy(Network_Node *node) {
     SocketMapEntry *current, *tmp;
     HASH_ITER(hh, node->socket_map, current, tmp) {
         HASH_DEL(node->socket_map, current);
-        zmq_close(current->socket);
+        close(current->fd);
+        free(current->batch);
         free(current);
     }
-    zmq_close(node->receiver);
-    zmq_ctx_destroy(node->context);
+    for (int i = 0; i < node->conn_count; i++) {
+        close(node->conns[i]->fd);
+        free(node->conns[i]->buf);
+        free(node->conns[i]);
+    }
+    close(node->listen_fd);
+    close(node->epoll_fd);
     for (int i = 0; i < node->net_def_count; i++) {
         free(node->net_def[i]);
     }
     free(node->net_def);
+    free(node->net_port);
     free(node);
 }
 
-void Network_Node_Send(Network_Node *node, int _pid, int _nid, const char *msg) {
-    char header[3] = {node->pid, node->nid, 0};
-    char *full_msg = malloc(strlen(header) + strlen(msg) + 1);
-    strcpy(full_msg, header);
-    strcat(full_msg, msg);
+static void net_writev_all(int fd, struct iovec *iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            fprintf(stderr, "send with error %s\n", strerror(errno));
+            exit(-1);
+        }
+        // skip what has been written, a partial write may stop inside an iov
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+static SocketMapEntry *net_get_peer(Network_Node *node, int _pid, int _nid) {
     int id = hash(_pid, _nid);
     SocketMapEntry *s;
     HASH_FIND_INT(node->socket_map, &id, s);
-    if (!s) {
-        s = malloc(sizeof(SocketMapEntry));
-        s->id = id;
-        s->socket = zmq_socket(node->context, ZMQ_PUSH);
-        char address[30] = "";
-#ifdef MUL
-        snprintf(address, 30, "tcp://%s:%d", node->net_def[_pid], 5500 + id);
-        printf("mul establish %s\n", address);
-#else
-        sprintf(address, "tcp://10.0.0.%d:%d", 100 + _pid, 5500 + id);
-#endif
-        zmq_connect(s->socket, address);
-        HASH_ADD_INT(node->socket_map, id, s);
-    }
-    zmq_msg_t request;
-    zmq_msg_init_size(&request, strlen(full_msg));
-    memcpy(zmq_msg_data(&request), full_msg, strlen(full_msg));
-    zmq_msg_send(&request, s->socket, 0);
-    zmq_msg_close(&request);
-    free(full_msg);
-}
-
-char* Network_Node_Recv(Network_Node *node) {
-    zmq_msg_t reply;
-    zmq_msg_init(&reply);
-    if (zmq_msg_recv(&reply, node->receiver, 0) < 0) {
-        fprintf(stderr, "recv with error %s\n", strerror(errno));
+    if (s)
+        return s;
+
+    assert(_pid < node->net_def_count);
+    s = (SocketMapEntry *)malloc(sizeof(SocketMapEntry));
+    s->id = id;
+    s->batch = (char *)malloc(NET_BUF_SIZE);
+    s->batch_len = 0;
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char port[16];
+    snprintf(port, sizeof(port), "%d", node->net_port[_pid] + id);
+    if (getaddrinfo(node->net_def[_pid], port, &hints, &res) != 0) {
+        fprintf(stderr, "can not resolve %s\n", node->net_def[_pid]);
+        exit(-1);
+    }
+    printf("mul establish %s:%s\n", node->net_def[_pid], port);
+    // the peer may not be listening yet, keep trying like zmq did
+    while (true) {
+        s->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(s->fd, res->ai_addr, res->ai_addrlen) == 0)
+            break;
+        close(s->fd);
+        usleep(10000);
+    }
+    freeaddrinfo(res);
+    int one = 1;
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    HASH_ADD_INT(node->socket_map, id, s);
+    return s;
+}
+
+static void net_flush_peer(SocketMapEntry *s) {
+    if (s->batch_len == 0)
+        return;
+    struct iovec iov;
+    iov.iov_base = s->batch;
+    iov.iov_len = s->batch_len;
+    net_writev_all(s->fd, &iov, 1);
+    s->batch_len = 0;
+}
+
+// Send one frame right away, pending batched frames to the peer go first.
+inline void Network_Node_Send(Network_Node *node, int _pid, int _nid, const char *msg, int len) {
+    SocketMapEntry *s = net_get_peer(node, _pid, _nid);
+    net_flush_peer(s);
+
+    net_frame_hdr header;
+    header.len = len;
+    header.pid = node->pid;
+    header.nid = node->nid;
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)msg;
+    iov[1].iov_len = len;
+    net_writev_all(s->fd, iov, len > 0 ? 2 : 1);
+}
+
+// Queue a small control message, it is sent on the next flush or send to the peer.
+inline void Network_Node_SendBatched(Network_Node *node, int _pid, int _nid, const char *msg, int len) {
+    if (len > NET_SMALL_MSG) {
+        Network_Node_Send(node, _pid, _nid, msg, len);
+        return;
+    }
+    SocketMapEntry *s = net_get_peer(node, _pid, _nid);
+    if (s->batch_len + sizeof(net_frame_hdr) + len > NET_BUF_SIZE)
+        net_flush_peer(s);
+
+    net_frame_hdr *header = (net_frame_hdr *)(s->batch + s->batch_len);
+    header->len = len;
+    header->pid = node->pid;
+    header->nid = node->nid;
+    memcpy(header + 1, msg, len);
+    s->batch_len += sizeof(net_frame_hdr) + len;
+}
+
+inline void Network_Node_Flush(Network_Node *node) {
+    SocketMapEntry *current, *tmp;
+    HASH_ITER(hh, node->socket_map, current, tmp) {
+        net_flush_peer(current);
+    }
+}
+
+static void net_accept(Network_Node *node) {
+    while (node->conn_count < NET_MAX_CONNS) {
+        int fd = accept(node->listen_fd, NULL, NULL);
+        if (fd < 0)
+            return;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        net_conn *c = (net_conn *)malloc(sizeof(net_conn));
+        c->fd = fd;
+        c->buf = (char *)malloc(NET_BUF_SIZE);
+        c->head = c->tail = 0;
+        node->conns[node->conn_count++] = c;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(node->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+static void net_close(Network_Node *node, net_conn *c) {
+    // closing the fd also removes it from the epoll set
+    close(c->fd);
+    free(c->buf);
+    for (int i = 0; i < node->conn_count; i++) {
+        if (node->conns[i] == c) {
+            node->conns[i] = node->conns[--node->conn_count];
+            break;
+        }
+    }
+    free(c);
+}
+
+// Return the payload of a complete frame buffered in c, or NULL.
+static char *net_next_frame(net_conn *c, int *len, int *_pid, int *_nid) {
+    if (c->tail - c->head < sizeof(net_frame_hdr))
+        return NULL;
+    net_frame_hdr *header = (net_frame_hdr *)(c->buf + c->head);
+    assert(header->len + sizeof(net_frame_hdr) <= NET_BUF_SIZE);
+    if (c->tail - c->head < sizeof(net_frame_hdr) + header->len)
+        return NULL;
+    *len = header->len;
+    if (_pid) *_pid = header->pid;
+    if (_nid) *_nid = header->nid;
+    c->head += sizeof(net_frame_hdr) + header->len;
+    return (char *)(header + 1);
+}
+
+// Read what is available on c. Returns false if the peer has gone.
+static bool net_fill(net_conn *c) {
+    if (c->head == c->tail) {
+        c->head = c->tail = 0;
+    } else if (c->head > NET_BUF_SIZE / 2 || c->tail == NET_BUF_SIZE) {
+        // compaction, the last returned frame is not used any more
+        memmove(c->buf, c->buf + c->head, c->tail - c->head);
+        c->tail -= c->head;
+        c->head = 0;
+    }
+    // full of complete frames, read again once they are consumed
+    if (c->tail == NET_BUF_SIZE)
+        return true;
+    ssize_t n = read(c->fd, c->buf + c->tail, NET_BUF_SIZE - c->tail);
+    if (n == 0)
+        return false;
+    if (n > 0)
+        c->tail += n;
+    return true;
+}
+
+/*
+ * Wait at most timeout ms for a frame from any connection.
+ * The returned payload stays valid until the next receive on this node.
+ */
+static char *net_recv(Network_Node *node, int *len, int *_pid, int *_nid, int timeout) {
+    struct epoll_event events[NET_MAX_EVENTS];
+    while (true) {
+        // frames already buffered come first
+        for (int k = 0; k < node->conn_count; k++) {
+            int i = (node->next_conn + k) % node->conn_count;
+            char *msg = net_next_frame(node->conns[i], len, _pid, _nid);
+            if (msg != NULL) {
+                node->next_conn = (i + 1) % node->conn_count;
+                return msg;
+            }
+        }
+
+        int ready = epoll_wait(node->epoll_fd, events, NET_MAX_EVENTS, timeout);
+        if (ready < 0 && errno != EINTR) {
+            fprintf(stderr, "recv with error %s\n", strerror(errno));
+            exit(-1);
+        }
+        if (ready <= 0 && timeout >= 0)
+            return NULL;
+
+        for (int i = 0; i < ready; i++) {
+            net_conn *c = (net_conn *)events[i].data.ptr;
+            if (c == NULL)
+                net_accept(node);
+            else if (!net_fill(c))
+                net_close(node, c);
+        }
+        if (node->next_conn >= node->conn_count)
+            node->next_conn = 0;
+    }
+}
+
+inline char* Network_Node_Recv(Network_Node *node, int *len, int *_pid, int *_nid) {
+    return net_recv(node, len, _pid, _nid, -1);
+}
+
+// Non-blocking receive, NULL if no message is available.
+inline char* Network_Node_tryRecv(Network_Node *node, int *len, int *_pid, int *_nid) {
+    return net_recv(node, len, _pid, _nid, 0);
+}
+
+/*
+ * Event loop over the nodes of this partition, one per served nid.
+ * Frames received by a node go to the handler registered with it. The loop
+ * busy polls while requests keep coming and sleeps in epoll_wait once it has
+ * been idle for spin_us, so an idle server does not burn a core but a loaded
+ * one does not pay a wakeup per request.
+ */
+#define NET_LOOP_MAX_NODES 64
+// spin_us values for the two extremes
+#define NET_LOOP_BLOCK 0
+#define NET_LOOP_BUSY -1
+
+typedef void (*net_handler)(void *arg, Network_Node *node, char *msg, int len, int pid, int nid);
+
+typedef struct {
+    int epoll_fd;       // epoll fds of the registered nodes
+    Network_Node *nodes[NET_LOOP_MAX_NODES];
+    net_handler handlers[NET_LOOP_MAX_NODES];
+    void *args[NET_LOOP_MAX_NODES];
+    int node_count;
+    int spin_us;        // idle time before sleeping, NET_LOOP_BUSY never sleeps
+    volatile bool running;
+
+    uint64_t msgs;      // frames dispatched
+    uint64_t polls;     // empty polls while spinning
+    uint64_t sleeps;    // times the loop went to sleep
+} Net_Loop;
+
+inline Net_Loop* Net_Loop_new(int spin_us) {
+    Net_Loop *loop = (Net_Loop *)malloc(sizeof(Net_Loop));
+    loop->epoll_fd = epoll_create1(0);
+    loop->node_count = 0;
+    loop->spin_us = spin_us;
+    loop->running = false;
+    loop->msgs = loop->polls = loop->sleeps = 0;
+    return loop;
+}
+
+inline void Net_Loop_destroy(Net_Loop *loop) {
+    close(loop->epoll_fd);
+    free(loop);
+}
+
+// An epoll fd is itself pollable, so each node's set is nested in the loop's.
+inline void Net_Loop_Register(Net_Loop *loop, Network_Node *node, net_handler handler, void *arg) {
+    assert(loop->node_count < NET_LOOP_MAX_NODES);
+    int i = loop->node_count++;
+    loop->nodes[i] = node;
+    loop->handlers[i] = handler;
+    loop->args[i] = arg;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, node->epoll_fd, &ev);
+}
+
+// Drain every frame of node i, returns the number dispatched.
+static int net_loop_drain(Net_Loop *loop, int i) {
+    Network_Node *node = loop->nodes[i];
+    int n = 0, len, pid, nid;
+    char *msg;
+    while ((msg = Network_Node_tryRecv(node, &len, &pid, &nid)) != NULL) {
+        loop->handlers[i](loop->args[i], node, msg, len, pid, nid);
+        n++;
+    }
+    return n;
+}
+
+/*
+ * One round of the loop, waiting at most timeout ms for activity.
+ * Returns the number of frames dispatched.
+ */
+inline int Net_Loop_Poll(Net_Loop *loop, int timeout) {
+    struct epoll_event events[NET_LOOP_MAX_NODES];
+    int ready = epoll_wait(loop->epoll_fd, events, NET_LOOP_MAX_NODES, timeout);
+    if (ready < 0 && errno != EINTR) {
+        fprintf(stderr, "loop with error %s\n", strerror(errno));
         exit(-1);
     }
-    char *response = strndup((char *)zmq_msg_data(&reply), zmq_msg_size(&reply));
-    zmq_msg_close(&reply);
-    return response;
+    int n = 0;
+    for (int i = 0; i < ready; i++)
+        n += net_loop_drain(loop, events[i].data.u32);
+    loop->msgs += n;
+    return n;
+}
+
+static inline uint64_t net_loop_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
 }
 
-char* Network_Node_tryRecv(Network_Node *node) {
-    zmq_msg_t reply;
-    zmq_msg_init(&reply);
-    if (zmq_msg_recv(&reply, node->receiver, ZMQ_DONTWAIT) > 0) {
-        char *response = strndup((char *)zmq_msg_data(&reply), zmq_msg_size(&reply));
-        zmq_msg_close(&reply);
-        return response;
-    } else {
-        zmq_msg_close(&reply);
-        return strdup("");
+// Run until Net_Loop_Stop, sleeps are bounded so a stop is noticed.
+inline void Net_Loop_Run(Net_Loop *loop) {
+    loop->running = true;
+    uint64_t last = net_loop_now_us();
+    while (loop->running) {
+        if (Net_Loop_Poll(loop, 0) > 0) {
+            last = net_loop_now_us();
+            continue;
+        }
+        loop->polls++;
+        if (loop->spin_us == NET_LOOP_BUSY ||
+            net_loop_now_us() - last < (uint64_t)loop->spin_us)
+            continue;
+        loop->sleeps++;
+        if (Net_Loop_Poll(loop, 100) > 0)
+            last = net_loop_now_us();
     }
 }
 
+inline void Net_Loop_Stop(Net_Loop *loop) {
+    loop->running = false;
+}
 
+#endif
@@ -31,6 +31,7 @@
 #define RAWTABLES_H
 
 #include <stdlib.h>
+#include <string.h>
 
 // #include "raw_bplustree.h"
 #include "rawstore.h"
@@ -207,7 +208,8 @@ public:
       rdma_table[CHECK] = true;
       rdma_table[SAV] = true;
 
-      rdmatablesize[SAV] = 100000 * 8 * 2; // todo,not hard coded
+      // the default, bench/smallbank sizes them from its account count
+      rdmatablesize[SAV] = 100000 * 8 * 2;
       rdmatablesize[CHECK] = 100000 * 8 * 2;
       break;
     default:
@@ -251,6 +253,26 @@ public:
       btrees[tableid].getWithRTM = !noInsert;
   }
 
+  // AddSchema for an rdma table created after the RDMA connection is set up.
+  // The table gets its own block instead of a piece of start_rdma, the caller
+  // registers it as a new region and sets rdma_off_mapping (RegisterTable of
+  // DBSSTX). rdmatablesize[tableid] has to be set before.
+  RdmaCuckooHash *AddRegionSchema(int tableid, int kl,
+                                  int commu_len, int versioned_len, int noversion_len, bool noInsert)
+  {
+    rdma_table[tableid] = false;
+    AddSchema(tableid, kl, commu_len, versioned_len, noversion_len, noInsert);
+
+    RdmaCuckooHash *t = RdmaCuckooHash_new(schemas[tableid].vlen + 64, rdmatablesize[tableid], NULL);
+    t->array = (char *)malloc(t->size);
+    memset(t->array, 0, t->size);
+    t->header = (RdmaArrayNode *)t->array;
+    rdmacuckoohash[tableid] = t;
+    rdma_off_mapping[tableid] = 0;
+    rdma_table[tableid] = true;
+    return t;
+  }
+
   __attribute__((always_inline)) uint64_t *Get(int tabid, uint64_t key)
   {
     assert(tabid <= CUST_INDEX);
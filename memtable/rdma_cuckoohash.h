@@ -28,81 +28,39 @@
 
 #ifndef RDMACUCKOOHASH_H
 #define RDMACUCKOOHASH_H
-typedef unsigned long long uint64_t;
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <iostream>
-#include "c_std/vector/Vector.h"
+#include "c_std/vector/vector.h"
+#include "microbench/rdma/crc64.h"
+#include "microbench/rdma/hash_func.h"
 
 // paddings for RDMA,may not be needed
 
 #define SLOT_PER_BUCKET 4
 #define MAX_TRY 500
-
-uint64_t MurmurHash64A(uint64_t key, unsigned int seed)
-{
-
-  const uint64_t m = 0xc6a4a7935bd1e995;
-  const int r = 47;
-  uint64_t h = seed ^ (8 * m);
-  const uint64_t *data = &key;
-  const uint64_t *end = data + 1;
-
-  while (data != end)
-  {
-    uint64_t k = *data++;
-    k *= m;
-    k ^= k >> r;
-    k *= m;
-    h ^= k;
-    h *= m;
-  }
-
-  const unsigned char *data2 = (const unsigned char *)data;
-
-  switch (8 & 7)
-  {
-  case 7:
-    h ^= uint64_t(data2[6]) << 48;
-  case 6:
-    h ^= uint64_t(data2[5]) << 40;
-  case 5:
-    h ^= uint64_t(data2[4]) << 32;
-  case 4:
-    h ^= uint64_t(data2[3]) << 24;
-  case 3:
-    h ^= uint64_t(data2[2]) << 16;
-  case 2:
-    h ^= uint64_t(data2[1]) << 8;
-  case 1:
-    h ^= uint64_t(data2[0]);
-    h *= m;
-  };
-
-  h ^= h >> r;
-  h *= m;
-  h ^= h >> r;
-
-  return h;
-}
+// keys of GetBatch whose buckets are prefetched together
+#define GET_BATCH 16
 
 struct RdmaArrayNode
 {
   uint64_t key;
   uint64_t index;
   bool valid;
+  uint64_t crc; // of the fields above, see crc_entry
 };
 
 struct RdmaCuckooHash
 {
   char *array;
-  int length;
-  int entrysize;
-  int bucketlength;
-  int bucketsize;
-  int size; // total
-  int data_offset;
-  int free_ptr;
+  uint64_t length;
+  uint64_t entrysize;
+  uint64_t bucketlength;
+  uint64_t bucketsize;
+  uint64_t size; // total, tables may exceed 2 GB
+  uint64_t data_offset;
+  uint64_t free_ptr;
   RdmaArrayNode *header;
 };
 
@@ -127,19 +85,37 @@ void RdmaCuckooHash_free(RdmaCuckooHash *it)
 {
 }
 
+// two seeds of RdmaHash, the second function was key % bucketlength, which
+// put runs of sequential keys into the same pairs of buckets
 uint64_t GetHash(RdmaCuckooHash *it, uint64_t key)
 {
-  return MurmurHash64A(key, 0xdeadbeef) % it->bucketlength;
+  return fastrange64(RdmaHash(key, RDMA_HASH_SEED0), it->bucketlength);
 }
 
 uint64_t GetHash2(RdmaCuckooHash *it, uint64_t key)
 {
-  return key % it->bucketlength;
+  return fastrange64(RdmaHash(key, RDMA_HASH_SEED1), it->bucketlength);
 }
-uint64_t get_dataloc(RdmaCuckooHash *it, int index)
+uint64_t get_dataloc(RdmaCuckooHash *it, uint64_t index)
 {
   return it->data_offset + it->entrysize * index;
 }
+
+// remote readers are cuckoo_travel of DBSSTX, see crc_entry
+void set_entry(RdmaArrayNode *node, uint64_t key, uint64_t index)
+{
+  node->key = key;
+  node->index = index;
+  node->valid = true;
+  __sync_synchronize();
+  node->crc = crc_entry(key, index, true);
+  __sync_synchronize();
+}
+
+bool entry_ok(const RdmaArrayNode *node)
+{
+  return node->crc == crc_entry(node->key, node->index, node->valid);
+}
 // void find_path(RdmaCuckooHash *it, uint64_t start_pos, vector<uint64_t> &pos_vec)
 void find_path(RdmaCuckooHash *it, uint64_t start_pos, Vector *pos_vec)
 {
@@ -181,10 +157,8 @@ void Insert(RdmaCuckooHash *it, uint64_t key, void *val)
       RdmaArrayNode *node = &it->header[p[slot] * SLOT_PER_BUCKET + i];
       if (node->valid == false)
       {
-        node->valid = true;
-        node->key = key;
-        node->index = it->free_ptr;
         memcpy((void *)(it->array + get_dataloc(it, it->free_ptr)), val, it->entrysize);
+        set_entry(node, key, it->free_ptr);
         it->free_ptr++;
         return;
       }
@@ -199,20 +173,17 @@ void Insert(RdmaCuckooHash *it, uint64_t key, void *val)
   int pointer = vector_size(pos_vec) - 1;
   // RdmaArrayNode *node = &it->header[pos_vec[pointer]];
   RdmaArrayNode *node = &it->header[*(uint64_t *)vector_at(pos_vec, pointer)];
-  node->valid = true;
   while (pointer > 0)
   {
     //    RdmaArrayNode *prev = &it->header[pos_vec[pointer - 1]];
     RdmaArrayNode *prev = &it->header[*(uint64_t *)vector_at(pos_vec, pointer - 1)];
-    node->key = prev->key;
-    node->index = prev->index;
+    set_entry(node, prev->key, prev->index);
     //            memcpy((void*)(node+1),(void*)(prev+1),entrysize);
     node = prev;
     pointer--;
   }
-  node->key = key;
-  node->index = it->free_ptr;
   memcpy((void *)(it->array + get_dataloc(it, it->free_ptr)), val, it->entrysize);
+  set_entry(node, key, it->free_ptr);
   it->free_ptr++;
 
   // ljh change free vector
@@ -239,6 +210,50 @@ uint64_t *Get(RdmaCuckooHash *it, uint64_t key)
   return NULL;
 }
 
+// Get of n keys, out[i] for keys[i]. The keys of a group are hashed
+// together with RdmaHashBatch, then both buckets of every key are prefetched
+// before the first one is read, so the cache misses of the group overlap
+// instead of following one another, and the values found are prefetched for
+// the caller.
+void GetBatch(RdmaCuckooHash *it, const uint64_t *keys, int n, uint64_t **out)
+{
+  RdmaArrayNode *buckets[GET_BATCH][2];
+  uint64_t h[2][GET_BATCH];
+  for (int base = 0; base < n; base += GET_BATCH)
+  {
+    int m = n - base < GET_BATCH ? n - base : GET_BATCH;
+    RdmaHashBatch(keys + base, m, RDMA_HASH_SEED0, h[0]);
+    RdmaHashBatch(keys + base, m, RDMA_HASH_SEED1, h[1]);
+    for (int k = 0; k < m; k++)
+    {
+      buckets[k][0] = &it->header[fastrange64(h[0][k], it->bucketlength) * SLOT_PER_BUCKET];
+      buckets[k][1] = &it->header[fastrange64(h[1][k], it->bucketlength) * SLOT_PER_BUCKET];
+      // an unaligned bucket touches up to three cache lines
+      for (int slot = 0; slot < 2; slot++)
+        for (uint64_t off = 0; off < it->bucketsize + 64; off += 64)
+          __builtin_prefetch((char *)buckets[k][slot] + off);
+    }
+    for (int k = 0; k < m; k++)
+    {
+      uint64_t key = keys[base + k];
+      out[base + k] = NULL;
+      for (int slot = 0; slot < 2 && out[base + k] == NULL; slot++)
+      {
+        for (int i = 0; i < SLOT_PER_BUCKET; i++)
+        {
+          RdmaArrayNode *node = &buckets[k][slot][i];
+          if (node->valid == true && node->key == key)
+          {
+            out[base + k] = (uint64_t *)(it->array + get_dataloc(it, node->index));
+            __builtin_prefetch(out[base + k]);
+            break;
+          }
+        }
+      }
+    }
+  }
+}
+
 void *Delete(RdmaCuckooHash *it, uint64_t key)
 {
   // TODO
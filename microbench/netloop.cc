@@ -0,0 +1,261 @@
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA for speedy distributed
+ *  in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS), Shanghai Jiao Tong University
+ *     All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+// Latency and server CPU cost of the Network_Node event loop.
+// Partition 0 serves echo requests with one Net_Loop thread over several
+// nodes, the other partitions run ping-pong clients, all on localhost.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+#include <sys/resource.h>
+
+#include "db/network_node.h"
+
+#define MAXTHREADS 64
+#define MAXSAMPLES (1 << 20)
+
+size_t total_partition;
+size_t current_partition;
+
+int partitions = 2;     // server partition plus client partitions
+int server_nodes = 1;   // nids served by the loop of partition 0
+int thrnum = 1;         // client threads per client partition
+int msg_size = 64;
+int duration = 1;       // seconds
+int spin_us = 50;       // as the RPC handler of DBSSTX
+bool csv = false;
+
+volatile int ready = 0;
+volatile bool stop = false;
+
+struct ClientResult {
+  uint64_t count;
+  uint64_t *samples;    // round trip times, ns
+  int nsamples;
+};
+
+ClientResult results[MAXTHREADS];
+
+static inline uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t thread_cpu_us() {
+  struct rusage ru;
+  getrusage(RUSAGE_THREAD, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL +
+    ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+void echo(void *arg, Network_Node *node, char *msg, int len, int pid, int nid) {
+  Network_Node_Send(node, pid, nid, msg, len);
+}
+
+struct ServerStat {
+  uint64_t cpu_us;
+  uint64_t wall_us;
+  uint64_t msgs, polls, sleeps;
+} server_stat;
+
+Net_Loop *loop;
+
+void* server(void *arg) {
+  Network_Node *nodes[NET_LOOP_MAX_NODES];
+  for (int i = 0; i < server_nodes; i++) {
+    nodes[i] = Network_Node_new(0, i, NULL);
+    Net_Loop_Register(loop, nodes[i], echo, NULL);
+  }
+  __sync_fetch_and_add(&ready, 1);
+
+  uint64_t cpu = thread_cpu_us();
+  uint64_t wall = now_ns();
+  Net_Loop_Run(loop);
+  server_stat.cpu_us = thread_cpu_us() - cpu;
+  server_stat.wall_us = (now_ns() - wall) / 1000;
+  server_stat.msgs = loop->msgs;
+  server_stat.polls = loop->polls;
+  server_stat.sleeps = loop->sleeps;
+
+  for (int i = 0; i < server_nodes; i++)
+    Network_Node_destroy(nodes[i]);
+  return NULL;
+}
+
+void* client(void *arg) {
+  int id = (long)arg;
+  int pid = 1 + id / thrnum;
+  int nid = id % thrnum;
+  int target = id % server_nodes;
+  ClientResult *r = &results[id];
+  r->count = 0;
+  r->nsamples = 0;
+  r->samples = (uint64_t *)malloc(sizeof(uint64_t) * MAXSAMPLES);
+
+  Network_Node *node = Network_Node_new(pid, nid, NULL);
+  char *buf = (char *)malloc(msg_size);
+  memset(buf, 0, msg_size);
+  int len;
+
+  // the first round trip sets up both connections
+  Network_Node_Send(node, 0, target, buf, msg_size);
+  Network_Node_Recv(node, &len, NULL, NULL);
+  __sync_fetch_and_add(&ready, 1);
+  while (ready >= 0);
+
+  while (!stop) {
+    uint64_t start = now_ns();
+    Network_Node_Send(node, 0, target, buf, msg_size);
+    // the client spins, so the latency difference comes from the server
+    while (Network_Node_tryRecv(node, &len, NULL, NULL) == NULL);
+    uint64_t lat = now_ns() - start;
+    if (r->nsamples < MAXSAMPLES)
+      r->samples[r->nsamples++] = lat;
+    r->count++;
+  }
+
+  free(buf);
+  Network_Node_destroy(node);
+  return NULL;
+}
+
+void usage() {
+  printf("usage: netloop [options]\n");
+  printf("  -part=N      partitions, partition 0 is the server (default 2)\n");
+  printf("  -nodes=N     nids served by the server loop (default 1)\n");
+  printf("  -thr=N       client threads per client partition (default 1)\n");
+  printf("  -size=N      message bytes (default 64)\n");
+  printf("  -dur=N       seconds (default 1)\n");
+  printf("  -spin=N      us the server spins before sleeping (default 50)\n");
+  printf("  -busy        server never sleeps\n");
+  printf("  -block       server sleeps as soon as it is idle\n");
+  printf("  -csv         print one CSV line\n");
+}
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    int n;
+    char junk;
+    if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0){
+      usage();
+      exit(0);
+    }
+    else if(sscanf(argv[i], "-part=%d%c", &n, &junk) == 1) {
+      partitions = n;
+    }else if(sscanf(argv[i], "-nodes=%d%c", &n, &junk) == 1) {
+      server_nodes = n;
+    }else if(sscanf(argv[i], "-thr=%d%c", &n, &junk) == 1) {
+      thrnum = n;
+    }else if(sscanf(argv[i], "-size=%d%c", &n, &junk) == 1) {
+      msg_size = n;
+    }else if(sscanf(argv[i], "-dur=%d%c", &n, &junk) == 1) {
+      duration = n;
+    }else if(sscanf(argv[i], "-spin=%d%c", &n, &junk) == 1) {
+      spin_us = n;
+    }else if(strcmp(argv[i], "-busy") == 0) {
+      spin_us = NET_LOOP_BUSY;
+    }else if(strcmp(argv[i], "-block") == 0) {
+      spin_us = NET_LOOP_BLOCK;
+    }else if(strcmp(argv[i], "-csv") == 0) {
+      csv = true;
+    }else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      usage();
+      exit(1);
+    }
+  }
+
+  int clients = (partitions - 1) * thrnum;
+  if (partitions < 2 || clients > MAXTHREADS || server_nodes < 1 ||
+      server_nodes > NET_LOOP_MAX_NODES || msg_size < 1) {
+    usage();
+    exit(1);
+  }
+  total_partition = partitions;
+  current_partition = 0;
+
+  loop = Net_Loop_new(spin_us);
+  pthread_t stid;
+  pthread_t tid[MAXTHREADS];
+  pthread_create(&stid, NULL, server, NULL);
+  while (ready < 1);
+  for (int i = 0; i < clients; i++)
+    pthread_create(&tid[i], NULL, client, (void *)(long)i);
+  while (ready < clients + 1);
+
+  ready = -1;
+  usleep(duration * 1000000);
+  stop = true;
+  for (int i = 0; i < clients; i++)
+    pthread_join(tid[i], NULL);
+  Net_Loop_Stop(loop);
+  pthread_join(stid, NULL);
+  Net_Loop_destroy(loop);
+
+  uint64_t total = 0;
+  int nsamples = 0;
+  for (int i = 0; i < clients; i++) {
+    total += results[i].count;
+    nsamples += results[i].nsamples;
+  }
+  uint64_t *all = (uint64_t *)malloc(sizeof(uint64_t) * (nsamples + 1));
+  uint64_t sum = 0;
+  nsamples = 0;
+  for (int i = 0; i < clients; i++) {
+    for (int j = 0; j < results[i].nsamples; j++) {
+      all[nsamples++] = results[i].samples[j];
+      sum += results[i].samples[j];
+    }
+    free(results[i].samples);
+  }
+  std::sort(all, all + nsamples);
+  double avg = nsamples ? (double)sum / nsamples / 1000 : 0;
+  double p50 = nsamples ? all[nsamples / 2] / 1000.0 : 0;
+  double p99 = nsamples ? all[(uint64_t)nsamples * 99 / 100] / 1000.0 : 0;
+  double cpu = server_stat.wall_us ? 100.0 * server_stat.cpu_us / server_stat.wall_us : 0;
+  free(all);
+
+  if (csv) {
+    printf("spin_us,partitions,nodes,clients,size,throughput,avg_us,p50_us,p99_us,server_cpu,polls,sleeps\n");
+    printf("%d,%d,%d,%d,%d,%.0f,%.2f,%.2f,%.2f,%.1f,%lu,%lu\n",
+           spin_us, partitions, server_nodes, clients, msg_size,
+           (double)total / duration, avg, p50, p99, cpu,
+           server_stat.polls, server_stat.sleeps);
+  } else {
+    printf("spin %d us, %d client partitions x %d threads -> %d server nodes, %d bytes\n",
+           spin_us, partitions - 1, thrnum, server_nodes, msg_size);
+    printf("throughput %.0f req/s\n", (double)total / duration);
+    printf("latency avg %.2f us p50 %.2f us p99 %.2f us\n", avg, p50, p99);
+    printf("server cpu %.1f%% (%lu msgs, %lu empty polls, %lu sleeps)\n",
+           cpu, server_stat.msgs, server_stat.polls, server_stat.sleeps);
+  }
+  return 0;
+}
@@ -0,0 +1,221 @@
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA
+ * for speedy distributed in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+// Local lookups of the remote hash tables one key at a time (Get) against
+// groups of keys (GetBatch), on tables far larger than the last level cache,
+// where every probe of Get waits for its own DRAM miss.
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pilaf.h"
+#include "rdma_clusterhash.h"
+
+#define MAX_BATCH 64
+
+const char *names = "cuckoo,cluster";
+uint64_t table_mb = 4096;
+int val_length = 64;
+double fill = 0.8;
+uint64_t ops = 10 * 1000 * 1000;
+const char *batches = "1,4,8,16";
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t xorshift(uint64_t *s) {
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+// a table of one type behind the two lookups being compared
+struct BatchTable {
+    void *table;
+    uint64_t len;
+    void (*insert)(void *table, uint64_t key, void *val);
+    uint64_t *(*get)(void *table, uint64_t key);
+    void (*get_batch)(void *table, const uint64_t *keys, int n,
+                      uint64_t **out);
+};
+
+static void cuckoo_insert(void *t, uint64_t key, void *val) {
+    Insert((Rdma_3_1_CuckooHash *)t, key, val);
+}
+static uint64_t *cuckoo_get(void *t, uint64_t key) {
+    return Get((Rdma_3_1_CuckooHash *)t, key);
+}
+static void cuckoo_get_batch(void *t, const uint64_t *keys, int n,
+                             uint64_t **out) {
+    GetBatch((Rdma_3_1_CuckooHash *)t, keys, n, out);
+}
+static void cluster_insert(void *t, uint64_t key, void *val) {
+    Insert((RdmaClusterHash *)t, key, val);
+}
+static uint64_t *cluster_get(void *t, uint64_t key) {
+    return Get((RdmaClusterHash *)t, key);
+}
+static void cluster_get_batch(void *t, const uint64_t *keys, int n,
+                              uint64_t **out) {
+    GetBatch((RdmaClusterHash *)t, keys, n, out);
+}
+
+// the table named name with about table_mb MB, NULL for an unknown name
+bool table_new(BatchTable *b, const char *name) {
+    uint64_t bytes = table_mb << 20;
+    // the footprint grows linearly with the length
+    if (strcmp(name, "cuckoo") == 0) {
+        uint64_t per = Rdma_3_1_CuckooHash_new(val_length, 1 << 20, NULL)->size;
+        b->len = (bytes << 20) / per;
+        Rdma_3_1_CuckooHash *it = Rdma_3_1_CuckooHash_new(val_length, b->len, NULL);
+        it->array = (char *)calloc(1, it->size);
+        it->header = (RdmaArrayNode *)it->array;
+        b->table = it;
+        b->insert = cuckoo_insert;
+        b->get = cuckoo_get;
+        b->get_batch = cuckoo_get_batch;
+    } else if (strcmp(name, "cluster") == 0) {
+        uint64_t per = RdmaClusterHash_new(val_length, 1 << 20, NULL)->size;
+        b->len = (bytes << 20) / per;
+        RdmaClusterHash *it = RdmaClusterHash_new(val_length, b->len, NULL);
+        it->array = (char *)calloc(1, it->size);
+        b->table = it;
+        b->insert = cluster_insert;
+        b->get = cluster_get;
+        b->get_batch = cluster_get_batch;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// lookups of keys in groups of batch, 1 for Get, returns Mops
+double run(BatchTable *b, const uint64_t *keys, int batch, uint64_t *sum) {
+    uint64_t *out[MAX_BATCH];
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i + batch <= ops; i += batch) {
+        if (batch == 1) {
+            out[0] = b->get(b->table, keys[i]);
+        } else {
+            b->get_batch(b->table, keys + i, batch, out);
+        }
+        // the values are read, as a transaction would
+        for (int k = 0; k < batch; k++)
+            *sum += out[k] != NULL ? *out[k] : 1;
+    }
+    return ops * 1000.0 / (now_ns() - start);
+}
+
+void usage() {
+    fprintf(stderr,
+            "usage: batch_get [-hash=NAME,...] [-mb=N] [-val=N] [-fill=R] "
+            "[-ops=N] [-batch=N,...]\n"
+            "  -hash  tables, from: cuckoo, cluster (default both)\n"
+            "  -mb    MB of a table (default 4096)\n"
+            "  -val   value bytes (default 64)\n"
+            "  -fill  loaded share of the entries (default 0.8)\n"
+            "  -ops   lookups per run (default 10000000)\n"
+            "  -batch keys per GetBatch, 1 for Get (default 1,4,8,16)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        int n;
+        double r;
+        char junk;
+        if (strncmp(argv[i], "-hash=", 6) == 0) {
+            names = argv[i] + 6;
+        } else if (sscanf(argv[i], "-mb=%d%c", &n, &junk) == 1 && n > 0) {
+            table_mb = n;
+        } else if (sscanf(argv[i], "-val=%d%c", &n, &junk) == 1 && n > 0) {
+            val_length = n;
+        } else if (sscanf(argv[i], "-fill=%lf%c", &r, &junk) == 1 && r > 0 &&
+                   r <= 1) {
+            fill = r;
+        } else if (sscanf(argv[i], "-ops=%d%c", &n, &junk) == 1 && n > 0) {
+            ops = n;
+        } else if (strncmp(argv[i], "-batch=", 7) == 0) {
+            batches = argv[i] + 7;
+        } else {
+            usage();
+        }
+    }
+
+    char *data = (char *)calloc(1, val_length);
+    uint64_t *keys = (uint64_t *)malloc(ops * sizeof(uint64_t));
+    char name[32];
+    for (const char *p = names; *p != '\0';) {
+        int len = strcspn(p, ",");
+        snprintf(name, sizeof(name), "%.*s", len, p);
+        p += len + (p[len] == ',');
+        BatchTable b;
+        if (!table_new(&b, name)) {
+            fprintf(stderr, "unknown table %s\n", name);
+            usage();
+        }
+        uint64_t loaded = b.len * fill;
+        if (loaded == 0) {
+            fprintf(stderr, "%s holds no keys at -mb=%lu -fill=%g\n", name,
+                    table_mb, fill);
+            usage();
+        }
+        for (uint64_t i = 0; i < loaded; i++) {
+            memcpy(data, &i, std::min(val_length, 8));
+            b.insert(b.table, i, data);
+        }
+        uint64_t seed = 0x2545f4914f6cdd1dULL;
+        for (uint64_t i = 0; i < ops; i++)
+            keys[i] = xorshift(&seed) % loaded;
+
+        double base = 0;
+        uint64_t sum = 0;
+        for (const char *q = batches; *q != '\0';) {
+            int batch = atoi(q);
+            q += strcspn(q, ",");
+            q += *q == ',';
+            if (batch < 1 || batch > MAX_BATCH)
+                usage();
+            double mops = run(&b, keys, batch, &sum);
+            if (base == 0)
+                base = mops;
+            printf("hash\t%s\tfunc\t%s\tmb\t%lu\tkeys\t%lu\tbatch\t%d\t"
+                   "mops\t%.2f\tspeedup\t%.2f\n",
+                   name, RDMA_HASH_NAME, table_mb, loaded, batch, mops,
+                   mops / base);
+        }
+        // keeps the value reads
+        if (sum == 0)
+            printf("\n");
+    }
+    return 0;
+}
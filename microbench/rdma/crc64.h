@@ -0,0 +1,73 @@
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA
+ * for speedy distributed in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+// CRC-64 of the ECMA-182 polynomial, bit-reflected as in xz. The remote hash
+// tables keep one in every index entry, so a one-sided reader can tell an
+// entry it read while a local writer was changing it.
+
+#ifndef RDMA_CRC64_H
+#define RDMA_CRC64_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC64_POLY 0xc96c5795d7870f42ULL
+
+// built on first use, threads racing on it write the same values
+inline const uint64_t *crc64_table() {
+    static uint64_t table[256];
+    static volatile bool ready = false;
+    if (!ready) {
+        for (int i = 0; i < 256; i++) {
+            uint64_t crc = i;
+            for (int b = 0; b < 8; b++)
+                crc = crc & 1 ? (crc >> 1) ^ CRC64_POLY : crc >> 1;
+            table[i] = crc;
+        }
+        __sync_synchronize();
+        ready = true;
+    }
+    return table;
+}
+
+inline uint64_t crc64(const void *data, size_t len) {
+    const uint64_t *table = crc64_table();
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t crc = ~0ULL;
+    for (size_t i = 0; i < len; i++)
+        crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Checksum of an index entry of the cuckoo tables (pilaf.h and
+// memtable/rdma_cuckoohash.h). The writer stores it after the other fields,
+// behind a barrier, and finishes each entry before the next store of a
+// cuckoo path. A one-sided reader that fetched an entry while it was being
+// written sees it mismatch and reads the bucket again.
+inline uint64_t crc_entry(uint64_t key, uint64_t index, bool valid) {
+    uint64_t words[3] = {key, index, valid};
+    return crc64(words, sizeof(words));
+}
+
+#endif
@@ -0,0 +1,201 @@
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA
+ * for speedy distributed in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+// Hash functions shared by the remote hash tables and the memtable.
+//
+// RdmaHash is the hash of the family chosen at compile time with
+// -DRDMA_HASH=<n>, every table of a build uses the same one:
+//   RDMA_HASH_MURMUR   MurmurHash64A, the default
+//   RDMA_HASH_XXH3     XXH3-64 of an 8-byte input, same values as xxhash
+//   RDMA_HASH_CRC32C   two rounds of the SSE4.2 crc32 instruction, -msse4.2
+//   RDMA_HASH_MULSHIFT multiply-shift, the cheapest, good in the high bits
+// A hash is reduced to a bucket with fastrange64, which keeps the high bits,
+// instead of %, which needs a division and keeps the low ones.
+// RdmaHash4, RdmaHash8 and RdmaHashBatch hash several keys in the lanes of
+// GCC vector types, compiled to AVX2 or AVX-512 when the target has them.
+
+#ifndef RDMA_HASH_FUNC_H
+#define RDMA_HASH_FUNC_H
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+#define RDMA_HASH_MURMUR 0
+#define RDMA_HASH_XXH3 1
+#define RDMA_HASH_CRC32C 2
+#define RDMA_HASH_MULSHIFT 3
+
+#ifndef RDMA_HASH
+#define RDMA_HASH RDMA_HASH_MURMUR
+#endif
+
+// seeds of the hash functions of a cuckoo table, one per function
+#define RDMA_HASH_SEED0 0xdeadbeef
+#define RDMA_HASH_SEED1 0x7ed55d16
+#define RDMA_HASH_SEED2 0xc761c23c
+
+typedef uint64_t rdma_hash_x4 __attribute__((vector_size(32)));
+typedef uint64_t rdma_hash_x8 __attribute__((vector_size(64)));
+
+// MurmurHash64A of a single 64-bit key
+inline uint64_t MurmurHash64A(uint64_t key, unsigned int seed) {
+    const uint64_t m = 0xc6a4a7935bd1e995;
+    const int r = 47;
+    uint64_t h = seed ^ (8 * m);
+
+    uint64_t k = key;
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// The families on one key or on the lanes of a vector, T is uint64_t or one
+// of the vector types, and the key is replaced by its hash. Only the shifts,
+// xors and multiplications they share are used, so the lanes give the same
+// values as the scalar form. Vectors are not returned by value, which would
+// depend on the ABI of the target.
+
+template <typename T> inline void murmur_lanes(T &h, unsigned int seed) {
+    const uint64_t m = 0xc6a4a7935bd1e995;
+    h *= m;
+    h ^= h >> 47;
+    h *= m;
+    h ^= seed ^ (8 * m);
+    h *= m;
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+}
+
+// XXH3_len_4to8_64b for len 8 with the default secret
+template <typename T> inline void xxh3_lanes(T &h, uint64_t seed) {
+    const uint64_t C = 0x9fb21c651e98df25ULL;
+    seed ^= (uint64_t)__builtin_bswap32((uint32_t)seed) << 32;
+    uint64_t bitflip = (0x1cad21f72c81017cULL ^ 0xdb979083e96dd4deULL) - seed;
+    // the two halves of the key swapped, then the rrmxmx avalanche
+    h = ((h << 32) | (h >> 32)) ^ bitflip;
+    h ^= ((h << 49) | (h >> 15)) ^ ((h << 24) | (h >> 40));
+    h *= C;
+    h ^= (h >> 35) + 8;
+    h *= C;
+    h ^= h >> 28;
+}
+
+// an odd multiplier of its own for every seed
+template <typename T> inline void mulshift_lanes(T &h, uint64_t seed) {
+    h *= (seed * 2 + 1) * 0x9e3779b97f4a7c15ULL;
+}
+
+#if defined(__SSE4_2__)
+// CRC32C is linear in the key, multiplying by a seed dependent odd number
+// first keeps two seeds from colliding on the same pairs of keys
+inline uint64_t crc32c_hash(uint64_t key, uint64_t seed) {
+    uint64_t k = key * ((seed * 2 + 1) * 0x9e3779b97f4a7c15ULL);
+    uint64_t lo = _mm_crc32_u64((uint32_t)seed, k);
+    uint64_t hi = _mm_crc32_u64(lo, k);
+    return hi << 32 | lo;
+}
+#endif
+
+#if RDMA_HASH == RDMA_HASH_MURMUR
+#define RDMA_HASH_NAME "murmur"
+#define RDMA_HASH_LANES(k, seed) murmur_lanes(k, (unsigned int)(seed))
+#elif RDMA_HASH == RDMA_HASH_XXH3
+#define RDMA_HASH_NAME "xxh3"
+#define RDMA_HASH_LANES(k, seed) xxh3_lanes(k, seed)
+#elif RDMA_HASH == RDMA_HASH_CRC32C
+#if !defined(__SSE4_2__)
+#error "RDMA_HASH_CRC32C needs -msse4.2"
+#endif
+#define RDMA_HASH_NAME "crc32c"
+#elif RDMA_HASH == RDMA_HASH_MULSHIFT
+#define RDMA_HASH_NAME "mulshift"
+#define RDMA_HASH_LANES(k, seed) mulshift_lanes(k, seed)
+#else
+#error "unknown RDMA_HASH"
+#endif
+
+inline uint64_t RdmaHash(uint64_t key, uint64_t seed) {
+#if RDMA_HASH == RDMA_HASH_CRC32C
+    return crc32c_hash(key, seed);
+#else
+    RDMA_HASH_LANES(key, seed);
+    return key;
+#endif
+}
+
+// keys[0, 4) to out[0, 4)
+inline void RdmaHash4(const uint64_t *keys, uint64_t seed, uint64_t *out) {
+#if RDMA_HASH == RDMA_HASH_CRC32C
+    // no vector crc32, four independent ones fill its pipeline
+    for (int i = 0; i < 4; i++)
+        out[i] = crc32c_hash(keys[i], seed);
+#else
+    rdma_hash_x4 k;
+    memcpy(&k, keys, sizeof(k));
+    RDMA_HASH_LANES(k, seed);
+    memcpy(out, &k, sizeof(k));
+#endif
+}
+
+// keys[0, 8) to out[0, 8)
+inline void RdmaHash8(const uint64_t *keys, uint64_t seed, uint64_t *out) {
+#if RDMA_HASH == RDMA_HASH_CRC32C
+    for (int i = 0; i < 8; i++)
+        out[i] = crc32c_hash(keys[i], seed);
+#else
+    rdma_hash_x8 k;
+    memcpy(&k, keys, sizeof(k));
+    RDMA_HASH_LANES(k, seed);
+    memcpy(out, &k, sizeof(k));
+#endif
+}
+
+inline void RdmaHashBatch(const uint64_t *keys, int n, uint64_t seed,
+                          uint64_t *out) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+        RdmaHash8(keys + i, seed, out + i);
+    for (; i + 4 <= n; i += 4)
+        RdmaHash4(keys + i, seed, out + i);
+    for (; i < n; i++)
+        out[i] = RdmaHash(keys[i], seed);
+}
+
+// h mapped to [0, n) by its high bits, in place of h % n
+inline uint64_t fastrange64(uint64_t h, uint64_t n) {
+    return (uint64_t)(((unsigned __int128)h * n) >> 64);
+}
+
+#endif
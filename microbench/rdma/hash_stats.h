@@ -0,0 +1,88 @@
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA
+ * for speedy distributed in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+/*
+ *  Occupancy and footprint of a remote hash table. Every variant fills a
+ *  HashStats by walking its own layout: how many keys it holds, how much of
+ *  its overflow area (chain or indirect nodes) is in use, the bytes that do
+ *  not hold a live value, and for each key the number of RDMA reads a remote
+ *  lookup of it takes with the stages of remote_hash.h, value read included.
+ */
+
+#ifndef RDMA_HASH_STATS_H
+#define RDMA_HASH_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// reads per lookup, longer lookups count in the last bucket
+#define HASH_MAX_READS 8
+
+struct HashStats {
+    uint64_t keys;           // present keys
+    uint64_t capacity;       // values the table has room for
+    uint64_t overflow_used;  // chain or indirect nodes in use
+    uint64_t overflow_total; // 0 for tables without an overflow area
+    uint64_t footprint;      // bytes of the table
+    uint64_t wasted;         // footprint not holding a live value
+    uint64_t reads[HASH_MAX_READS + 1]; // keys by the reads to find them
+};
+
+inline void HashStats_init(HashStats *s) { memset(s, 0, sizeof(HashStats)); }
+
+inline void HashStats_key(HashStats *s, uint64_t reads) {
+    s->keys++;
+    s->reads[reads < HASH_MAX_READS ? reads : HASH_MAX_READS]++;
+}
+
+// footprint and wasted bytes, once the keys are counted
+inline void HashStats_finish(HashStats *s, uint64_t footprint,
+                             uint64_t entrysize) {
+    s->footprint = footprint;
+    s->wasted = footprint - s->keys * entrysize;
+}
+
+// mean reads of a lookup, every present key looked up once
+inline double HashStats_reads(const HashStats *s) {
+    uint64_t sum = 0;
+    for (int i = 1; i <= HASH_MAX_READS; i++)
+        sum += s->reads[i] * i;
+    return s->keys ? sum * 1.0 / s->keys : 0;
+}
+
+inline void HashStats_print(const HashStats *s, const char *name, FILE *f) {
+    fprintf(f,
+            "%s\tkeys\t%lu\toccupancy\t%.3f\toverflow\t%lu/%lu\t"
+            "bytes/key\t%.1f\twasted\t%lu\treads/lookup\t%.3f\treads",
+            name, s->keys, s->capacity ? s->keys * 1.0 / s->capacity : 0,
+            s->overflow_used, s->overflow_total,
+            s->keys ? s->footprint * 1.0 / s->keys : 0, s->wasted,
+            HashStats_reads(s));
+    for (int i = 1; i <= HASH_MAX_READS; i++)
+        fprintf(f, "\t%lu", s->reads[i]);
+    fprintf(f, "\n");
+}
+
+#endif
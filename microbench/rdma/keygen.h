@@ -0,0 +1,209 @@
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA
+ * for speedy distributed in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+/*
+ *  Key generators of the benchmark drivers. A generator draws keys in
+ *  [0, n) from its own random state, so every thread keeps one.
+ *
+ *    uniform              every key alike
+ *    zipf:THETA           key 0 hottest, rank r drawn with weight 1/(r+1)^THETA
+ *    hotspot:FRAC:PROB    PROB of the draws go to the first FRAC of the keys
+ *    latest:THETA         zipf over recency, key n-1 hottest; KeyGen_grow
+ *                         moves the head as keys are inserted
+ *    shift:FRAC:PROB:OPS  hotspot whose hot range moves on by its own size
+ *                         every OPS draws
+ *
+ *  Zipf uses rejection-inversion sampling (Hormann and Derflinger), which
+ *  needs no table over n and takes about one iteration per draw.
+ */
+
+#ifndef RDMA_KEYGEN_H
+#define RDMA_KEYGEN_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+enum { KEY_UNIFORM, KEY_ZIPF, KEY_HOTSPOT, KEY_LATEST, KEY_SHIFT };
+
+#define KEYGEN_NAMES "uniform, zipf:THETA, hotspot:FRAC:PROB, "          \
+                     "latest:THETA, shift:FRAC:PROB:OPS"
+
+struct KeyGen {
+    int type;
+    uint64_t n;
+    uint64_t state;
+
+    // zipf and latest
+    double theta;
+    double h_x1; // hIntegral(1.5) - 1
+    double h_n;  // hIntegral(n + 0.5)
+    double s;
+
+    // hotspot and shift
+    double hot_frac;
+    double hot_prob;
+    uint64_t hot_n;
+    uint64_t hot_base;
+    uint64_t shift_ops;
+    uint64_t ops;
+};
+
+inline uint64_t keygen_rand(KeyGen *g) {
+    // xorshift64*
+    g->state ^= g->state >> 12;
+    g->state ^= g->state << 25;
+    g->state ^= g->state >> 27;
+    return g->state * 2685821657736338717ULL;
+}
+
+// uniform in [0, 1)
+inline double keygen_double(KeyGen *g) {
+    return (keygen_rand(g) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// log1p(x) / x and expm1(x) / x, precise around 0
+inline double zipf_helper1(double x) {
+    if (fabs(x) > 1e-8)
+        return log1p(x) / x;
+    return 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+inline double zipf_helper2(double x) {
+    if (fabs(x) > 1e-8)
+        return expm1(x) / x;
+    return 1 + x * 0.5 * (1 + x * (1.0 / 3) * (1 + 0.25 * x));
+}
+
+inline double zipf_h(KeyGen *g, double x) { return exp(-g->theta * log(x)); }
+
+inline double zipf_hintegral(KeyGen *g, double x) {
+    double logx = log(x);
+    return zipf_helper2((1 - g->theta) * logx) * logx;
+}
+
+inline double zipf_hintegral_inv(KeyGen *g, double x) {
+    double t = x * (1 - g->theta);
+    if (t < -1)
+        t = -1;
+    return exp(zipf_helper1(t) * x);
+}
+
+// rank in [0, n), 0 the most frequent
+inline uint64_t zipf_next(KeyGen *g) {
+    while (true) {
+        double u = g->h_n + keygen_double(g) * (g->h_x1 - g->h_n);
+        double x = zipf_hintegral_inv(g, u);
+        uint64_t k = (uint64_t)(x + 0.5);
+        if (k < 1)
+            k = 1;
+        else if (k > g->n)
+            k = g->n;
+        if (k - x <= g->s || u >= zipf_hintegral(g, k + 0.5) - zipf_h(g, k))
+            return k - 1;
+    }
+}
+
+// change the key range, keeping the random state
+inline void KeyGen_grow(KeyGen *g, uint64_t n) {
+    g->n = n;
+    if (g->type == KEY_ZIPF || g->type == KEY_LATEST)
+        g->h_n = zipf_hintegral(g, n + 0.5);
+    if (g->type == KEY_HOTSPOT || g->type == KEY_SHIFT) {
+        g->hot_n = (uint64_t)(n * g->hot_frac);
+        if (g->hot_n < 1)
+            g->hot_n = 1;
+    }
+}
+
+// set up a generator over [0, n), the parameters come from KeyGen_parse
+inline void KeyGen_init(KeyGen *g, uint64_t n, uint64_t seed) {
+    // the state must not be 0
+    g->state = seed * 0x9e3779b97f4a7c15ULL + 0x2545f4914f6cdd1dULL;
+    if (g->state == 0)
+        g->state = 1;
+    g->hot_base = 0;
+    g->ops = 0;
+    if (g->type == KEY_ZIPF || g->type == KEY_LATEST) {
+        g->h_x1 = zipf_hintegral(g, 1.5) - 1;
+        g->s = 2 - zipf_hintegral_inv(g, zipf_hintegral(g, 2.5) - zipf_h(g, 2));
+    }
+    KeyGen_grow(g, n);
+}
+
+// returns false on a malformed spec
+inline bool KeyGen_parse(KeyGen *g, const char *spec) {
+    char junk;
+    memset(g, 0, sizeof(KeyGen));
+    if (strcmp(spec, "uniform") == 0) {
+        g->type = KEY_UNIFORM;
+        return true;
+    }
+    if (sscanf(spec, "zipf:%lf%c", &g->theta, &junk) == 1) {
+        g->type = KEY_ZIPF;
+        return g->theta > 0;
+    }
+    if (sscanf(spec, "latest:%lf%c", &g->theta, &junk) == 1) {
+        g->type = KEY_LATEST;
+        return g->theta > 0;
+    }
+    if (sscanf(spec, "hotspot:%lf:%lf%c", &g->hot_frac, &g->hot_prob,
+               &junk) == 2) {
+        g->type = KEY_HOTSPOT;
+    } else if (sscanf(spec, "shift:%lf:%lf:%lu%c", &g->hot_frac, &g->hot_prob,
+                      &g->shift_ops, &junk) == 3) {
+        g->type = KEY_SHIFT;
+        if (g->shift_ops == 0)
+            return false;
+    } else {
+        return false;
+    }
+    return g->hot_frac > 0 && g->hot_frac < 1 && g->hot_prob >= 0 &&
+           g->hot_prob <= 1;
+}
+
+inline uint64_t KeyGen_next(KeyGen *g) {
+    switch (g->type) {
+    case KEY_ZIPF:
+        return zipf_next(g);
+    case KEY_LATEST:
+        return g->n - 1 - zipf_next(g);
+    case KEY_SHIFT:
+        if (++g->ops % g->shift_ops == 0)
+            g->hot_base = (g->hot_base + g->hot_n) % g->n;
+        // fall through
+    case KEY_HOTSPOT:
+        if (keygen_double(g) < g->hot_prob)
+            return (g->hot_base + keygen_rand(g) % g->hot_n) % g->n;
+        if (g->hot_n == g->n)
+            return keygen_rand(g) % g->n;
+        return (g->hot_base + g->hot_n + keygen_rand(g) % (g->n - g->hot_n)) %
+               g->n;
+    default:
+        return keygen_rand(g) % g->n;
+    }
+}
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA
+ * for speedy distributed in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+/*
+ *  Log-bucketed latency histogram in the way of HdrHistogram. Values below
+ *  2^HIST_SUB_BITS have a bucket each, above that every power of two is
+ *  split in 2^HIST_SUB_BITS buckets, so a percentile is off by less than
+ *  1/2^HIST_SUB_BITS of its value. Each thread records into its own
+ *  histogram, merging adds the buckets, and the serialized form only carries
+ *  the buckets in use so partitions can ship it to the one that reports.
+ */
+
+#ifndef RDMA_LATENCY_HIST_H
+#define RDMA_LATENCY_HIST_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct LatencyHist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+inline void LatencyHist_init(LatencyHist *h) {
+    memset(h, 0, sizeof(LatencyHist));
+}
+
+inline int hist_index(uint64_t v) {
+    if (v < (1UL << HIST_SUB_BITS))
+        return v;
+    int shift = 63 - __builtin_clzl(v) - HIST_SUB_BITS;
+    return (shift << HIST_SUB_BITS) + (v >> shift);
+}
+
+// the largest value of bucket i
+inline uint64_t hist_value(int i) {
+    if (i < (1 << HIST_SUB_BITS))
+        return i;
+    int shift = (i >> HIST_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)(i - (shift << HIST_SUB_BITS)) << shift;
+    return low + (1UL << shift) - 1;
+}
+
+inline void LatencyHist_record(LatencyHist *h, uint64_t v) {
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+inline void LatencyHist_merge(LatencyHist *dst, const LatencyHist *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+// the value below which a fraction p of the samples fall
+inline uint64_t LatencyHist_percentile(const LatencyHist *h, double p) {
+    uint64_t rank = (uint64_t)(p * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+inline double LatencyHist_mean(const LatencyHist *h) {
+    return h->count ? (double)h->sum / h->count : 0;
+}
+
+// bytes LatencyHist_serialize needs at most
+#define HIST_SERIAL_MAX (3 * 8 + 4 + HIST_BUCKETS * 12)
+
+// count, sum, max, the number of buckets in use and (index, count) of each,
+// returns the length
+inline int LatencyHist_serialize(const LatencyHist *h, char *buf) {
+    char *p = buf;
+    memcpy(p, &h->count, 8);
+    memcpy(p + 8, &h->sum, 8);
+    memcpy(p + 16, &h->max, 8);
+    p += 28;
+    uint32_t used = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if (h->buckets[i] == 0)
+            continue;
+        uint32_t idx = i;
+        memcpy(p, &idx, 4);
+        memcpy(p + 4, &h->buckets[i], 8);
+        p += 12;
+        used++;
+    }
+    memcpy(buf + 24, &used, 4);
+    return p - buf;
+}
+
+// merge a serialized histogram into h, returns the bytes consumed
+inline int LatencyHist_merge_serialized(LatencyHist *h, const char *buf) {
+    uint64_t count, sum, max;
+    uint32_t used;
+    memcpy(&count, buf, 8);
+    memcpy(&sum, buf + 8, 8);
+    memcpy(&max, buf + 16, 8);
+    memcpy(&used, buf + 24, 4);
+    const char *p = buf + 28;
+    for (uint32_t j = 0; j < used; j++, p += 12) {
+        uint32_t idx;
+        uint64_t n;
+        memcpy(&idx, p, 4);
+        memcpy(&n, p + 4, 8);
+        // the buffer comes from another partition
+        assert(idx < HIST_BUCKETS);
+        h->buckets[idx] += n;
+    }
+    h->count += count;
+    h->sum += sum;
+    if (max > h->max)
+        h->max = max;
+    return p - buf;
+}
+
+// one line of count, mean and percentiles, the values are in ns and printed
+// in us
+inline void LatencyHist_print(const LatencyHist *h, const char *name,
+                              FILE *out) {
+    fprintf(out,
+            "%s\tcount\t%lu\tavg\t%.2f\tp50\t%.2f\tp90\t%.2f\tp99\t%.2f\t"
+            "p99.9\t%.2f\tmax\t%.2f\n",
+            name, h->count, LatencyHist_mean(h) / 1000,
+            LatencyHist_percentile(h, 0.5) / 1000.0,
+            LatencyHist_percentile(h, 0.9) / 1000.0,
+            LatencyHist_percentile(h, 0.99) / 1000.0,
+            LatencyHist_percentile(h, 0.999) / 1000.0, h->max / 1000.0);
+}
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA
+ * for speedy distributed in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+// GetBatch of the cuckoo hash the rdma tables of DBSSTX live in
+// (memtable/rdma_cuckoohash.h) against its Get. The same keys, loaded and
+// missing ones mixed, are looked up both ways with batch sizes around
+// GET_BATCH, then each lookup is timed. Exits non-zero on the first key
+// the two disagree on.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "memtable/rdma_cuckoohash.h"
+
+#define VAL_LENGTH 64
+
+uint64_t len = 1 << 24;
+uint64_t ops = 10 * 1000 * 1000;
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t xorshift(uint64_t *s) {
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+// compares GetBatch of n keys with Get of each, false on a mismatch
+bool check(RdmaCuckooHash *it, const uint64_t *keys, int n) {
+    uint64_t *out[4 * GET_BATCH];
+    GetBatch(it, keys, n, out);
+    for (int k = 0; k < n; k++) {
+        if (out[k] != Get(it, keys[k])) {
+            fprintf(stderr, "FAIL key %lu of a batch of %d\n", keys[k], n);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        int n;
+        char junk;
+        if (sscanf(argv[i], "-len=%d%c", &n, &junk) == 1 && n > 0) {
+            len = n;
+        } else if (sscanf(argv[i], "-ops=%d%c", &n, &junk) == 1 && n > 0) {
+            ops = n;
+        } else {
+            fprintf(stderr, "usage: memtable_batch [-len=N] [-ops=N]\n"
+                            "  -len  entries of the table (default 16M)\n"
+                            "  -ops  timed lookups (default 10000000)\n");
+            return 1;
+        }
+    }
+
+    RdmaCuckooHash *it = RdmaCuckooHash_new(VAL_LENGTH, len, NULL);
+    it->array = (char *)calloc(1, it->size);
+    it->header = (RdmaArrayNode *)it->array;
+    char val[VAL_LENGTH];
+    memset(val, 0, sizeof(val));
+    uint64_t loaded = len * 0.8;
+    for (uint64_t i = 0; i < loaded; i++) {
+        memcpy(val, &i, sizeof(i));
+        Insert(it, i, val);
+    }
+
+    // every other key is missing
+    uint64_t *keys = (uint64_t *)malloc(ops * sizeof(uint64_t));
+    uint64_t seed = 0x2545f4914f6cdd1dULL;
+    for (uint64_t i = 0; i < ops; i++)
+        keys[i] = xorshift(&seed) % (2 * loaded);
+
+    // short groups, one group and groups that span GET_BATCH
+    int sizes[] = {1, 3, GET_BATCH, GET_BATCH + 1, 2 * GET_BATCH + 5,
+                   4 * GET_BATCH};
+    bool ok = true;
+    for (int s = 0; ok && s < 6; s++) {
+        for (uint64_t i = 0; ok && i + sizes[s] <= 100000; i += sizes[s])
+            ok = check(it, keys + i, sizes[s]);
+    }
+    if (!ok) {
+        printf("failed\n");
+        return 1;
+    }
+
+    uint64_t sum = 0;
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < ops; i++) {
+        uint64_t *v = Get(it, keys[i]);
+        sum += v != NULL ? *v : 1;
+    }
+    double get = ops * 1000.0 / (now_ns() - start);
+
+    uint64_t *out[GET_BATCH];
+    start = now_ns();
+    for (uint64_t i = 0; i + GET_BATCH <= ops; i += GET_BATCH) {
+        GetBatch(it, keys + i, GET_BATCH, out);
+        for (int k = 0; k < GET_BATCH; k++)
+            sum += out[k] != NULL ? *out[k] : 1;
+    }
+    double batch = ops * 1000.0 / (now_ns() - start);
+
+    printf("ok\tlen\t%lu\tget mops\t%.2f\tbatch mops\t%.2f\tspeedup\t%.2f\n",
+           len, get, batch, batch / get);
+    // keeps the value reads
+    if (sum == 0)
+        printf("\n");
+    return 0;
+}
@@ -24,68 +24,28 @@
 
 #ifndef RDMA_31_CUCKOOHASH_H
 #define RDMA_31_CUCKOOHASH_H
-typedef unsigned long long uint64_t;
-typedef unsigned int uint32_t;
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <iostream>
-#include "c_std/vector/Vector.h"
+#include "c_std/vector/vector.h"
+#include "crc64.h"
+#include "hash_func.h"
+#include "hash_stats.h"
 
 // paddings for RDMA,may not be needed
 
 #define SLOT_PER_BUCKET 1
 #define MAX_TRY 500
-
-uint64_t MurmurHash64A(uint64_t key, unsigned int seed)
-{
-    const uint64_t m = 0xc6a4a7935bd1e995;
-    const uint64_t r = 47;
-    uint64_t h = seed ^ (8 * m);
-    const uint64_t *data = &key;
-    const uint64_t *end = data + 1;
-
-    while (data != end)
-    {
-        uint64_t k = *data++;
-        k *= m;
-        k ^= k >> r;
-        k *= m;
-        h ^= k;
-        h *= m;
-    }
-
-    const unsigned char *data2 = (const unsigned char *)data;
-
-    switch (8 & 7)
-    {
-    case 7:
-        h ^= uint64_t(data2[6]) << 48;
-    case 6:
-        h ^= uint64_t(data2[5]) << 40;
-    case 5:
-        h ^= uint64_t(data2[4]) << 32;
-    case 4:
-        h ^= uint64_t(data2[3]) << 24;
-    case 3:
-        h ^= uint64_t(data2[2]) << 16;
-    case 2:
-        h ^= uint64_t(data2[1]) << 8;
-    case 1:
-        h ^= uint64_t(data2[0]);
-        h *= m;
-    };
-
-    h ^= h >> r;
-    h *= m;
-    h ^= h >> r;
-
-    return h;
-}
+// keys of GetBatch whose buckets are prefetched together
+#define GET_BATCH 16
 
 struct RdmaArrayNode
 {
     uint64_t key;
     uint64_t index;
     bool valid;
+    uint64_t crc; // of the fields above, see crc_entry
 };
 struct Rdma_3_1_CuckooHash
 {
@@ -121,32 +81,44 @@ Rdma_3_1_CuckooHash *Rdma_3_1_CuckooHash_new(int esize, int len, char *arr)
 void Rdma_3_1_CuckooHash_free(Rdma_3_1_CuckooHash *it)
 {
 }
+// RdmaHash under three seeds. A table with one slot per bucket fills to
+// about 0.91 with independent functions, key % bucketlength went further
+// only for dense sequential keys.
 uint64_t GetHash(Rdma_3_1_CuckooHash *it, uint64_t key)
 {
-    return MurmurHash64A(key, 0xdeadbeef) % it->bucketlength;
+    return fastrange64(RdmaHash(key, RDMA_HASH_SEED0), it->bucketlength);
 }
 
-uint64_t GetHash3(Rdma_3_1_CuckooHash *it, uint64_t key)
-{
-    return key % it->bucketlength;
-}
 uint64_t GetHash2(Rdma_3_1_CuckooHash *it, uint64_t key)
 {
-    uint32_t a = key;
-    a = (a + 0x7ed55d16) + (a << 12);
-    a = (a ^ 0xc761c23c) ^ (a >> 19);
-    a = (a + 0x165667b1) + (a << 5);
-    a = (a + 0xd3a2646c) ^ (a << 9);
-    a = (a + 0xfd7046c5) + (a << 3);
-    a = (a ^ 0xb55a4f09) ^ (a >> 16);
+    return fastrange64(RdmaHash(key, RDMA_HASH_SEED1), it->bucketlength);
+}
 
-    return (a) % it->bucketlength;
+uint64_t GetHash3(Rdma_3_1_CuckooHash *it, uint64_t key)
+{
+    return fastrange64(RdmaHash(key, RDMA_HASH_SEED2), it->bucketlength);
 }
 
 uint64_t get_dataloc(Rdma_3_1_CuckooHash *it, uint64_t index)
 {
     return it->data_offset + it->entrysize * index;
 }
+
+// see crc_entry
+void set_entry(RdmaArrayNode *node, uint64_t key, uint64_t index)
+{
+    node->key = key;
+    node->index = index;
+    node->valid = true;
+    __sync_synchronize();
+    node->crc = crc_entry(key, index, true);
+    __sync_synchronize();
+}
+
+bool entry_ok(const RdmaArrayNode *node)
+{
+    return node->crc == crc_entry(node->key, node->index, node->valid);
+}
 // void find_path(Rdma_3_1_CuckooHash *it, uint64_t start_pos, vector<uint64_t> &pos_vec)
 void find_path(Rdma_3_1_CuckooHash *it, uint64_t start_pos, Vector *pos_vec)
 {
@@ -190,7 +162,7 @@ void find_path(Rdma_3_1_CuckooHash *it, uint64_t start_pos, Vector *pos_vec)
     //        assert(false);
 }
 
-void Insert(Rdma_3_1_CuckooHash *it, uint64_t key, void *val)
+bool Insert(Rdma_3_1_CuckooHash *it, uint64_t key, void *val)
 {
     uint64_t p[3];
     p[0] = GetHash(it, key);
@@ -203,12 +175,10 @@ void Insert(Rdma_3_1_CuckooHash *it, uint64_t key, void *val)
             RdmaArrayNode *node = &it->header[p[slot] * SLOT_PER_BUCKET + i];
             if (node->valid == false)
             {
-                node->valid = true;
-                node->key = key;
-                node->index = it->free_ptr;
                 memcpy((void *)(it->array + get_dataloc(it, it->free_ptr)), val, it->entrysize);
+                set_entry(node, key, it->free_ptr);
                 it->free_ptr++;
-                return;
+                return true;
             }
         }
     }
@@ -220,32 +190,30 @@ void Insert(Rdma_3_1_CuckooHash *it, uint64_t key, void *val)
     find_path(it, kick_pos, pos_vec);
     if (vector_size(pos_vec) == 0)
     {
-        printf("fail when inserting %d\n", key);
         //        assert(false);
+        vector_deallocate(pos_vec);
+        return false;
     }
     uint64_t pointer = vector_size(pos_vec) - 1;
     // RdmaArrayNode *node = &it->header[pos_vec[pointer]];
     RdmaArrayNode *node = &it->header[*(uint64_t *)vector_at(pos_vec, pointer)];
     //    assert(node->valid == false);
-    node->valid = true;
     while (pointer > 0)
     {
         //    RdmaArrayNode *prev = &it->header[pos_vec[pointer - 1]];
         RdmaArrayNode *prev = &it->header[*(uint64_t *)vector_at(pos_vec, pointer - 1)];
-        node->key = prev->key;
-        node->index = prev->index;
+        set_entry(node, prev->key, prev->index);
         //            memcpy((void*)(node+1),(void*)(prev+1),entrysize);
         node = prev;
         pointer--;
     }
-    node->key = key;
-    node->index = it->free_ptr;
     memcpy((void *)(it->array + get_dataloc(it, it->free_ptr)), val, it->entrysize);
+    set_entry(node, key, it->free_ptr);
     it->free_ptr++;
 
     // ljh change free vector
     vector_deallocate(pos_vec);
-    return;
+    return true;
 }
 
 uint64_t *Get(Rdma_3_1_CuckooHash *it, uint64_t key)
@@ -270,6 +238,51 @@ uint64_t *Get(Rdma_3_1_CuckooHash *it, uint64_t key)
     return NULL;
 }
 
+// Get of n keys, out[i] for keys[i]. The keys of a group are hashed
+// together with RdmaHashBatch, then the three buckets of every key are
+// prefetched before the first one is read, so the cache misses of the group
+// overlap instead of following one another, and the values found are
+// prefetched for the caller.
+void GetBatch(Rdma_3_1_CuckooHash *it, const uint64_t *keys, int n, uint64_t **out)
+{
+    static const uint64_t seeds[3] = {RDMA_HASH_SEED0, RDMA_HASH_SEED1,
+                                      RDMA_HASH_SEED2};
+    uint64_t h[3][GET_BATCH];
+    uint64_t p[GET_BATCH][3];
+    for (int base = 0; base < n; base += GET_BATCH)
+    {
+        int m = n - base < GET_BATCH ? n - base : GET_BATCH;
+        for (int slot = 0; slot < 3; slot++)
+            RdmaHashBatch(keys + base, m, seeds[slot], h[slot]);
+        for (int k = 0; k < m; k++)
+        {
+            for (int slot = 0; slot < 3; slot++)
+            {
+                p[k][slot] = fastrange64(h[slot][k], it->bucketlength);
+                __builtin_prefetch(&it->header[p[k][slot] * SLOT_PER_BUCKET]);
+            }
+        }
+        for (int k = 0; k < m; k++)
+        {
+            uint64_t key = keys[base + k];
+            out[base + k] = NULL;
+            for (int slot = 0; slot < 3 && out[base + k] == NULL; slot++)
+            {
+                for (uint64_t i = 0; i < SLOT_PER_BUCKET; i++)
+                {
+                    RdmaArrayNode *node = &it->header[p[k][slot] * SLOT_PER_BUCKET + i];
+                    if (node->valid == true && node->key == key)
+                    {
+                        out[base + k] = (uint64_t *)(it->array + get_dataloc(it, node->index));
+                        __builtin_prefetch(out[base + k]);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
 uint64_t read(Rdma_3_1_CuckooHash *it, uint64_t key)
 {
     uint64_t p[3];
@@ -288,7 +301,7 @@ uint64_t read(Rdma_3_1_CuckooHash *it, uint64_t key)
             }
         }
     }
-    printf("%d fail\n", key);
+    printf("%lu fail\n", key);
     //    assert(false);
     return NULL;
 }
@@ -299,4 +312,26 @@ void *Delete(Rdma_3_1_CuckooHash *it, uint64_t key)
     return NULL;
 }
 
+// a remote lookup reads the buckets of the three hashes in turn until the
+// key's, then its value
+void Stats(Rdma_3_1_CuckooHash *it, HashStats *s)
+{
+    HashStats_init(s);
+    s->capacity = it->length;
+    for (uint64_t b = 0; b < it->bucketlength; b++)
+    {
+        for (uint64_t i = 0; i < SLOT_PER_BUCKET; i++)
+        {
+            RdmaArrayNode *node = &it->header[b * SLOT_PER_BUCKET + i];
+            if (node->valid == false)
+                continue;
+            uint64_t stage = GetHash(it, node->key) == b    ? 0
+                             : GetHash2(it, node->key) == b ? 1
+                                                            : 2;
+            HashStats_key(s, stage + 2);
+        }
+    }
+    HashStats_finish(s, it->size, it->entrysize);
+}
+
 #endif
@@ -22,14 +22,17 @@
  *
  */
 
-#ifndef RDMAHASHEXT_H
-#define RDMAHASHEXT_H
-
-typedef unsigned long long uint64_t;
-typedef unsigned int uint32_t;
+#ifndef RDMACLUSTERHASH_H
+#define RDMACLUSTERHASH_H
 
+#include <algorithm>
 #include <iostream>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "hash_func.h"
+#include "hash_stats.h"
 
 #define HASH_LOCK 0
 
@@ -37,50 +40,8 @@ typedef unsigned int uint32_t;
 #define MAX_THREADS 16
 
 #define CLUSTER_H 8
-
-inline uint64_t MurmurHash64A(uint64_t key, unsigned int seed) {
-
-    const uint64_t m = 0xc6a4a7935bd1e995;
-    const int r = 47;
-    uint64_t h = seed ^ (8 * m);
-    const uint64_t *data = &key;
-    const uint64_t *end = data + 1;
-
-    while (data != end) {
-        uint64_t k = *data++;
-        k *= m;
-        k ^= k >> r;
-        k *= m;
-        h ^= k;
-        h *= m;
-    }
-
-    const unsigned char *data2 = (const unsigned char *)data;
-
-    switch (8 & 7) {
-    case 7:
-        h ^= uint64_t(data2[6]) << 48;
-    case 6:
-        h ^= uint64_t(data2[5]) << 40;
-    case 5:
-        h ^= uint64_t(data2[4]) << 32;
-    case 4:
-        h ^= uint64_t(data2[3]) << 24;
-    case 3:
-        h ^= uint64_t(data2[2]) << 16;
-    case 2:
-        h ^= uint64_t(data2[1]) << 8;
-    case 1:
-        h ^= uint64_t(data2[0]);
-        h *= m;
-    };
-
-    h ^= h >> r;
-    h *= m;
-    h ^= h >> r;
-
-    return h;
-}
+// keys of GetBatch whose nodes are prefetched together
+#define CLUSTER_GET_BATCH 16
 
 struct HeaderNode {
     uint64_t next;
@@ -105,6 +66,7 @@ struct RdmaClusterHash {
     uint64_t size;
     uint64_t free_indirect;
     uint64_t free_data;
+    uint64_t free_list; // deleted data nodes, linked through their key
 };
 
 RdmaClusterHash *RdmaClusterHash_new(uint64_t esize, uint64_t len, char *arr) {
@@ -121,102 +83,213 @@ RdmaClusterHash *RdmaClusterHash_new(uint64_t esize, uint64_t len, char *arr) {
     it->data_size = (sizeof(DataNode) + it->entrysize);
     it->size =
         it->indirect_length * it->header_size + it->length * it->data_size;
+    it->free_list = 0;
     it->array = arr;
+    return it;
 }
 
 void RdmaClusterHash_free(RdmaClusterHash *it) {}
 
 uint64_t GetHash(RdmaClusterHash *it, uint64_t key) {
-    return MurmurHash64A(key, 0xdeadbeef) % it->Logical_length;
+    return fastrange64(RdmaHash(key, RDMA_HASH_SEED0), it->Logical_length);
 }
 
-DataNode *getDataNode(RdmaClusterHash *it, uint64_t i) {
-    return (DataNode *)(it->array + getDataNode_loc(it, i));
-}
 uint64_t getDataNode_loc(RdmaClusterHash *it, uint64_t i) {
     return it->indirect_length * it->header_size +
            (i - it->indirect_length) * it->data_size;
 }
+DataNode *getDataNode(RdmaClusterHash *it, uint64_t i) {
+    return (DataNode *)(it->array + getDataNode_loc(it, i));
+}
 uint64_t getHeaderNode_loc(RdmaClusterHash *it, uint64_t i) {
     return i * it->header_size;
 }
-void Insert(RdmaClusterHash *it, uint64_t key, void *val) {
-    if (it->free_data == it->total_length) {
-        printf("fail when inserting %d\n", key);
-        //    assert(false);
-    }
-    uint64_t hash = GetHash(it, key);
-    HeaderNode *node = (HeaderNode *)(it->array + hash * it->header_size);
-    while (node->next != 0) {
-        node = (HeaderNode *)(it->array + (node->next) * it->header_size);
+HeaderNode *getHeaderNode(RdmaClusterHash *it, uint64_t i) {
+    return (HeaderNode *)(it->array + getHeaderNode_loc(it, i));
+}
+
+// Readers may run concurrently with one writer inserting new keys or
+// deleting. A slot turns used by its
+// index, written after its key and data node, and a reader checks the key of
+// the data node, which may have been deleted and reused meanwhile.
+uint64_t *Get(RdmaClusterHash *it, uint64_t key) {
+    HeaderNode *node = getHeaderNode(it, GetHash(it, key));
+    while (true) {
+        for (int i = 0; i < CLUSTER_H; i++) {
+            uint64_t index = node->indexes[i];
+            if (index != 0 && node->keys[i] == key) {
+                DataNode *datanode = getDataNode(it, index);
+                if (datanode->valid && datanode->key == key)
+                    return (uint64_t *)(datanode + 1);
+            }
+        }
+        if (node->next == 0)
+            return NULL;
+        node = getHeaderNode(it, node->next);
     }
-    for (int i = 0; i < CLUSTER_H; i++) {
-        if (node->indexes[i] == 0) {
-            DataNode *free_node = getDataNode(it, it->free_data);
-            free_node->key = key;
-            memcpy((void *)(free_node + 1), val, it->entrysize);
-            node->keys[i] = key;
-            node->indexes[i] = it->free_data;
-            it->free_data++;
-            return;
+}
+
+// Get of n keys, out[i] for keys[i]. A group of keys is hashed together with
+// RdmaHashBatch and moves through the lookup in steps, each step prefetching
+// for all keys of the group what the next one reads: the home header nodes,
+// then the data nodes of the keys found there. A key in an overflow node is
+// looked up on its own.
+void GetBatch(RdmaClusterHash *it, const uint64_t *keys, int n,
+              uint64_t **out) {
+    HeaderNode *nodes[CLUSTER_GET_BATCH];
+    uint64_t index[CLUSTER_GET_BATCH];
+    uint64_t h[CLUSTER_GET_BATCH];
+    for (int base = 0; base < n; base += CLUSTER_GET_BATCH) {
+        int m = std::min(n - base, CLUSTER_GET_BATCH);
+        RdmaHashBatch(keys + base, m, RDMA_HASH_SEED0, h);
+        for (int k = 0; k < m; k++) {
+            nodes[k] = getHeaderNode(
+                it, fastrange64(h[k], it->Logical_length));
+            // a header node spans up to three cache lines
+            __builtin_prefetch(nodes[k]);
+            __builtin_prefetch((char *)nodes[k] + 64);
+            __builtin_prefetch((char *)nodes[k] + 128);
+        }
+        for (int k = 0; k < m; k++) {
+            index[k] = 0;
+            for (int i = 0; i < CLUSTER_H; i++) {
+                if (nodes[k]->indexes[i] != 0 &&
+                    nodes[k]->keys[i] == keys[base + k]) {
+                    index[k] = nodes[k]->indexes[i];
+                    __builtin_prefetch(getDataNode(it, index[k]));
+                    break;
+                }
+            }
+        }
+        for (int k = 0; k < m; k++) {
+            uint64_t key = keys[base + k];
+            DataNode *datanode =
+                index[k] != 0 ? getDataNode(it, index[k]) : NULL;
+            if (datanode != NULL && datanode->valid && datanode->key == key)
+                out[base + k] = (uint64_t *)(datanode + 1);
+            else if (datanode == NULL && nodes[k]->next == 0)
+                out[base + k] = NULL;
+            else
+                out[base + k] = Get(it, key);
         }
     }
-    if (it->free_indirect == it->indirect_length) {
-        printf("fail when allocating indirect node,key is %d\n", key);
-        //    assert(false);
+}
+
+// false when the data or indirect nodes run out. Inserting a present key
+// copies the new value over the old one in place, which a concurrent reader
+// may see half written.
+bool Insert(RdmaClusterHash *it, uint64_t key, void *val) {
+    uint64_t *old = Get(it, key);
+    if (old != NULL) {
+        memcpy(old, val, it->entrysize);
+        return true;
+    }
+
+    // data nodes of deleted keys first
+    uint64_t index;
+    if (it->free_list != 0) {
+        index = it->free_list;
+        it->free_list = getDataNode(it, index)->key;
+    } else if (it->free_data < it->total_length) {
+        index = it->free_data++;
+    } else {
+        return false;
     }
-    node->next = it->free_indirect;
-    node = (HeaderNode *)(it->array + it->free_indirect * it->header_size);
-    it->free_indirect++;
-    DataNode *free_node = getDataNode(it, it->free_data);
+    DataNode *free_node = getDataNode(it, index);
     free_node->key = key;
     memcpy((void *)(free_node + 1), val, it->entrysize);
-    node->keys[0] = key;
-    node->indexes[0] = it->free_data;
-    it->free_data++;
-    return;
-}
+    free_node->valid = true;
 
-uint64_t *Get(RdmaClusterHash *it, uint64_t key) {
-    uint64_t hash = GetHash(it, key);
-    HeaderNode *node = (HeaderNode *)(it->array + hash * it->header_size);
+    // first free slot along the chain
+    HeaderNode *node = getHeaderNode(it, GetHash(it, key));
     while (true) {
         for (int i = 0; i < CLUSTER_H; i++) {
-            if (node->keys[i] == key && node->indexes[i] != 0) {
-                DataNode *datanode = getDataNode(it, node->indexes[i]);
-                return (uint64_t *)(datanode + 1);
+            if (node->indexes[i] == 0) {
+                node->keys[i] = key;
+                __sync_synchronize();
+                node->indexes[i] = index;
+                return true;
             }
         }
-        if (node->next != NULL)
-            node = (HeaderNode *)(it->array + (node->next) * it->header_size);
-        else {
-            //    assert(false);
-        }
+        if (node->next == 0)
+            break;
+        node = getHeaderNode(it, node->next);
     }
+    if (it->free_indirect == it->indirect_length) {
+        free_node->valid = false;
+        free_node->key = it->free_list;
+        it->free_list = index;
+        return false;
+    }
+    HeaderNode *next = getHeaderNode(it, it->free_indirect);
+    memset(next, 0, sizeof(HeaderNode));
+    next->keys[0] = key;
+    next->indexes[0] = index;
+    __sync_synchronize();
+    node->next = it->free_indirect++;
+    return true;
 }
 
+// number of header nodes a lookup visits, 0 if the key is missing
 uint64_t read(RdmaClusterHash *it, uint64_t key) {
-    uint64_t hash = GetHash(it, key);
-    HeaderNode *node = (HeaderNode *)(it->array + hash * it->header_size);
+    HeaderNode *node = getHeaderNode(it, GetHash(it, key));
     int count = 0;
     while (true) {
         count++;
         for (int i = 0; i < CLUSTER_H; i++) {
-            if (node->keys[i] == key && node->indexes[i] != 0) {
-                DataNode *datanode = getDataNode(it, node->indexes[i]);
+            if (node->keys[i] == key && node->indexes[i] != 0)
                 return count;
-            }
-        }
-        if (node->next != NULL)
-            node = (HeaderNode *)(it->array + (node->next) * it->header_size);
-        else {
-            // assert(false);
         }
+        if (node->next == 0)
+            return 0;
+        node = getHeaderNode(it, node->next);
     }
 }
 
+// The slot and the data node are reused by later inserts, the returned value
+// stays readable until then.
 void *Delete(RdmaClusterHash *it, uint64_t key) {
-    // TODO
-    return NULL;
+    HeaderNode *node = getHeaderNode(it, GetHash(it, key));
+    while (true) {
+        for (int i = 0; i < CLUSTER_H; i++) {
+            uint64_t index = node->indexes[i];
+            if (index != 0 && node->keys[i] == key) {
+                node->indexes[i] = 0;
+                __sync_synchronize();
+                DataNode *datanode = getDataNode(it, index);
+                datanode->valid = false;
+                datanode->key = it->free_list;
+                it->free_list = index;
+                return (void *)(datanode + 1);
+            }
+        }
+        if (node->next == 0)
+            return NULL;
+        node = getHeaderNode(it, node->next);
+    }
+}
+
+// a remote lookup reads the header nodes of the chain up to the key's, then
+// its data node
+void Stats(RdmaClusterHash *it, HashStats *s) {
+    HashStats_init(s);
+    s->capacity = it->length;
+    s->overflow_used = it->free_indirect - it->Logical_length;
+    s->overflow_total = it->indirect_length - it->Logical_length;
+    for (uint64_t b = 0; b < it->Logical_length; b++) {
+        HeaderNode *node = getHeaderNode(it, b);
+        uint64_t reads = 1;
+        while (true) {
+            reads++;
+            for (int i = 0; i < CLUSTER_H; i++) {
+                if (node->indexes[i] != 0)
+                    HashStats_key(s, reads);
+            }
+            if (node->next == 0)
+                break;
+            node = getHeaderNode(it, node->next);
+        }
+    }
+    HashStats_finish(s, it->size, it->entrysize);
 }
 #endif
@@ -0,0 +1,169 @@
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA
+ * for speedy distributed in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+/*
+ *  Coroutines over the asynchronous RDMA operations of one worker thread.
+ *  A coroutine posts a request and suspends until its ticket completes, so a
+ *  lookup is written as plain sequential code while the scheduler keeps the
+ *  requests of all coroutines of the thread in flight.
+ */
+
+#ifndef RDMA_COROUTINE_H
+#define RDMA_COROUTINE_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ucontext.h>
+
+#include "rdma_resource.h"
+
+#define CO_STACK_SIZE (64 * 1024)
+// every coroutine has at most one request in flight, below RDMA_MAX_OUTSTANDING
+#define CO_MAX 32
+
+class RdmaScheduler;
+typedef void (*co_func)(RdmaScheduler *sched, int cid, void *arg);
+
+struct RdmaCoroutine {
+    ucontext_t ctx;
+    char *stack;
+    co_func fn;
+    void *arg;
+    bool finished;
+    int wait_mid; // machine of the pending request, -1 if runnable
+    uint64_t wait_ticket;
+};
+
+class RdmaScheduler {
+    RdmaResource *rdma;
+    int t_id;
+    int count;
+    int current;
+    ucontext_t main_ctx;
+    RdmaCoroutine co[CO_MAX];
+
+    // makecontext only passes ints
+    static void Entry(uint32_t lo, uint32_t hi) {
+        RdmaScheduler *s =
+            (RdmaScheduler *)(((uint64_t)hi << 32) | (uint64_t)lo);
+        RdmaCoroutine *c = &s->co[s->current];
+        c->fn(s, s->current, c->arg);
+        c->finished = true;
+        // returns to main_ctx through uc_link
+    }
+
+  public:
+    RdmaScheduler(RdmaResource *_rdma, int _t_id)
+        : rdma(_rdma), t_id(_t_id), count(0), current(-1) {}
+
+    ~RdmaScheduler() {
+        for (int i = 0; i < count; i++)
+            free(co[i].stack);
+    }
+
+    // returns the coroutine id, which can index per coroutine buffers
+    int Spawn(co_func fn, void *arg) {
+        assert(count < CO_MAX);
+        int cid = count++;
+        RdmaCoroutine *c = &co[cid];
+        c->fn = fn;
+        c->arg = arg;
+        c->finished = false;
+        c->wait_mid = -1;
+        c->stack = (char *)malloc(CO_STACK_SIZE);
+
+        getcontext(&c->ctx);
+        c->ctx.uc_stack.ss_sp = c->stack;
+        c->ctx.uc_stack.ss_size = CO_STACK_SIZE;
+        c->ctx.uc_link = &main_ctx;
+        uint64_t self = (uint64_t)this;
+        makecontext(&c->ctx, (void (*)())Entry, 2, (uint32_t)self,
+                    (uint32_t)(self >> 32));
+        return cid;
+    }
+
+    // run the spawned coroutines until all of them return
+    void Run() {
+        int alive = count;
+        while (alive > 0) {
+            for (int i = 0; i < count; i++) {
+                RdmaCoroutine *c = &co[i];
+                if (c->finished)
+                    continue;
+                if (c->wait_mid >= 0) {
+                    if (!rdma->Done(t_id, c->wait_mid, c->wait_ticket)) {
+                        rdma->PollAsync(t_id, c->wait_mid);
+                        if (!rdma->Done(t_id, c->wait_mid, c->wait_ticket))
+                            continue;
+                    }
+                    c->wait_mid = -1;
+                }
+                current = i;
+                swapcontext(&main_ctx, &c->ctx);
+                if (c->finished)
+                    alive--;
+            }
+        }
+        current = -1;
+    }
+
+    // the following are called from inside a coroutine
+
+    // suspend until the ticket of QP (t_id, m_id) completes
+    void Wait(int m_id, uint64_t ticket) {
+        RdmaCoroutine *c = &co[current];
+        c->wait_mid = m_id;
+        c->wait_ticket = ticket;
+        swapcontext(&c->ctx, &main_ctx);
+    }
+
+    void Yield() { swapcontext(&co[current].ctx, &main_ctx); }
+
+    void Read(int m_id, char *local, uint64_t size, uint64_t off) {
+        Wait(m_id,
+             rdma->PostAsync(t_id, m_id, local, size, off, IBV_WR_RDMA_READ));
+    }
+
+    void Write(int m_id, char *local, uint64_t size, uint64_t off) {
+        Wait(m_id,
+             rdma->PostAsync(t_id, m_id, local, size, off, IBV_WR_RDMA_WRITE));
+    }
+
+    // returns the old value, which is also left in local
+    uint64_t CmpSwap(int m_id, char *local, uint64_t compare, uint64_t swap,
+                     uint64_t off) {
+        Wait(m_id,
+             rdma->PostCmpSwapAsync(t_id, m_id, local, compare, swap, off));
+        return *(uint64_t *)local;
+    }
+
+    // returns the old value, which is also left in local
+    uint64_t FetchAdd(int m_id, char *local, uint64_t add, uint64_t off) {
+        Wait(m_id, rdma->PostFetchAddAsync(t_id, m_id, local, add, off));
+        return *(uint64_t *)local;
+    }
+};
+
+#endif
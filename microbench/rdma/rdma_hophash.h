@@ -25,11 +25,13 @@
 #ifndef RDMAHOPHASH_H
 #define RDMAHOPHASH_H
 
-typedef unsigned long long uint64_t;
-typedef unsigned int uint32_t;
-
 #include <iostream>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "hash_func.h"
+#include "hash_stats.h"
 
 #define HASH_LOCK 0
 
@@ -38,50 +40,6 @@ typedef unsigned int uint32_t;
 
 #define HOP_H 8
 
-inline uint64_t MurmurHash64A(uint64_t key, unsigned int seed) {
-
-    const uint64_t m = 0xc6a4a7935bd1e995;
-    const int r = 47;
-    uint64_t h = seed ^ (8 * m);
-    const uint64_t *data = &key;
-    const uint64_t *end = data + 1;
-
-    while (data != end) {
-        uint64_t k = *data++;
-        k *= m;
-        k ^= k >> r;
-        k *= m;
-        h ^= k;
-        h *= m;
-    }
-
-    const unsigned char *data2 = (const unsigned char *)data;
-
-    switch (8 & 7) {
-    case 7:
-        h ^= uint64_t(data2[6]) << 48;
-    case 6:
-        h ^= uint64_t(data2[5]) << 40;
-    case 5:
-        h ^= uint64_t(data2[4]) << 32;
-    case 4:
-        h ^= uint64_t(data2[3]) << 24;
-    case 3:
-        h ^= uint64_t(data2[2]) << 16;
-    case 2:
-        h ^= uint64_t(data2[1]) << 8;
-    case 1:
-        h ^= uint64_t(data2[0]);
-        h *= m;
-    };
-
-    h ^= h >> r;
-    h *= m;
-    h ^= h >> r;
-
-    return h;
-}
-
 struct RdmaHopNode {
     uint64_t keys[HOP_H / 2];
     bool valid[HOP_H / 2];
@@ -143,149 +101,217 @@ RdmaChainNode *get_chainnod(RdmaHopHash *it, uint64_t i) {
 }
 
 uint64_t GetHash(RdmaHopHash *it, uint64_t key) {
-    return MurmurHash64A(key, 0xdeadbeef) % it->hash_length;
+    return fastrange64(RdmaHash(key, RDMA_HASH_SEED0), it->hash_length);
     // return key % (_RHASHLENGTH) ;
 }
 
-void Insert(RdmaHopHash *it, uint64_t key, void *val) {
-    if (it->free_chain >= it->hash_length + it->chain_length) {
-        printf("out of memory when inserting %d\n", key);
+char *get_headernod_value(RdmaHopHash *it, uint64_t i, int slot) {
+    return it->array + get_headernod_loc(it, i) + sizeof(RdmaHopNode) +
+           it->entrysize * slot;
+}
+char *get_chainnod_value(RdmaHopHash *it, uint64_t i, int slot) {
+    return it->array + get_chainnod_loc(it, i) + sizeof(RdmaChainNode) +
+           it->entrysize * slot;
+}
+
+// Readers may run concurrently with one writer inserting new keys. A value is
+// in place before its slot turns valid, and a moved entry is valid at its new
+// slot before it is cleared at the old one, so a reader never misses a
+// present key.
+void hop_fill(RdmaHopHash *it, uint64_t *keyp, bool *valid, char *dst,
+              uint64_t key, const void *val) {
+    memcpy(dst, val, it->entrysize);
+    *keyp = key;
+    __sync_synchronize();
+    *valid = true;
+}
+
+// the value of key, valid is set to its slot flag
+char *hop_find(RdmaHopHash *it, uint64_t key, bool **valid) {
+    uint64_t hash = GetHash(it, key);
+    for (int i = 0; i < 2; i++) {
+        uint64_t p = (hash + i) % it->hash_length;
+        RdmaHopNode *node = get_headernod(it, p);
+        for (int j = 0; j < HOP_H / 2; j++) {
+            if (node->valid[j] && node->keys[j] == key) {
+                *valid = &node->valid[j];
+                return get_headernod_value(it, p, j);
+            }
+        }
+    }
+    uint64_t iter = get_headernod(it, hash)->next;
+    while (iter != 0) {
+        RdmaChainNode *node = get_chainnod(it, iter);
+        for (int j = 0; j < 2; j++) {
+            if (node->valid[j] && node->keys[j] == key) {
+                *valid = &node->valid[j];
+                return get_chainnod_value(it, iter, j);
+            }
+        }
+        iter = node->next;
+    }
+    return NULL;
+}
+
+uint64_t *Get(RdmaHopHash *it, uint64_t key) {
+    bool *valid;
+    return (uint64_t *)hop_find(it, key, &valid);
+}
+
+// false when the chain nodes run out. Inserting a present key copies the new
+// value over the old one in place, a concurrent reader may see it half
+// written, see hop_fill for what readers can rely on.
+bool Insert(RdmaHopHash *it, uint64_t key, void *val) {
+    uint64_t *old = Get(it, key);
+    if (old != NULL) {
+        memcpy(old, val, it->entrysize);
+        return true;
     }
-    //    assert(free_chain < hash_length + chain_length);
 
     uint64_t hash = GetHash(it, key);
-    uint64_t p[2];
-    p[0] = hash;
-    p[1] = (hash + 1) % it->hash_length;
     for (int i = 0; i < 2; i++) {
+        uint64_t p = (hash + i) % it->hash_length;
+        RdmaHopNode *node = get_headernod(it, p);
         for (int j = 0; j < HOP_H / 2; j++)
-            if (get_headernod(it, p[i])->valid[j] == false) {
-                get_headernod(it, p[i])->keys[j] = key;
-                get_headernod(it, p[i])->valid[j] = true;
-                return;
+            if (node->valid[j] == false) {
+                hop_fill(it, &node->keys[j], &node->valid[j],
+                         get_headernod_value(it, p, j), key, val);
+                return true;
             }
     }
 
+    // find an empty slot further away and hop it back to the neighborhood
     uint64_t offset = 2;
-    uint64_t slot;
-    while (true) {
-        uint64_t pos = (hash + offset) % it->hash_length;
-        bool found = false;
+    int slot = -1;
+    for (; offset < it->hash_length && slot < 0; offset++) {
+        RdmaHopNode *node = get_headernod(it, (hash + offset) % it->hash_length);
         for (int j = 0; j < HOP_H / 2; j++) {
-            if (get_headernod(it, pos)->valid[j] == false) {
+            if (node->valid[j] == false) {
                 slot = j;
-                found = true;
+                break;
             }
         }
-        if (found)
-            break;
-        else
-            offset++;
     }
-
-    // we find empty slot
-    while (offset > 1) {
-        uint64_t p[2];
-        p[0] = (hash + offset - 1) % it->hash_length;
-        p[1] = (hash + offset) % it->hash_length;
-        bool found = false;
+    offset--;
+    while (slot >= 0 && offset > 1) {
+        uint64_t p0 = (hash + offset - 1) % it->hash_length;
+        uint64_t p1 = (hash + offset) % it->hash_length;
+        RdmaHopNode *from = get_headernod(it, p0);
+        RdmaHopNode *to = get_headernod(it, p1);
+        int moved = -1;
         for (int j = 0; j < HOP_H / 2; j++) {
-            if (GetHash(it, get_headernod(it, p[0])->keys[j]) == p[0]) {
-                // move this slot to (p[1],slot)
-                get_headernod(it, p[1])->keys[slot] =
-                    get_headernod(it, p[0])->keys[j];
-                get_headernod(it, p[1])->valid[slot] = true;
-
-                get_headernod(it, p[0])->keys[j] = 0;
-                get_headernod(it, p[0])->valid[j] = false;
-                // current we don't copy data, since it's only a microbench
-                slot = j;
-                offset--;
-                found = true;
+            // only entries whose home is p0 may move to p0 + 1
+            if (from->valid[j] && GetHash(it, from->keys[j]) == p0) {
+                hop_fill(it, &to->keys[slot], &to->valid[slot],
+                         get_headernod_value(it, p1, slot), from->keys[j],
+                         get_headernod_value(it, p0, j));
+                from->valid[j] = false;
+                __sync_synchronize();
+                moved = j;
                 break;
             }
         }
-        if (!found) {
-            // cannot move to find an empty slot, so use chain instead
-            // printf("fail to insert %d\n", key);
-            // assert(false);
-            if (get_headernod(it, hash)->next == 0) {
-                get_headernod(it, hash)->next = it->free_chain;
-                get_chainnod(it, it->free_chain)->keys[0] = key;
-                get_chainnod(it, it->free_chain)->valid[0] = true;
-                it->free_chain++;
-                return;
-            }
-            uint64_t iter = get_headernod(it, hash)->next;
-            while (true) {
-                for (int i = 0; i < 2; i++) {
-                    if (get_chainnod(it, iter)->valid[i] == false) {
-                        get_chainnod(it, iter)->keys[i] = key;
-                        get_chainnod(it, iter)->valid[i] = true;
-                        if (i == 0) {
-                            //    assert(false);
-                        }
-                        return;
-                    }
-                }
-                if (get_chainnod(it, iter)->next == 0)
-                    break;
-                else
-                    iter = get_chainnod(it, iter)->next;
-            }
+        slot = moved;
+        offset--;
+    }
+    if (slot >= 0) {
+        uint64_t p = (hash + 1) % it->hash_length;
+        RdmaHopNode *node = get_headernod(it, p);
+        hop_fill(it, &node->keys[slot], &node->valid[slot],
+                 get_headernod_value(it, p, slot), key, val);
+        return true;
+    }
 
-            get_chainnod(it, iter)->next = it->free_chain;
-            get_chainnod(it, it->free_chain)->keys[0] = key;
-            get_chainnod(it, it->free_chain)->valid[0] = true;
-            it->free_chain++;
-            return;
+    // cannot move an empty slot close enough, use the chain of the home
+    // bucket, reusing the slots of deleted keys
+    uint64_t *link = &get_headernod(it, hash)->next;
+    while (*link != 0) {
+        RdmaChainNode *node = get_chainnod(it, *link);
+        for (int j = 0; j < 2; j++) {
+            if (node->valid[j] == false) {
+                hop_fill(it, &node->keys[j], &node->valid[j],
+                         get_chainnod_value(it, *link, j), key, val);
+                return true;
+            }
         }
-        // assert(found);
+        link = &node->next;
+    }
+    if (it->free_chain >= it->hash_length + it->chain_length) {
+        return false;
     }
-    get_headernod(it, (hash + 1) % it->hash_length)->keys[slot] = key;
-    get_headernod(it, (hash + 1) % it->hash_length)->valid[slot] = true;
-    return;
+    uint64_t n = it->free_chain++;
+    RdmaChainNode *node = get_chainnod(it, n);
+    memset(node, 0, sizeof(RdmaChainNode));
+    hop_fill(it, &node->keys[0], &node->valid[0], get_chainnod_value(it, n, 0),
+             key, val);
+    __sync_synchronize();
+    *link = n;
+    return true;
 }
 
-uint64_t *Get(RdmaHopHash *it, uint64_t key) { return NULL; }
-
+// number of nodes a lookup visits, 0 if the key is missing
 uint64_t read(RdmaHopHash *it, uint64_t key) {
     uint64_t hash = GetHash(it, key);
-    uint64_t p[2];
-    p[0] = hash;
-    p[1] = (hash + 1) % it->hash_length;
-    bool found = false;
     for (int i = 0; i < 2; i++) {
+        RdmaHopNode *node = get_headernod(it, (hash + i) % it->hash_length);
         for (int j = 0; j < HOP_H / 2; j++) {
-            //                printf("local key %d ,%d\n",
-            //                get_headernod(p[i])->keys[j],get_headernod(p[i])->valid[j]);
-            if (get_headernod(it, p[i])->keys[j] == key) {
-                found = true;
-                break;
-            }
+            if (node->valid[j] && node->keys[j] == key)
+                return 1;
         }
     }
-    if (found)
-        return 1;
     uint64_t iter = get_headernod(it, hash)->next;
     int count = 0;
     while (iter != 0) {
         count++;
+        RdmaChainNode *node = get_chainnod(it, iter);
         for (int i = 0; i < 2; i++) {
-            if (get_chainnod(it, iter)->keys[i] == key) {
+            if (node->valid[i] && node->keys[i] == key)
                 return 1 + count;
-            }
         }
-        iter = get_chainnod(it, iter)->next;
+        iter = node->next;
     }
-    printf("fail to read %d,count %d\n", key, count);
-    //    assert(false);
-    return NULL;
+    printf("fail to read %lu,count %d\n", key, count);
+    return 0;
 }
 
+// The slot is free for the next insert, the returned value stays readable
+// until then. Chain nodes are kept linked and reused.
 void *Delete(RdmaHopHash *it, uint64_t key) {
-    // TODO
-    return NULL;
+    bool *valid;
+    char *val = hop_find(it, key, &valid);
+    if (val != NULL)
+        *valid = false;
+    return val;
+}
+
+// The first remote read covers the home bucket and the next one with their
+// values, the home bucket being the last one it takes a second read for
+// bucket 0. Each chain node is one more read.
+void Stats(RdmaHopHash *it, HashStats *s) {
+    HashStats_init(s);
+    s->capacity = it->length;
+    s->overflow_used = it->free_chain - it->hash_length;
+    s->overflow_total = it->chain_length;
+    for (uint64_t b = 0; b < it->hash_length; b++) {
+        RdmaHopNode *node = get_headernod(it, b);
+        for (int j = 0; j < HOP_H / 2; j++) {
+            if (!node->valid[j])
+                continue;
+            uint64_t home = GetHash(it, node->keys[j]);
+            HashStats_key(s, home == b || home + 1 < it->hash_length ? 1 : 2);
+        }
+        uint64_t reads = b + 1 < it->hash_length ? 1 : 2;
+        for (uint64_t iter = node->next; iter != 0;
+             iter = get_chainnod(it, iter)->next) {
+            RdmaChainNode *chain = get_chainnod(it, iter);
+            reads++;
+            for (int j = 0; j < 2; j++) {
+                if (chain->valid[j])
+                    HashStats_key(s, reads);
+            }
+        }
+    }
+    HashStats_finish(s, it->size, it->entrysize);
 }
 
 #endif
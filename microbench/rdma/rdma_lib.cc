@@ -24,6 +24,9 @@
 
 #include "rdma_resource.h"
 #include <errno.h>
+#include <string>
+#include <algorithm>
+#include <zmq.hpp>
 
 struct config_t rdma_config = {
   NULL,                         /* dev_name */
@@ -243,7 +246,8 @@ QP_create(struct QP *res,struct dev_resource *dev)
   res->mr = dev->mr;
 
   int rc = 0;
-  int cq_size = 40;
+  /* all requests of a shared QP are signaled */
+  int cq_size = 2 * RDMA_MAX_OUTSTANDING + RDMA_MAX_QP_GROUP;
   res->cq = ibv_create_cq (dev->ib_ctx,cq_size,NULL,NULL,0);
   if(!res->cq) {
     fprintf (stderr, "failed to create CQ with %u entries\n", cq_size);
@@ -260,13 +264,22 @@ QP_create(struct QP *res,struct dev_resource *dev)
   qp_init_attr.cap.max_recv_wr = 128;
   qp_init_attr.cap.max_send_sge = 1;
   qp_init_attr.cap.max_recv_sge = 1;
+  qp_init_attr.cap.max_inline_data = RDMA_MAX_INLINE;
   res->qp = ibv_create_qp (res->pd, &qp_init_attr);
+  if (!res->qp)
+    {
+      /* retry without inline data for NICs that do not support it */
+      qp_init_attr.cap.max_inline_data = 0;
+      res->qp = ibv_create_qp (res->pd, &qp_init_attr);
+    }
   if (!res->qp)
     {
       fprintf (stderr, "failed to create QP\n");
       rc = 1;
       goto resources_create_exit;
     }
+  /* the granted value is written back into the attributes */
+  res->max_inline = qp_init_attr.cap.max_inline_data;
 
  resources_create_exit:
   if(rc) {
@@ -461,38 +474,139 @@ connect_qp (struct QP *res,struct cm_con_data_t tmp_con_data)
 
 
 
+static int reap_completions (struct QP *res);
+
+static inline void
+complete_ticket (struct QP *res, uint64_t ticket)
+{
+  if (res->shared)
+    {
+      res->done[ticket % RDMA_DONE_RING] = ticket;
+      __sync_fetch_and_sub (&res->inflight, 1);
+    }
+  else
+    /* a completion also retires the unsignaled requests before it */
+    res->completed = ticket;
+}
+
+/* wait for a send queue slot and take the ticket of the next request */
+static inline uint64_t
+next_ticket (struct QP *res)
+{
+  if (res->shared)
+    {
+      while (res->inflight >= RDMA_MAX_OUTSTANDING)
+	reap_completions (res);
+      __sync_fetch_and_add (&res->inflight, 1);
+      return __sync_add_and_fetch (&res->posted, 1);
+    }
+  /* unsignaled requests hold their slot until a later signaled one
+     completes, and there is always one in flight by now */
+  while (res->posted - res->completed >= RDMA_MAX_OUTSTANDING)
+    reap_completions (res);
+  return ++res->posted;
+}
+
+/* software transport, the request runs right away on the local region */
 static int
+soft_exec (struct QP *res, struct ibv_send_wr *sr)
+{
+  char *local = (char *) sr->sg_list->addr;
+  switch (sr->opcode)
+    {
+    case IBV_WR_RDMA_READ:
+      memcpy (local, (char *) sr->wr.rdma.remote_addr, sr->sg_list->length);
+      break;
+    case IBV_WR_RDMA_WRITE:
+      memcpy ((char *) sr->wr.rdma.remote_addr, local, sr->sg_list->length);
+      break;
+    case IBV_WR_ATOMIC_CMP_AND_SWP:
+      *(uint64_t *) local =
+	__sync_val_compare_and_swap ((uint64_t *) sr->wr.atomic.remote_addr,
+				     sr->wr.atomic.compare_add, sr->wr.atomic.swap);
+      break;
+    case IBV_WR_ATOMIC_FETCH_AND_ADD:
+      *(uint64_t *) local =
+	__sync_fetch_and_add ((uint64_t *) sr->wr.atomic.remote_addr,
+			      sr->wr.atomic.compare_add);
+      break;
+    default:
+      return 1;
+    }
+  if (sr->send_flags & IBV_SEND_SIGNALED)
+    complete_ticket (res, sr->wr_id);
+  return 0;
+}
+
+/* post a chain of requests */
+static inline int
+submit (struct QP *res, struct ibv_send_wr *sr)
+{
+  struct ibv_send_wr *bad_wr = NULL;
+  for (struct ibv_send_wr *w = sr; w != NULL; w = w->next)
+    {
+      if (w->send_flags & IBV_SEND_SIGNALED)
+	res->signaled = w->wr_id;
+      if (res->soft && soft_exec (res, w))
+	return 1;
+    }
+  if (res->soft)
+    return 0;
+  return ibv_post_send (res->qp, sr, &bad_wr);
+}
+
+/* remote address and key of an offset, see RDMA_REGION_OFF */
+static inline uint64_t
+remote_addr (struct QP *res, uint64_t off, uint32_t *rkey)
+{
+  int r = RDMA_REGION_OF (off);
+  if (r == 0)
+    {
+      *rkey = res->remote_props.rkey;
+      return res->remote_props.addr + off;
+    }
+  assert (r < RDMA_MAX_REGIONS);
+  struct rdma_region *e = &res->regions[r];
+  /* fails if the peer has not announced the region yet */
+  assert (e->size > (off & RDMA_REGION_MASK));
+  *rkey = e->rkey;
+  return e->addr + (off & RDMA_REGION_MASK);
+}
+
+/* returns the ticket of the request */
+static uint64_t
 post_send (struct QP *res, int opcode,char* local_buf,size_t size,size_t remote_offset,bool signal)
 {
   struct ibv_send_wr sr;
   struct ibv_sge sge;
-  struct ibv_send_wr *bad_wr = NULL;
   int rc;
   /* prepare the scatter/gather entry */
   memset (&sge, 0, sizeof (sge));
   sge.addr = (uintptr_t) local_buf;
   sge.length = size;
-  sge.lkey = res->mr->lkey;
+  sge.lkey = res->soft ? 0 : res->mr->lkey;
   /* prepare the send work request */
   memset (&sr, 0, sizeof (sr));
   sr.next = NULL;
-  sr.wr_id = 0;
+  sr.wr_id = next_ticket (res);
   sr.sg_list = &sge;
   sr.num_sge = 1;
-  sr.opcode = opcode;
-  if(signal)
+  sr.opcode = (enum ibv_wr_opcode) opcode;
+  if(signal || res->shared)
     sr.send_flags = IBV_SEND_SIGNALED;
   else
     sr.send_flags = 0;
   if (opcode != IBV_WR_SEND)
     {
-      sr.wr.rdma.remote_addr = res->remote_props.addr+remote_offset;
-      sr.wr.rdma.rkey = res->remote_props.rkey;
+      sr.wr.rdma.remote_addr = remote_addr (res, remote_offset, &sr.wr.rdma.rkey);
     }
   /* there is a Receive Request in the responder side, so we won't get any into RNR flow */
-  rc = ibv_post_send (res->qp, &sr, &bad_wr);
+  rc = submit (res, &sr);
   if (rc)
-    fprintf (stderr, "failed to post SR\n");
+    {
+      fprintf (stderr, "failed to post SR\n");
+      assert(false);
+    }
   else
     {
       /*
@@ -512,53 +626,46 @@ post_send (struct QP *res, int opcode,char* local_buf,size_t size,size_t remote_
 	break;
 	}*/
     }
-  return rc;
+  return sr.wr_id;
 }
 
 
+/* reap up to RDMA_POLL_BATCH completions, returns how many */
 static int
-poll_completion (struct QP *res) {
-  struct ibv_wc wc;
-  unsigned long start_time_msec;
-  unsigned long cur_time_msec;
-  struct timeval cur_time;
-  int poll_result;
-  int rc = 0;
-  /* poll the completion for a while before giving up of doing it .. */
-  do{
-    poll_result = ibv_poll_cq (res->cq, 1, &wc);
-  } while ((poll_result == 0));
-  if (poll_result < 0)
+reap_completions (struct QP *res)
+{
+  struct ibv_wc wc[RDMA_POLL_BATCH];
+  /* software requests complete when they are posted */
+  if (res->soft)
+    return 0;
+  int n = ibv_poll_cq (res->cq, RDMA_POLL_BATCH, wc);
+  if (n < 0)
     {
-      /* poll CQ failed */
       fprintf (stderr, "poll CQ failed\n");
-      rc = 1;
-    } else if (poll_result == 0)
+      assert(false);
+    }
+  for (int i = 0; i < n; i++)
     {
-      /* the CQ is empty */
-      fprintf (stderr, "completion wasn't found in the CQ after timeout\n");
-      rc = 1;
-    } else {
-    /* CQE found */
-    //      fprintf (stdout, "completion was found in CQ with status 0x%x\n",
-    //               wc.status);
-    /* check the completion status (here we don't care about the completion opcode */
-    if (wc.status != IBV_WC_SUCCESS)
-      {
-	fprintf (stderr,
-		 "got bad completion with status: 0x%x, vendor syndrome: 0x%x\n",
-		 wc.status, wc.vendor_err);
-	rc = 1;
-      }
-  }
-  return rc;
+      if (wc[i].status != IBV_WC_SUCCESS)
+	{
+	  fprintf (stderr,
+		   "got bad completion with status: 0x%x, vendor syndrome: 0x%x\n",
+		   wc[i].status, wc[i].vendor_err);
+	  assert(false);
+	}
+      complete_ticket (res, wc[i].wr_id);
+    }
+  return n;
 }
 
 
 
-RdmaResource::RdmaResource(int t_partition,int t_threads,int current,char *_buffer,uint64_t _size,uint64_t _slotsize,uint64_t _off) {
+RdmaResource::RdmaResource(int t_partition,int t_threads,int current,char *_buffer,uint64_t _size,uint64_t _slotsize,uint64_t _off,
+			   int _qp_group,bool _soft) {
 
   _total_threads = t_threads;
+  qp_group = _qp_group;
+  soft = _soft;
   _total_partition = t_partition;
   _current_partition = current;
 
@@ -574,37 +681,68 @@ RdmaResource::RdmaResource(int t_partition,int t_threads,int current,char *_buff
 
 void RdmaResource::init() {
   assert(_total_partition >= 0 && _total_threads >= 0 && _current_partition >= 0);
-  fprintf(stdout,"init devs\n");
+  assert(qp_group >= 1 && qp_group <= RDMA_MAX_QP_GROUP);
+  qp_rows = (_total_threads + qp_group - 1) / qp_group;
+
+  last_ticket = new uint64_t *[_total_threads];
+  for(int i = 0;i < _total_threads;i++) {
+    last_ticket[i] = new uint64_t[_total_partition];
+    memset(last_ticket[i],0,sizeof(uint64_t) * _total_partition);
+  }
+  /* empty until the thread sets its pool up */
+  pools = new struct BufPool[_total_threads];
+  memset(pools,0,sizeof(struct BufPool) * _total_threads);
+  regions = new struct rdma_region *[_total_partition];
+  for(int i = 0;i < _total_partition;i++)
+    regions[i] = (struct rdma_region *)calloc(RDMA_MAX_REGIONS,sizeof(struct rdma_region));
+  memset(region_mr,0,sizeof(region_mr));
+
+  if(!soft) {
+    fprintf(stdout,"init devs\n");
 
-  dev0 = new dev_resource;
-  dev1 = new dev_resource;
+    dev0 = new dev_resource;
+    dev1 = new dev_resource;
 
-  dev_resources_init(dev0);
-  dev_resources_init(dev1);
+    dev_resources_init(dev0);
+    dev_resources_init(dev1);
 
-  if(dev_resources_create(dev0,buffer,size) || dev_resources_create(dev1,buffer,size)) {
-    fprintf(stderr,"failed to create dev resources");
+    if(dev_resources_create(dev0,buffer,size) || dev_resources_create(dev1,buffer,size)) {
+      fprintf(stderr,"failed to create dev resources");
+    }
   }
 
-  fprintf(stdout,"creating remote qps\n");
-  res = new struct QP *[_total_threads];
+  fprintf(stdout,"creating remote qps, %d threads per qp\n",qp_group);
+  res = new struct QP *[qp_rows];
 
-  for(int i = 0; i< _total_threads ; i++){
+  for(int i = 0; i< qp_rows ; i++){
     res[i] = new struct QP[_total_partition];
     for(int j = 0; j < _total_partition;j++){
-      QP_init (res[i]+j);
-      if (QP_create (res[i]+j,dev0))
+      struct QP *r = res[i] + j;
+      QP_init (r);
+      r->regions = regions[j];
+      if(soft) {
+	/* every machine is the local region */
+	r->soft = 1;
+	r->remote_props.addr = (uintptr_t)buffer;
+	r->max_inline = RDMA_MAX_INLINE;
+      } else if (QP_create (r,dev0))
         {
           fprintf (stderr, "failed to create qp\n");
           assert(false);
         }
+      if(qp_group > 1) {
+	r->shared = 1;
+	r->done = (volatile uint64_t *)calloc(RDMA_DONE_RING,sizeof(uint64_t));
+      }
     }
   }
+  if(soft)
+    return;
 
   fprintf(stdout,"creating own qps\n");
 
-  own_res = new struct QP[_total_threads];
-  for(int i = 0;i < _total_threads;++i) {
+  own_res = new struct QP[qp_rows];
+  for(int i = 0;i < qp_rows;++i) {
     QP_init(own_res + i);
     if(QP_create(own_res + i,dev1)) {
       fprintf(stderr,"failed to create own resources\n");
@@ -613,12 +751,24 @@ void RdmaResource::init() {
   }
 }
 
+void RdmaResource::SoftMap(int m_id,char *addr) {
+  assert(soft && m_id < _total_partition);
+  for(int i = 0;i < qp_rows;i++)
+    res[i][m_id].remote_props.addr = (uintptr_t)addr;
+}
+
 void RdmaResource::Servicing() {
+  if(soft)
+    return;
   pthread_t update_tid;
   pthread_create(&update_tid, NULL, RecvThread, (void *)this);
 }
 
 void RdmaResource::Connect() {
+  if(soft) {
+    fprintf(stdout,"software transport, nothing to connect\n");
+    return;
+  }
 
   std::vector<int> partitions;
   for(int i = 0;i < _total_partition;++i) {
@@ -634,11 +784,11 @@ void RdmaResource::Connect() {
     zmq::socket_t socket(context,ZMQ_REQ);
 
     int port = 5573;
-    snprintf(address,30,"tcp://%s:%d",node->net_def[j].c_str(),port);
+    snprintf(address,30,"tcp://%s:%d",node->net_def[j],port);
     fprintf(stdout,"connect to %s\n",address);
     socket.connect(address);
 
-    for(int i = 0;i < _total_threads;++i) {
+    for(int i = 0;i < qp_rows;++i) {
       zmq::message_t request(2);
       std::string msg = "00";
       msg[0] = (char)_current_partition;
@@ -660,7 +810,7 @@ void RdmaResource::Connect() {
       }
     }
   }
-  for(int i = 0;i < _total_threads;++i) {
+  for(int i = 0;i < qp_rows;++i) {
     //initiliaze own qps for local reads
     struct cm_con_data_t local_con_data = get_local_con_data(own_res + i);
     if(connect_qp(res[i] + _current_partition,local_con_data)){
@@ -687,13 +837,10 @@ int RdmaResource::RdmaWrite(int t_id,int m_id,char* local,uint64_t size,uint64_t
 int RdmaResource::rdmaOp(int t_id,int machine_id,char* local,uint64_t size,uint64_t remote_offset,int op) {
   //simple wrapper function for handling rdma compare and swap
 
-  assert(remote_offset < this->size);
+  assert(RDMA_REGION_OF(remote_offset) != 0 || remote_offset < this->size);
   assert(machine_id < _total_partition);
   assert(t_id < _total_threads);
-  if(post_send(res[t_id] + machine_id,op,local,size,remote_offset,true) ) {
-    fprintf(stderr,"failed to post request.");
-    assert(false);
-  }
+  uint64_t ticket = post_send(GetQP(t_id,machine_id),op,local,size,remote_offset,true);
 
   // for(int i=0;i<31;i++){
   //   if(post_send(res[t_id] + machine_id,op,local,size,remote_offset,false) ) {
@@ -701,66 +848,223 @@ int RdmaResource::rdmaOp(int t_id,int machine_id,char* local,uint64_t size,uint6
   //     assert(false);
   //   }
   // }
-  if(poll_completion(res[t_id] + machine_id)) {
-    fprintf(stderr,"poll completion failed\n");
-    assert(false);
-  }
-  //TODO! we need to
+  Wait(t_id,machine_id,ticket);
   return 0;
 }
 int RdmaResource::RdmaCmpSwap(int t_id,int m_id,char*local,uint64_t compare,uint64_t swap,uint64_t size,uint64_t off) {
+  //the old value is in local on return
+  Wait(t_id,m_id,PostCmpSwapAsync(t_id,m_id,local,compare,swap,off));
+  return 0;
+}
 
-  struct QP *r = res[t_id] + m_id;
-  assert(r != NULL);
+int RdmaResource::RdmaFetchAdd(int t_id,int m_id,char*local,uint64_t add,uint64_t off) {
+  Wait(t_id,m_id,PostFetchAddAsync(t_id,m_id,local,add,off));
+  return 0;
+}
 
+/* a signaled atomic on the 8 bytes at off, the old value lands in local */
+static uint64_t
+post_atomic (struct QP *r,int opcode,char *local,uint64_t compare_add,uint64_t swap,
+	     uint64_t off)
+{
   struct ibv_send_wr sr;
   struct ibv_sge sge;
-  struct ibv_send_wr *bad_wr = NULL;
   int rc;
 
   memset(&sge,0,sizeof(sge));
   sge.addr = (uintptr_t)local;
   sge.length = sizeof(uint64_t);
-  sge.lkey = r->mr->lkey;
+  sge.lkey = r->soft ? 0 : r->mr->lkey;
 
   memset(&sr,0,sizeof(sr));
   sr.next = NULL;
-  sr.wr_id = 0;
+  sr.wr_id = next_ticket(r);
   sr.sg_list = &sge;
   sr.num_sge = 1;
-  sr.opcode = IBV_WR_ATOMIC_CMP_AND_SWP;
+  sr.opcode = (enum ibv_wr_opcode) opcode;
   sr.send_flags = IBV_SEND_SIGNALED;
-  sr.wr.atomic.remote_addr = r->remote_props.addr + off;//this field is uint64_t
-  sr.wr.atomic.rkey = r->remote_props.rkey;
-  sr.wr.atomic.compare_add = compare;
+  sr.wr.atomic.remote_addr = remote_addr(r,off,&sr.wr.atomic.rkey);
+  sr.wr.atomic.compare_add = compare_add;
   sr.wr.atomic.swap = swap;
 
-  rc = ibv_post_send(r->qp,&sr,&bad_wr);
+  rc = submit(r,&sr);
   if(rc) {
-    fprintf(stderr,"failed to post SR CAS\n");
-  }else {
+    fprintf(stderr,"failed to post SR atomic\n");
+    assert(false);
+  }
+  return sr.wr_id;
+}
+
+uint64_t RdmaResource::PostFetchAddAsync(int t_id,int m_id,char*local,uint64_t add,uint64_t off) {
+  struct QP *r = GetQP(t_id,m_id);
+  assert(r != NULL);
+  return post_atomic(r,IBV_WR_ATOMIC_FETCH_AND_ADD,local,add,0,off);
+}
+
+uint64_t RdmaResource::PostCmpSwapAsync(int t_id,int m_id,char*local,uint64_t compare,uint64_t swap,uint64_t off) {
+
+  struct QP *r = GetQP(t_id,m_id);
+  assert(r != NULL);
+  return post_atomic(r,IBV_WR_ATOMIC_CMP_AND_SWP,local,compare,swap,off);
+}
+
+uint64_t RdmaResource::PostAsync(int t_id,int m_id,char* local,uint64_t size,uint64_t remote_offset,int op) {
+  assert(RDMA_REGION_OF(remote_offset) != 0 || remote_offset < this->size);
+  return post_send(GetQP(t_id,m_id),op,local,size,remote_offset,true);
+}
 
+uint64_t RdmaResource::PostOpsAsync(int t_id,int m_id,normal_op_req *reqs,int n) {
+  struct QP *r = GetQP(t_id,m_id);
+  assert(n > 0);
+
+  for(int i = 0;i < n;i++) {
+    normal_op_req *req = reqs + i;
+    assert(RDMA_REGION_OF(req->remote_offset) != 0 || req->remote_offset < this->size);
+    memset(&req->sge,0,sizeof(req->sge));
+    req->sge.addr = (uintptr_t)req->local_buf;
+    req->sge.length = req->size;
+    req->sge.lkey = r->soft ? 0 : r->mr->lkey;
+
+    memset(&req->sr,0,sizeof(req->sr));
+    req->sr.wr_id = next_ticket(r);
+    req->sr.sg_list = &req->sge;
+    req->sr.num_sge = 1;
+    req->sr.opcode = req->opcode;
+    req->sr.next = (i + 1 < n) ? &reqs[i + 1].sr : NULL;
+    if(i == n - 1 || r->shared)
+      req->sr.send_flags = IBV_SEND_SIGNALED;
+    if(req->opcode == IBV_WR_RDMA_WRITE && req->size <= r->max_inline)
+      req->sr.send_flags |= IBV_SEND_INLINE;
+    if(req->opcode == IBV_WR_ATOMIC_CMP_AND_SWP || req->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) {
+      req->sr.wr.atomic.remote_addr = remote_addr(r,req->remote_offset,&req->sr.wr.atomic.rkey);
+      req->sr.wr.atomic.compare_add = req->compare_and_add;
+      req->sr.wr.atomic.swap = req->swap;
+    } else {
+      req->sr.wr.rdma.remote_addr = remote_addr(r,req->remote_offset,&req->sr.wr.rdma.rkey);
+    }
   }
-  // if(poll_completion(r) ){
-  //   fprintf(stderr,"poll completion failed\n");
-  //   assert(false);
-  // }
-  //TODO! we need to
+  if(submit(r,&reqs[0].sr)) {
+    fprintf(stderr,"failed to post request chain.");
+    assert(false);
+  }
+  return reqs[n - 1].sr.wr_id;
+}
+
+int RdmaResource::RdmaOps(int t_id,int m_id,normal_op_req *reqs,int n) {
+  Wait(t_id,m_id,PostOpsAsync(t_id,m_id,reqs,n));
   return 0;
 }
 
-int RdmaResource::post(int t_id,int machine_id,char* local,uint64_t size,uint64_t remote_offset,int op) {
-  if(post_send(res[t_id] + machine_id,op,local,size,remote_offset,true) ) {
-    fprintf(stderr,"failed to post request.");
-    assert(false);
+int RdmaResource::FillWritePair(int t_id,int m_id,normal_op_req *reqs,char *val,uint64_t size,
+				uint64_t val_off,uint64_t word,uint64_t word_off,char *buf) {
+  *(uint64_t *)buf = word;
+  reqs[0].opcode = IBV_WR_RDMA_WRITE;
+  if(size <= (uint64_t)MaxInline(t_id,m_id)) {
+    /* inline payload is copied by the post itself */
+    reqs[0].local_buf = val;
+  } else {
+    assert(sizeof(uint64_t) + size <= BufSize(t_id));
+    memcpy(buf + sizeof(uint64_t),val,size);
+    reqs[0].local_buf = buf + sizeof(uint64_t);
+  }
+  reqs[0].size = size;
+  reqs[0].remote_offset = val_off;
+
+  reqs[1].opcode = IBV_WR_RDMA_WRITE;
+  reqs[1].local_buf = buf;
+  reqs[1].size = sizeof(uint64_t);
+  reqs[1].remote_offset = word_off;
+  return 2;
+}
+
+void RdmaResource::InitBufPool(int t_id,uint64_t reserved) {
+  struct BufPool *p = &pools[t_id];
+  assert(reserved <= bufferEntrySize);
+  if(p->free_list != NULL && p->base == GetMsgAddr(t_id) + reserved)
+    return;
+  delete[] p->free_list;
+  p->base = GetMsgAddr(t_id) + reserved;
+  /* keep the buffers cache line aligned */
+  p->buf_size = ((bufferEntrySize - reserved) / RDMA_MAX_OUTSTANDING) & ~63UL;
+  p->count = p->buf_size > 0 ? RDMA_MAX_OUTSTANDING : 0;
+  p->free_list = new int[RDMA_MAX_OUTSTANDING];
+  for(p->top = 0;p->top < p->count;p->top++)
+    p->free_list[p->top] = p->count - 1 - p->top;
+}
+
+int RdmaResource::RegisterRegion(int r_id,char *addr,uint64_t size) {
+  assert(r_id > 0 && r_id < RDMA_MAX_REGIONS && size <= RDMA_REGION_MASK);
+  struct rdma_region e;
+  e.addr = (uintptr_t)addr;
+  e.size = size;
+  e.rkey = 0;
+  if(!soft) {
+    int mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+      IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC;
+    for(int d = 0;d < 2;d++) {
+      if(region_mr[r_id][d] != NULL)
+	ibv_dereg_mr(region_mr[r_id][d]);
+      region_mr[r_id][d] = ibv_reg_mr((d == 0 ? dev0 : dev1)->pd,addr,size,mr_flags);
+      if(region_mr[r_id][d] == NULL) {
+	fprintf(stderr,"ibv_reg_mr of region %d failed\n",r_id);
+	return 1;
+      }
+    }
+    /* loopback requests are served by the own QPs on dev1 */
+    e.rkey = region_mr[r_id][1]->rkey;
   }
+  SetRegion(_current_partition,r_id,&e);
+  return 0;
+}
+
+void RdmaResource::GetRegion(int r_id,struct rdma_region *entry) {
+  *entry = regions[_current_partition][r_id];
+  /* remote machines reach us through the QPs on dev0 */
+  if(!soft)
+    entry->rkey = region_mr[r_id][0]->rkey;
+}
+
+void RdmaResource::SetRegion(int m_id,int r_id,const struct rdma_region *entry) {
+  assert(r_id > 0 && r_id < RDMA_MAX_REGIONS);
+  struct rdma_region *e = &regions[m_id][r_id];
+  e->size = 0;
+  __sync_synchronize();
+  e->addr = entry->addr;
+  e->rkey = entry->rkey;
+  /* the size marks the entry valid */
+  __sync_synchronize();
+  e->size = entry->size;
+}
+
+int RdmaResource::PollAsync(int t_id,int m_id) {
+  return reap_completions(GetQP(t_id,m_id));
+}
+
+void RdmaResource::Wait(int t_id,int m_id,uint64_t ticket) {
+  while(!Done(t_id,m_id,ticket))
+    PollAsync(t_id,m_id);
+}
+
+int RdmaResource::post(int t_id,int machine_id,char* local,uint64_t size,uint64_t remote_offset,int op) {
+  struct QP *r = GetQP(t_id,machine_id);
+  /* a shared QP signals every request anyway */
+  bool signal = (r->posted + 1) % RDMA_SIGNAL_BATCH == 0;
+  last_ticket[t_id][machine_id] = post_send(r,op,local,size,remote_offset,signal);
   return 0;
 }
 int RdmaResource::poll(int t_id,int machine_id) {
-  if(poll_completion(res[t_id] + machine_id)) {
-    fprintf(stderr,"poll completion failed\n");
-    assert(false);
+  struct QP *r = GetQP(t_id,machine_id);
+  if(r->shared) {
+    /* requests of one thread complete in the order it posted them */
+    Wait(t_id,machine_id,last_ticket[t_id][machine_id]);
+    return 0;
+  }
+  if(r->signaled < r->posted) {
+    /* nothing would report the unsignaled tail, flush it with an empty write */
+    post_send(r,IBV_WR_RDMA_WRITE,buffer,0,0,true);
   }
+  while(r->completed < r->posted)
+    reap_completions(r);
   return 0;
 }
 
@@ -799,6 +1103,8 @@ batch_poll_completion (struct QP *res,int total) {
     //      wc.status, wc.vendor_err);
     //   rc = 1;
     // }
+    for (int i = 0; i < poll_result; i++)
+      complete_ticket (res, wc[i].wr_id);
   }
   return poll_result;
 }
@@ -814,7 +1120,7 @@ internal_rdtsc(void)
 int RdmaResource::batch_rdmaOp(int t_id,int machine_id,char* local,uint64_t size,uint64_t remote_offset,int op) {
   //simple wrapper function for handling rdma compare and swap
 
-  assert(remote_offset < this->size);
+  assert(RDMA_REGION_OF(remote_offset) != 0 || remote_offset < this->size);
   assert(machine_id < _total_partition);
   assert(t_id < _total_threads);
 
@@ -822,14 +1128,11 @@ int RdmaResource::batch_rdmaOp(int t_id,int machine_id,char* local,uint64_t size
   uint64_t sum = 0;
   int batch_factor=32;
   for(int i=0;i<batch_factor;i++){
-    if(post_send(res[t_id] + machine_id,op,local,size,remote_offset,true) ) {
-      fprintf(stderr,"failed to post request.");
-      assert(false);
-    }
+    post_send(GetQP(t_id,machine_id),op,local,size,remote_offset,true);
   }
   int count=0;
   while(true){
-    int this_round=batch_poll_completion(res[t_id] + machine_id,batch_factor-count);
+    int this_round=batch_poll_completion(GetQP(t_id,machine_id),batch_factor-count);
     sum = sum+ (internal_rdtsc() - start)*this_round;
     count=count+this_round;
     if(count==batch_factor)
@@ -855,7 +1158,7 @@ void* RdmaResource::RecvThread(void * arg) {
   char address[30]="";
   int port =  5573;
   int _current_partition=rdma->_current_partition;
-  sprintf(address,"tcp://%s:%d",rdma->node->net_def[_current_partition].c_str(),port);
+  sprintf(address,"tcp://%s:%d",rdma->node->net_def[_current_partition],port);
   fprintf(stdout,"binding: %s\n",address);
   socket.bind(address);
 
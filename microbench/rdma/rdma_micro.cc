@@ -24,19 +24,22 @@
 
 // a file for testing rdma read performance
 
+#include <assert.h>
 #include <pthread.h>
 #include <set>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unordered_map>
 #include <vector>
 
 #include "network_node.h"
-#include "rdma_cuckoohash.h"
+#include "keygen.h"
+#include "latency_hist.h"
+#include "rdma_coroutine.h"
 #include "rdma_resource.h"
+#include "remote_hash.h"
 #include <sys/mman.h> //linux 内存映射
-// #include "rdma_hophash.h"
-// #include "rdma_clusterhash.h"
 
 int THREAD_NUM = 6;
 uint64_t cycles_per_second;
@@ -60,23 +63,43 @@ inline uint64_t rdtsc(void) {
     return ((uint64_t)lo) | (((uint64_t)hi) << 32);
 }
 
+inline uint64_t cycles_to_ns(uint64_t cycles) {
+    return (uint64_t)(cycles * 1e9 / cycles_per_second);
+}
+
 struct Thread_config {
     int id;
     double throughput;
-    int latency;
+    LatencyHist *hist; // lookup latencies, ns
     void *ptr;
     int *buffer;
+    int misses;
 };
 uint64_t rdma_size;
-uint64_t val_num = 1000 * 1000;
+uint64_t val_num = 1000 * 1000 * 20;
 double rate = 0.9;
 
-int current_partition;
-int total_partition;
+size_t current_partition;
+size_t total_partition;
 int target_partition;
 void Run(void *info);
 void Run1(void *info);
 void Run2(void *info);
+void Run3(void *info);
+
+#define MAX_TABLES 8
+RemoteHash *tables[MAX_TABLES];
+int table_num = 0;
+bool use_cache = false; // cache value locations of looked up keys
+const char *dist = "uniform";
+KeyGen keygen; // parsed -dist, every thread copies it
+
+// the key generator of a thread over the loaded keys
+void thread_keygen(KeyGen *g, int id) {
+    *g = keygen;
+    KeyGen_init(g, (uint64_t)(val_num * rate),
+                id + current_partition * THREAD_NUM);
+}
 
 struct cache_entry {
     // pthread_spinlock_t lock;
@@ -100,14 +123,16 @@ void limited_cache_clear() {
         limited_cache[i].loc = -1;
     }
 }
-bool limited_cache_lookup(uint64_t key) {
+bool limited_cache_lookup(uint64_t key, uint64_t *loc) {
     bool ret = false;
     uint64_t old_seq = limited_cache[key % cache_num].seq_num;
     if (old_seq % 2 == 1)
         return false;
 
-    if (limited_cache[key % cache_num].key == key)
+    if (limited_cache[key % cache_num].key == key) {
+        *loc = limited_cache[key % cache_num].loc;
         ret = true;
+    }
 
     uint64_t new_seq = limited_cache[key % cache_num].seq_num;
     if (new_seq == old_seq)
@@ -128,15 +153,150 @@ void limited_cache_insert(uint64_t key, uint64_t loc) {
     return;
 }
 
-int val_length;
+int val_length = 64;
+
+#define SWEEP_RATES "0.5,0.6,0.7,0.8,0.85,0.9,0.95"
+#define SWEEP_LOOKUPS 1000000
+
+void usage() {
+    fprintf(stderr,
+            "usage: rdma_micro <partition> <partitions> [peer list] "
+            "[-hash=NAME,...] [-val=N] [-len=N] [-cache] [-dist=SPEC]\n"
+            "       rdma_micro -sweep[=RATE,...] [-hash=NAME,...] [-val=N] "
+            "[-len=N] [-dist=SPEC]\n"
+            "  -hash  tables to compare on the same keys, from: %s\n"
+            "  -val   value bytes (default 64)\n"
+            "  -len   entries of a table (default %lu)\n"
+            "  -cache cache the value location of looked up keys\n"
+            "  -dist  key distribution (default uniform), one of\n"
+            "         %s\n"
+            "  -sweep fill the tables to each rate (default %s) and print\n"
+            "         their occupancy and reads per lookup, no remote side\n",
+            REMOTE_HASH_NAMES, val_num, KEYGEN_NAMES, SWEEP_RATES);
+    exit(1);
+}
+
+// A remote lookup replayed on the table in arr: the reads of its stages are
+// served from local memory, returns how many it took.
+int local_lookup(RemoteHash *table, const char *arr, uint64_t key,
+                 bool *miss) {
+    RemoteLookup l;
+    int count = 0;
+    RemoteHash_start(&l, key);
+    while (l.stage >= 0) {
+        uint64_t off, size;
+        RemoteHash_post(table, &l, &off, &size);
+        RemoteHash_poll(table, &l, arr + off);
+        count++;
+    }
+    *miss = l.stage == RH_MISS;
+    return count;
+}
+
+// Fill every table to each of the rates in turn. The stats give the reads of
+// one lookup per present key, the replayed lookups the reads under -dist.
+void sweep(const char *names, const char *rates, char *buffer) {
+    char name[32];
+    for (const char *r = rates; *r != '\0';) {
+        rate = atof(r);
+        r += strcspn(r, ",");
+        r += *r == ',';
+        for (const char *p = names; *p != '\0';) {
+            int len = strcspn(p, ",");
+            snprintf(name, sizeof(name), "%.*s", len, p);
+            p += len + (p[len] == ',');
+            RemoteHash *table =
+                RemoteHash_new(name, val_length, val_num, buffer, 0);
+            if (table == NULL) {
+                fprintf(stderr, "unknown table %s\n", name);
+                usage();
+            }
+            char data[2050];
+            memset(data, 0, sizeof(data));
+            uint64_t failed = 0;
+            for (uint64_t i = 0; i < val_num * rate; i++)
+                failed += !table->insert(table->table, i, data);
+            if (failed > 0)
+                fprintf(stderr, "%s: %lu inserts failed\n", name, failed);
+
+            HashStats s;
+            table->stats(table->table, &s);
+            KeyGen gen;
+            thread_keygen(&gen, 0);
+            uint64_t reads = 0;
+            int misses = 0;
+            for (int i = 0; i < SWEEP_LOOKUPS; i++) {
+                bool miss;
+                reads += local_lookup(table, buffer, KeyGen_next(&gen), &miss);
+                misses += miss;
+            }
+            printf("rate\t%.2f\tdist\t%s\tdist_reads\t%.3f\tmisses\t%d\t",
+                   rate, dist, reads * 1.0 / SWEEP_LOOKUPS, misses);
+            HashStats_print(&s, table->name, stdout);
+            free(table->table);
+            free(table);
+        }
+    }
+}
+
 int main(int argc, char **argv) {
     void (*ptr)(void *) = Run;
 
-    int id = atoi(argv[1]);
-    current_partition = id;
-    total_partition = atoi(argv[2]);
+    const char *names = "cluster";
+    const char *peers = NULL;
+    const char *rates = NULL;
+    int positional = 0;
+    for (int i = 1; i < argc; i++) {
+        int n;
+        char junk;
+        if (strncmp(argv[i], "-hash=", 6) == 0) {
+            names = argv[i] + 6;
+        } else if (sscanf(argv[i], "-val=%d%c", &n, &junk) == 1) {
+            val_length = n;
+        } else if (sscanf(argv[i], "-len=%d%c", &n, &junk) == 1 && n > 0) {
+            val_num = n;
+        } else if (strcmp(argv[i], "-sweep") == 0) {
+            rates = SWEEP_RATES;
+        } else if (strncmp(argv[i], "-sweep=", 7) == 0) {
+            rates = argv[i] + 7;
+        } else if (strcmp(argv[i], "-cache") == 0) {
+            use_cache = true;
+        } else if (strncmp(argv[i], "-dist=", 6) == 0) {
+            dist = argv[i] + 6;
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else if (positional == 0) {
+            current_partition = atoi(argv[i]);
+            positional++;
+        } else if (positional == 1) {
+            total_partition = atoi(argv[i]);
+            positional++;
+        } else {
+            peers = argv[i];
+        }
+    }
+    if ((positional < 2 && rates == NULL) || val_length <= 0 ||
+        val_length > 2048 || !KeyGen_parse(&keygen, dist))
+        usage();
+    if (rates != NULL) {
+        // above the footprint of every table, pages are only touched as
+        // far as the current one reaches
+        uint64_t entry = (val_length + 7) & ~7;
+        uint64_t bytes = val_num * (2 * entry + 2 * sizeof(HeaderNode));
+        char *sweep_buf = (char *)malloc(bytes);
+        if (sweep_buf == NULL) {
+            fprintf(stderr,
+                    "cannot allocate %lu bytes for the sweep, lower -len\n",
+                    bytes);
+            return 1;
+        }
+        sweep(names, rates, sweep_buf);
+        free(sweep_buf);
+        return 0;
+    }
+
     target_partition = 0;
-    ptr = Run2;
+    ptr = Run3;
     if (current_partition == target_partition) {
         ptr = Run1;
     }
@@ -157,52 +317,69 @@ int main(int argc, char **argv) {
     rdma_size = rdma_size * 20;     // 20G
     uint64_t total_size = rdma_size + 1024 * 1024 * 1024;
 
-    // rdma_size = 1024*4;  //4K
-    // //rdma_size = rdma_size*20; //20G
-    // uint64_t total_size=rdma_size+1024*4;
-
+    // optional peer list, one "host [base port]" line per partition
     Network_Node *node =
-        new Network_Node(total_partition, current_partition, THREAD_NUM);
+        Network_Node_new(current_partition, THREAD_NUM, peers);
 
     fprintf(stdout, "size %ld ... ", total_size);
     char *buffer = (char *)malloc(total_size);
     char data[2050];
-    val_num = 1000 * 1000;
-    val_num = val_num * 20;
+    memset(data, 0, sizeof(data));
     limited_cache_init();
 
-    // Rdma_3_1_CuckooHash *table = new
-    // Rdma_3_1_CuckooHash(val_length,val_num,buffer); RdmaHopHash *table = new
-    // RdmaHopHash(val_length,val_num,buffer);
-    RdmaClusterHash *table = new RdmaClusterHash(val_length, val_num, buffer);
-    for (uint64_t i = 0; i < val_num * rate; i++) {
-        table->Insert(i, data);
+    // every table is loaded with the same keys, one after another in the
+    // region, so all of them are served during one connection
+    uint64_t base = 0;
+    char name[32];
+    for (const char *p = names; *p != '\0';) {
+        int len = strcspn(p, ",");
+        snprintf(name, sizeof(name), "%.*s", len, p);
+        p += len + (p[len] == ',');
+        assert(table_num < MAX_TABLES);
+        RemoteHash *table =
+            RemoteHash_new(name, val_length, val_num, buffer + base, base);
+        if (table == NULL) {
+            fprintf(stderr, "unknown table %s\n", name);
+            usage();
+        }
+        uint64_t failed = 0;
+        for (uint64_t i = 0; i < val_num * rate; i++) {
+            failed += !table->insert(table->table, i, data);
+        }
+        if (failed > 0)
+            fprintf(stderr, "%s: %lu inserts failed\n", name, failed);
+        base += (table->footprint(table->table) + 4095) & ~4095UL;
+        assert(base <= rdma_size);
+        tables[table_num++] = table;
+        HashStats s;
+        table->stats(table->table, &s);
+        HashStats_print(&s, table->name, stdout);
     }
-    limited_cache_clear();
     rdma = new RdmaResource(total_partition, THREAD_NUM, current_partition,
                             (char *)buffer, total_size, 1024 * 1024 * 128,
                             rdma_size);
-    // rdma=new RdmaResource(total_partition,THREAD_NUM,current_partition,(char
-    // *)buffer,total_size,512,rdma_size);
     rdma->node = node;
     rdma->Servicing();
     rdma->Connect();
     for (size_t id = 0; id < THREAD_NUM; ++id) {
         configs[id].buffer = NULL;
+        configs[id].hist = new LatencyHist;
     }
+    LatencyHist *hist = new LatencyHist;
+    char *msg_buf = (char *)malloc(sizeof(int) + HIST_SERIAL_MAX);
 
     fprintf(stdout, "connection done\n");
 
-    val_length = 64;
-    while (true) {
-        // val_length=val_length*2;
-        if (val_length > 2048)
-            break;
+    for (int t = 0; t < table_num; t++) {
+        RemoteHash *table = tables[t];
+        // the cached locations belong to the previous table
         limited_cache_clear();
         for (size_t id = 0; id < THREAD_NUM; ++id) {
             configs[id].id = id;
             configs[id].throughput = 0;
+            configs[id].misses = 0;
             configs[id].ptr = table;
+            LatencyHist_init(configs[id].hist);
             pthread_create(&(thread[id]), NULL, ptr, (void *)&(configs[id]));
         }
         for (size_t t = 0; t < THREAD_NUM; t++) {
@@ -213,93 +390,90 @@ int main(int argc, char **argv) {
             }
         }
         int total_throughput = 0;
+        int misses = 0;
+        LatencyHist_init(hist);
         for (size_t t = 0; t < THREAD_NUM; t++) {
             total_throughput += configs[t].throughput;
+            misses += configs[t].misses;
+            LatencyHist_merge(hist, configs[t].hist);
         }
-        int average_latency = 0;
-        for (size_t t = 0; t < THREAD_NUM; t++) {
-            average_latency += configs[t].latency;
-        }
-        average_latency = average_latency / THREAD_NUM;
+        if (misses > 0)
+            fprintf(stderr, "%s: %d keys not found\n", table->name, misses);
+
+        // the throughput and the latency histogram of a partition travel in
+        // one message
+        int len;
 
         // last partition will print the total throughput of all clients
         if (current_partition == total_partition - 1) {
             for (int i = 1; i < current_partition; i++) {
-                std::string str = node->Recv();
-                // first 2 char is for internal usage
-                int tmp = std::stoi(str.substr(2));
-                total_throughput += tmp;
-            }
-            for (int i = 1; i < current_partition; i++) {
-                node->Send(i, THREAD_NUM, std::to_string(total_throughput));
+                char *msg = Network_Node_Recv(node, &len, NULL, NULL);
+                int throughput;
+                memcpy(&throughput, msg, sizeof(int));
+                total_throughput += throughput;
+                int used =
+                    LatencyHist_merge_serialized(hist, msg + sizeof(int));
+                assert(len == sizeof(int) + used);
             }
+            int average_latency = LatencyHist_mean(hist);
             // barrier();
             for (int i = 1; i < current_partition; i++) {
-                std::string str = node->Recv();
-                // first 2 char is for internal usage
-                int tmp = std::stoi(str.substr(2));
-                average_latency += tmp;
+                Network_Node_SendBatched(node, i, THREAD_NUM,
+                                         (char *)&total_throughput,
+                                         sizeof(total_throughput));
             }
-            average_latency = average_latency / (total_partition - 1);
-            for (int i = 1; i < current_partition; i++) {
-                node->Send(i, THREAD_NUM, std::to_string(total_throughput));
-            }
-            printf("val_length\t%d\tthroughput\t%d\tlatency\t%d\n", val_length,
-                   total_throughput, average_latency);
+            Network_Node_Flush(node);
+            printf("hash\t%s\tdist\t%s\tval_length\t%d\tthroughput\t%d\t"
+                   "latency\t%d\tfootprint\t%lu\n",
+                   table->name, dist, val_length, total_throughput,
+                   average_latency, table->footprint(table->table));
+            LatencyHist_print(hist, table->name, stdout);
         } else {
-            node->Send(total_partition - 1, THREAD_NUM,
-                       std::to_string(total_throughput));
-            std::string str = node->Recv();
-            node->Send(total_partition - 1, THREAD_NUM,
-                       std::to_string(average_latency));
-            str = node->Recv();
+            memcpy(msg_buf, &total_throughput, sizeof(int));
+            len = sizeof(int) +
+                  LatencyHist_serialize(hist, msg_buf + sizeof(int));
+            Network_Node_Send(node, total_partition - 1, THREAD_NUM, msg_buf,
+                              len);
+            Network_Node_Recv(node, &len, NULL, NULL);
             printf("local throughput:%d\n", total_throughput);
         }
     }
 }
 
-void random_read(void *ptr, uint64_t key, uint64_t val_length) {
-    struct Thread_config *config = (struct Thread_config *)ptr;
-    int id = config->id;
-    uint64_t *local_buffer = (uint64_t *)rdma->GetMsgAddr(id);
-    uint64_t start_addr = (key % (rdma_size / val_length)) * val_length;
-    rdma->RdmaRead(id, target_partition, (char *)local_buffer, val_length,
-                   start_addr);
+// start a lookup, a cached location skips the index
+void lookup_start(RemoteLookup *l, uint64_t key) {
+    RemoteHash_start(l, key);
+    if (use_cache && limited_cache_lookup(key, &l->loc))
+        l->stage = RH_VALUE;
+}
+
+// consume the read of the current stage
+void lookup_advance(RemoteHash *table, RemoteLookup *l, const char *buf) {
+    int stage = l->stage;
+    RemoteHash_poll(table, l, buf);
+    if (use_cache && stage != RH_VALUE &&
+        (l->stage == RH_VALUE || l->stage == RH_DONE))
+        limited_cache_insert(l->key, l->loc);
 }
-int cuckoo_read(void *ptr, uint64_t key, uint64_t val_length) {
+
+// one lookup with blocking reads, returns the number of reads
+int remote_lookup(void *ptr, uint64_t key) {
     struct Thread_config *config = (struct Thread_config *)ptr;
-    uint64_t id = config->id;
-    Rdma_3_1_CuckooHash *table = (Rdma_3_1_CuckooHash *)(config->ptr);
-    uint64_t *local_buffer = (uint64_t *)rdma->GetMsgAddr(id);
-    uint64_t loc = 0;
-    uint64_t p[3];
-    p[0] = table->GetHash(key);
+    int id = config->id;
+    RemoteHash *table = (RemoteHash *)(config->ptr);
+    char *local_buffer = (char *)rdma->GetMsgAddr(id);
+    RemoteLookup l;
     int count = 0;
-    for (uint64_t slot = 0; slot < 3; slot++) {
+    lookup_start(&l, key);
+    while (l.stage >= 0) {
+        uint64_t off, size;
+        RemoteHash_post(table, &l, &off, &size);
+        rdma->RdmaRead(id, target_partition, local_buffer, size, off);
+        lookup_advance(table, &l, local_buffer);
         count++;
-        if (slot == 1)
-            p[1] = table->GetHash2(key);
-        if (slot == 2)
-            p[2] = table->GetHash3(key);
-        loc = p[slot] * table->bucketsize;
-        rdma->RdmaRead(id, target_partition, (char *)local_buffer,
-                       sizeof(Rdma_3_1_CuckooHash::RdmaArrayNode), loc);
-        Rdma_3_1_CuckooHash::RdmaArrayNode *node =
-            (Rdma_3_1_CuckooHash::RdmaArrayNode *)local_buffer;
-        if (node->valid == true && node->key == key) {
-            loc = table->get_dataloc(node->index);
-            break;
-        }
     }
-    // assert(rdma->RdmaRead(id,target_partition,(char *)local_buffer
-    // ,val_length , 0) == 0);
-    uint64_t index = ((key * key) % (val_num));
-    uint64_t start_addr = index * val_length;
-    // while(start_addr>off)
-    //   start_addr=start_addr/2;
-    rdma->RdmaRead(id, target_partition, (char *)local_buffer, val_length,
-                   start_addr);
-    count++;
+    if (l.stage == RH_MISS)
+        config->misses++;
     return count;
 }
 
@@ -308,23 +482,15 @@ void Run(void *ptr) {
     int id = config->id;
     pin_to_core(socket_1[id]);
     int num_operations = 1000000; //*16;
-    int seed = id + current_partition * THREAD_NUM;
+    KeyGen gen;
+    thread_keygen(&gen, id);
     sleep(2);
     uint64_t start_t = rdtsc();
     int count = 0;
     for (int i = 0; i < num_operations; i++) {
-        uint64_t key = rand_r(&seed) % ((int)(val_num * rate));
-        // int val_length=64;
-        uint64_t *local_buffer = (uint64_t *)rdma->GetMsgAddr(id);
-        uint64_t start_addr = (key % (rdma_size / val_length)) * val_length;
-        count += cuckoo_read(ptr, key, val_length);
-
-        // rdma->post(id,target_partition,(char
-        // *)local_buffer+(i%32)*val_length,val_length,start_addr,IBV_WR_RDMA_READ);
-        // if(i%32==31){
-        //   for(int tmp=0;tmp<32;tmp++)
-        //     rdma->poll(id,target_partition);
-        // }
+        uint64_t start = rdtsc();
+        count += remote_lookup(ptr, KeyGen_next(&gen));
+        LatencyHist_record(config->hist, cycles_to_ns(rdtsc() - start));
     }
     printf("count %f\n", count * 1.0 / num_operations);
     uint64_t cycle_num = rdtsc() - start_t;
@@ -333,320 +499,86 @@ void Run(void *ptr) {
 
 const int batch_factor = 4; // 32;
 struct post_window {
-    uint64_t key;
-    uint64_t loc;
+    RemoteLookup l;
     uint64_t start;
-    int stage;
     int winid;
 };
-void rdmaread_post(void *ptr, post_window win) {
-    struct Thread_config *config = (struct Thread_config *)ptr;
-    int id = config->id;
-    uint64_t *local_buffer = (uint64_t *)rdma->GetMsgAddr(id) +
-                             win.winid * val_length; // 2048;//val_length ;
-    uint64_t start_addr = (win.key % (rdma_size / val_length)) * val_length;
-    rdma->post(id, target_partition, (char *)local_buffer, val_length,
-               start_addr, IBV_WR_RDMA_READ);
-}
 
-post_window rdmaread_poll(void *ptr, post_window win) {
+char *window_buffer(void *ptr, int winid) {
     struct Thread_config *config = (struct Thread_config *)ptr;
-    int id = config->id;
-    rdma->poll(id, target_partition);
-    win.stage = -1;
-    return win;
-}
-
-void cuckoo_post(void *ptr, post_window win) {
-    struct Thread_config *config = (struct Thread_config *)ptr;
-    uint64_t id = config->id;
-    Rdma_3_1_CuckooHash *table = (Rdma_3_1_CuckooHash *)(config->ptr);
-    // char *local_buffer = (char
-    // *)rdma->GetMsgAddr(id)+win.winid*2048;///batch_factor*128 ;
-    int node_size = sizeof(Rdma_3_1_CuckooHash::RdmaArrayNode);
-    char *local_buffer =
-        (char *)rdma->GetMsgAddr(id) + win.winid * std::max(32, val_length);
-    uint64_t loc = 0;
-    uint64_t hash;
-    if (win.stage == 0) {
-        hash = table->GetHash(win.key);
-        loc = hash * table->bucketsize;
-        rdma->post(id, target_partition, (char *)local_buffer,
-                   sizeof(Rdma_3_1_CuckooHash::RdmaArrayNode), loc,
-                   IBV_WR_RDMA_READ);
-    } else if (win.stage == 1) {
-        hash = table->GetHash2(win.key);
-        loc = hash * table->bucketsize;
-        rdma->post(id, target_partition, (char *)local_buffer,
-                   sizeof(Rdma_3_1_CuckooHash::RdmaArrayNode), loc,
-                   IBV_WR_RDMA_READ);
-    } else if (win.stage == 2) {
-        hash = table->GetHash3(win.key);
-        loc = hash * table->bucketsize;
-        rdma->post(id, target_partition, (char *)local_buffer,
-                   sizeof(Rdma_3_1_CuckooHash::RdmaArrayNode), loc,
-                   IBV_WR_RDMA_READ);
-    } else {
-        uint64_t start_addr = (win.key % (rdma_size / val_length)) * val_length;
-        rdma->post(id, target_partition, (char *)local_buffer, val_length,
-                   start_addr, IBV_WR_RDMA_READ);
-    }
-}
-
-post_window cuckoo_poll(void *ptr, post_window win) {
-    struct Thread_config *config = (struct Thread_config *)ptr;
-    uint64_t id = config->id;
-    Rdma_3_1_CuckooHash *table = (Rdma_3_1_CuckooHash *)(config->ptr);
-    // char *local_buffer = (char
-    // *)rdma->GetMsgAddr(id)+win.winid*2048;///batch_factor*128 ;
-    int node_size = sizeof(Rdma_3_1_CuckooHash::RdmaArrayNode);
-    char *local_buffer =
-        (char *)rdma->GetMsgAddr(id) + win.winid * std::max(32, val_length);
-    uint64_t loc = 0;
-    rdma->poll(id, target_partition);
-    if (win.stage == 0 || win.stage == 1 || win.stage == 2) {
-        Rdma_3_1_CuckooHash::RdmaArrayNode *node =
-            (Rdma_3_1_CuckooHash::RdmaArrayNode *)local_buffer;
-        if (node->valid == true && node->key == win.key) {
-
-            loc = table->get_dataloc(node->index);
-            win.stage = 3;
-            return win;
-        } else {
-            win.stage = win.stage + 1;
-            return win;
-        }
-    } else {
-        win.stage = -1;
-        return win;
-    }
+    RemoteHash *table = (RemoteHash *)(config->ptr);
+    return (char *)rdma->GetMsgAddr(config->id) + winid * table->max_read;
 }
 
-void hop_indirect_post(void *ptr, post_window win) {
-    struct Thread_config *config = (struct Thread_config *)ptr;
-    uint64_t id = config->id;
-    RdmaHopHash *table = (RdmaHopHash *)(config->ptr);
-    char *local_buffer =
-        (char *)rdma->GetMsgAddr(id) + win.winid * 2048; /// batch_factor*128 ;
-    uint64_t loc = 0;
-    uint64_t hash;
-    if (win.stage == 0) {
-        hash = table->GetHash(win.key);
-        uint64_t read_header = 8 * (sizeof(uint64_t) + 16);
-        uint64_t loc = read_header / 2 * hash;
-        rdma->post(id, target_partition, (char *)local_buffer, read_header, loc,
-                   IBV_WR_RDMA_READ);
-    } else if (win.stage == 1) {
-        uint64_t read_chain = (sizeof(RdmaHopHash::RdmaChainNode));
-        rdma->post(id, target_partition, (char *)local_buffer, read_chain, loc,
-                   IBV_WR_RDMA_READ);
-    } else {
-        uint64_t start_addr = (win.key % (rdma_size / val_length)) * val_length;
-        rdma->post(id, target_partition, (char *)local_buffer, val_length,
-                   start_addr, IBV_WR_RDMA_READ);
-    }
-}
-post_window hop_indirect_poll(void *ptr, post_window win) {
+void window_post(void *ptr, post_window *win) {
     struct Thread_config *config = (struct Thread_config *)ptr;
-    uint64_t id = config->id;
-    RdmaHopHash *table = (RdmaHopHash *)(config->ptr);
-    char *local_buffer =
-        (char *)rdma->GetMsgAddr(id) + win.winid * 2048; /// batch_factor*128 ;
-    uint64_t loc = 0;
-    rdma->poll(id, target_partition);
-    if (win.stage == 0) {
-        uint64_t hash = table->GetHash(win.key);
-        if (hash % 100 < 5) {
-            win.stage = 1;
-        } else {
-            win.stage = 2;
-        }
-        return win;
-    } else if (win.stage == 1) {
-        win.stage = 2;
-        return win;
-    } else {
-        win.stage = -1;
-        return win;
-    }
+    RemoteHash *table = (RemoteHash *)(config->ptr);
+    uint64_t off, size;
+    RemoteHash_post(table, &win->l, &off, &size);
+    rdma->post(config->id, target_partition, window_buffer(ptr, win->winid),
+               size, off, IBV_WR_RDMA_READ);
 }
 
-void hop_post(void *ptr, post_window win) {
-    struct Thread_config *config = (struct Thread_config *)ptr;
-    uint64_t id = config->id;
-    RdmaHopHash *table = (RdmaHopHash *)(config->ptr);
-    // int msg_size=2*(sizeof(RdmaHopHash::RdmaHopNode)+4*val_length);
-    // char *local_buffer = (char
-    // *)rdma->GetMsgAddr(id)+win.winid*msg_size;//*10;///batch_factor*128 ;
-    char *local_buffer = (char *)rdma->GetMsgAddr(id) +
-                         win.winid * 2048; //*10;///batch_factor*128 ;
-    uint64_t loc = 0;
-    uint64_t hash;
-    if (win.stage == 0) {
-        hash = table->GetHash(win.key);
-        uint64_t read_header =
-            2 * (sizeof(RdmaHopHash::RdmaHopNode) + 4 * val_length);
-        uint64_t loc = read_header / 2 * hash;
-        rdma->post(id, target_partition, (char *)local_buffer, read_header, loc,
-                   IBV_WR_RDMA_READ);
-    } else {
-        uint64_t read_chain =
-            (sizeof(RdmaHopHash::RdmaChainNode) + 2 * val_length);
-        rdma->post(id, target_partition, (char *)local_buffer, read_chain, loc,
-                   IBV_WR_RDMA_READ);
-    }
-}
-post_window hop_poll(void *ptr, post_window win) {
+void window_poll(void *ptr, post_window *win) {
     struct Thread_config *config = (struct Thread_config *)ptr;
-    uint64_t id = config->id;
-    RdmaHopHash *table = (RdmaHopHash *)(config->ptr);
-    // int msg_size=2*(sizeof(RdmaHopHash::RdmaHopNode)+4*val_length);
-    // char *local_buffer = (char
-    // *)rdma->GetMsgAddr(id)+win.winid*msg_size;//*10;///batch_factor*128 ;
-    char *local_buffer = (char *)rdma->GetMsgAddr(id) +
-                         win.winid * 2048; //*10;///batch_factor*128 ;
-    uint64_t loc = 0;
-    rdma->poll(id, target_partition);
-    if (win.stage == 0) {
-        uint64_t hash = table->GetHash(win.key);
-        if (hash % 100 < 5) {
-            win.stage = 1;
-        } else {
-            win.stage = -1;
-        }
-        return win;
-    } else {
-        win.stage = -1;
-        return win;
-    }
+    RemoteHash *table = (RemoteHash *)(config->ptr);
+    rdma->poll(config->id, target_partition);
+    lookup_advance(table, &win->l, window_buffer(ptr, win->winid));
+    if (win->l.stage == RH_MISS)
+        config->misses++;
 }
 
-void clustering_post(void *ptr, post_window win) {
-    struct Thread_config *config = (struct Thread_config *)ptr;
-    uint64_t id = config->id;
-    RdmaClusterHash *table = (RdmaClusterHash *)(config->ptr);
-    char *local_buffer =
-        (char *)rdma->GetMsgAddr(id) + win.winid * 2048; /// batch_factor*128 ;
-    uint64_t loc = 0;
-    uint64_t hash;
-    hash = table->GetHash(win.key);
-    uint64_t read_header = CLUSTER_H * (sizeof(uint64_t) + 8);
-    if (win.stage == 0) {
-        uint64_t loc = read_header * hash;
-        rdma->post(id, target_partition, (char *)local_buffer, read_header, loc,
-                   IBV_WR_RDMA_READ);
-    } else if (win.stage == 1) {
-        rdma->post(id, target_partition, (char *)local_buffer, read_header, 0,
-                   IBV_WR_RDMA_READ);
-    } else {
-        uint64_t start_addr = (win.key % (rdma_size / val_length)) * val_length;
-        rdma->post(id, target_partition, (char *)local_buffer, val_length,
-                   start_addr, IBV_WR_RDMA_READ);
-    }
-}
-post_window clustering_poll(void *ptr, post_window win) {
-    struct Thread_config *config = (struct Thread_config *)ptr;
-    uint64_t id = config->id;
-    RdmaClusterHash *table = (RdmaClusterHash *)(config->ptr);
-    char *local_buffer =
-        (char *)rdma->GetMsgAddr(id) + win.winid * 2048; /// batch_factor*128 ;
-    uint64_t loc = 0;
-    rdma->poll(id, target_partition);
-    if (win.stage == 0) {
-        uint64_t hash = table->GetHash(win.key);
-        if (hash % 100 < 10) {
-            win.stage = 1;
-        } else {
-            win.stage = 2;
-        }
-        return win;
-    } else if (win.stage == 1) {
-        win.stage = 2;
-        return win;
-    } else {
-        win.stage = -1;
-        return win;
-    }
-}
+struct co_worker {
+    Thread_config *config;
+    KeyGen gen;
+    int issued;
+    int num_operations;
+};
 
-post_window clustering_limited_cache_post(void *ptr, post_window win) {
-    struct Thread_config *config = (struct Thread_config *)ptr;
-    uint64_t id = config->id;
-    RdmaClusterHash *table = (RdmaClusterHash *)(config->ptr);
-    char *local_buffer =
-        (char *)rdma->GetMsgAddr(id) + win.winid * 2048; /// batch_factor*128 ;
-    uint64_t loc = 0;
-    if (win.stage == 0) {
-        if (limited_cache_lookup(win.key)) {
-            win.stage = 2;
-            uint64_t start_addr =
-                (win.key % (rdma_size / val_length)) * val_length;
-            rdma->post(id, target_partition, (char *)local_buffer, val_length,
-                       start_addr, IBV_WR_RDMA_READ);
-        } else {
-            uint64_t index = table->GetHash(win.key);
-            uint64_t loc = table->getHeaderNode_loc(index);
-            rdma->post(id, target_partition, (char *)local_buffer,
-                       sizeof(RdmaClusterHash::HeaderNode), loc,
-                       IBV_WR_RDMA_READ);
+// remote_lookup as a coroutine, the thread keeps the reads of all of its
+// lookups in flight
+void lookup_co(RdmaScheduler *sched, int cid, void *arg) {
+    co_worker *w = (co_worker *)arg;
+    RemoteHash *table = (RemoteHash *)(w->config->ptr);
+    char *local_buffer = window_buffer(w->config, cid);
+    // coroutines of a thread never run in parallel, w needs no locking
+    while (w->issued < w->num_operations) {
+        w->issued++;
+        uint64_t key = KeyGen_next(&w->gen);
+        uint64_t start = rdtsc();
+        RemoteLookup l;
+        lookup_start(&l, key);
+        while (l.stage >= 0) {
+            uint64_t off, size;
+            RemoteHash_post(table, &l, &off, &size);
+            sched->Read(target_partition, local_buffer, size, off);
+            lookup_advance(table, &l, local_buffer);
         }
-    } else if (win.stage == 1) {
-        uint64_t loc = win.loc;
-        rdma->post(id, target_partition, (char *)local_buffer,
-                   sizeof(RdmaClusterHash::HeaderNode), loc, IBV_WR_RDMA_READ);
-    } else {
-        uint64_t start_addr = (win.key % (rdma_size / val_length)) * val_length;
-        rdma->post(id, target_partition, (char *)local_buffer, val_length,
-                   start_addr, IBV_WR_RDMA_READ);
+        if (l.stage == RH_MISS)
+            w->config->misses++;
+        LatencyHist_record(w->config->hist, cycles_to_ns(rdtsc() - start));
     }
-    return win;
 }
 
-post_window clustering_limited_cache_poll(void *ptr, post_window win) {
+// Run2 with one coroutine per window slot instead of the stage machines
+void Run3(void *ptr) {
     struct Thread_config *config = (struct Thread_config *)ptr;
-    uint64_t id = config->id;
-    RdmaClusterHash *table = (RdmaClusterHash *)(config->ptr);
-    char *local_buffer =
-        (char *)rdma->GetMsgAddr(id) + win.winid * 2048; /// batch_factor*128 ;
-    uint64_t loc = 0;
-    rdma->poll(id, target_partition);
-    if (win.stage == 0 || win.stage == 1) {
-        // win.stage==0 means cache miss , and first time to read data
-        // win.stage==1 means read the next ptr
-        RdmaClusterHash::HeaderNode *node =
-            (RdmaClusterHash::HeaderNode *)local_buffer;
-        bool found = false;
-        for (int i = 0; i < CLUSTER_H; i++) {
-            if (node->indexes[i] != 0) {
-                loc = table->getDataNode_loc(node->indexes[i]);
-                loc += sizeof(RdmaClusterHash::DataNode);
-                limited_cache_insert(node->keys[i], loc);
-            }
-        }
-        for (int i = 0; i < CLUSTER_H; i++) {
-            if (node->keys[i] == win.key && node->indexes[i] != 0) {
-                loc = table->getDataNode_loc(node->indexes[i]);
-                loc += sizeof(RdmaClusterHash::DataNode);
-                found = true;
-                break;
-            }
-        }
-        if (found) {
-            win.stage = 2;
-        } else {
-            // stage 1 will read the next pointer
-            win.stage = 1;
-            if (node->next != NULL) {
-                win.loc = table->getHeaderNode_loc(node->next);
-            } else {
-                assert(false);
-            }
-        }
-        return win;
-    } else {
-        win.stage = -1;
-        return win;
-    }
+    int id = config->id;
+    pin_to_core(socket_1[id]);
+    co_worker w;
+    w.config = config;
+    thread_keygen(&w.gen, id);
+    w.issued = 0;
+    w.num_operations = 1000000 * 20;
+
+    RdmaScheduler sched(rdma, id);
+    for (int i = 0; i < batch_factor; i++)
+        sched.Spawn(lookup_co, &w);
+    sleep(2);
+    uint64_t start_t = rdtsc();
+    sched.Run();
+    uint64_t cycle_num = rdtsc() - start_t;
+    config->throughput = cycles_per_second * 1.0 * w.num_operations / cycle_num;
 }
 
 void Run2(void *ptr) {
@@ -654,78 +586,37 @@ void Run2(void *ptr) {
     int id = config->id;
     pin_to_core(socket_1[id]);
     int num_operations = 1000000 * 20;
-    ; // 00*16;
-    int seed = id + current_partition * THREAD_NUM;
+    KeyGen gen;
+    thread_keygen(&gen, id);
     post_window window[batch_factor];
     for (int i = 0; i < batch_factor; i++) {
-        window[i].stage = -1;
+        window[i].l.stage = RH_DONE;
         window[i].winid = i;
     }
-    /*
-      if(config->buffer==NULL){
-      char filename[]="/home/datanfs/nfs0/zipf_data/0output";
-      filename[29]+=id;
-      std::ifstream infile(filename);
-      config->buffer=new int[num_operations];
-      for(int i=0;i<num_operations;i++){
-      if(infile>> config->buffer[i])//=dist.get_zipf_random(&seed)%
-      ((int)(val_num*rate)); continue; else { printf("error when loading zipf
-      data\n"); assert(false);
-      }
-      }
-      printf("%d loading zipf data OK\n",id);
-      }
-    */
     sleep(2);
     uint64_t start_t = rdtsc();
 
     int finish_ops = 0;
-    int num_post = 0;
-    int count = 0;
-    int curr_op = 0;
-    uint64_t latency_accum = 0;
     while (true) {
         if (finish_ops + batch_factor >= num_operations)
             break;
         for (int k = 0; k < batch_factor; k++) {
-            if (window[k].stage == -1) {
-                // window[k].key = config->buffer[curr_op];
-                // curr_op++;
-                window[k].key = rand_r(&seed) % ((int)(val_num * rate));
-                window[k].stage = 0;
+            if (window[k].l.stage < 0) {
+                lookup_start(&window[k].l, KeyGen_next(&gen));
                 window[k].start = rdtsc();
             }
-            count++;
-            // this line is special, because when cache hit , it will modify
-            // window
-            window[k] = clustering_limited_cache_post(ptr, window[k]);
-
-            // rdmaread_post(ptr,window[k]);
-            // hop_post(ptr,window[k]);
-            // clustering_post(ptr,window[k]);
-            // hop_indirect_post(ptr,window[k]);
-            // cuckoo_post(ptr,window[k]);
+            window_post(ptr, &window[k]);
         }
         for (int k = 0; k < batch_factor; k++) {
-            window[k] = clustering_limited_cache_poll(ptr, window[k]);
-            // window[k]=rdmaread_poll(ptr,window[k]);
-            // window[k]=hop_poll(ptr,window[k]);
-            // window[k]=clustering_poll(ptr,window[k]);
-            // window[k]=hop_indirect_poll(ptr,window[k]);
-            // window[k]=cuckoo_poll(ptr,window[k]);
-            if (window[k].stage == -1) {
-                latency_accum += (rdtsc() - window[k].start);
+            window_poll(ptr, &window[k]);
+            if (window[k].l.stage < 0) {
+                LatencyHist_record(config->hist,
+                                   cycles_to_ns(rdtsc() - window[k].start));
                 finish_ops++;
             }
         }
     }
     uint64_t cycle_num = rdtsc() - start_t;
-    // printf("count %d\n",count);
-    // printf("average latency %ld ns\n",latency_accum/finish_ops*1000000000
-    // /cycles_per_second  ); printf("average cycle_num %ld
-    // ns\n",cycle_num*1000000000/finish_ops /cycles_per_second  );
-    config->latency =
-        latency_accum / finish_ops * 1000000000 / cycles_per_second;
     config->throughput = 0;
     config->throughput = cycles_per_second * 1.0 * num_operations / cycle_num;
 }
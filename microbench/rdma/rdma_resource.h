@@ -30,6 +30,7 @@
 #pragma GCC diagnostic warning "-fpermissive"
 
 #include <arpa/inet.h>
+#include <assert.h>
 #include <byteswap.h>
 #include <endian.h>
 #include <getopt.h>
@@ -46,6 +47,28 @@
 #include <unistd.h>
 
 #include <vector>
+
+// post() signals one request in RDMA_SIGNAL_BATCH, the others are
+// unsignaled and complete with the next signaled one
+#define RDMA_SIGNAL_BATCH 16
+// requests a QP may have in flight, below max_send_wr of the send queue
+#define RDMA_MAX_OUTSTANDING 64
+// CQEs fetched per ibv_poll_cq
+#define RDMA_POLL_BATCH 16
+// completion slots of a shared QP, above the requests it can have in flight
+#define RDMA_DONE_RING 256
+#define RDMA_MAX_QP_GROUP 64
+// inline payload asked for at QP creation, the NIC may grant less
+#define RDMA_MAX_INLINE 256
+
+// Memory regions registered after construction. A remote offset carries its
+// region in the top bits, region 0 is the buffer given to the constructor.
+#define RDMA_MAX_REGIONS 16
+#define RDMA_REGION_SHIFT 48
+#define RDMA_REGION_MASK ((1UL << RDMA_REGION_SHIFT) - 1)
+#define RDMA_REGION_OFF(r, off) (((uint64_t)(r) << RDMA_REGION_SHIFT) | (off))
+#define RDMA_REGION_OF(off) ((int)((uint64_t)(off) >> RDMA_REGION_SHIFT))
+
 struct config_t {
     const char *dev_name; /* IB device name */
     char *server_name;    /* server host name */
@@ -62,6 +85,12 @@ struct cm_con_data_t {
     uint16_t lid;    /* LID of the IB port */
     uint8_t gid[16]; /* gid */
 } __attribute__((packed));
+/* directory entry of a region, as seen by the machines accessing it */
+struct rdma_region {
+    uint64_t addr;
+    uint64_t size; /* 0 until the region is known */
+    uint32_t rkey;
+} __attribute__((packed));
 /* structure of system resources */
 
 struct dev_resource {
@@ -82,13 +111,37 @@ struct QP {
     struct ibv_mr *mr;                 /* MR handle for buf */
 
     struct dev_resource *dev;
+
+    /* tickets of the send queue, a request's wr_id is its ticket */
+    uint64_t posted;    /* last ticket handed out */
+    uint64_t completed; /* last ticket whose completion was polled */
+    uint64_t signaled;  /* last ticket posted with IBV_SEND_SIGNALED */
+
+    /* a QP shared by a group of threads signals every request, its tickets
+       are taken atomically and each completion is recorded in its own slot */
+    int shared;
+    volatile int inflight;
+    volatile uint64_t *done; /* RDMA_DONE_RING slots, by ticket */
+
+    int soft; /* software transport, no verbs objects behind this QP */
+    int max_inline; /* largest write sent inline, granted by the NIC */
+    struct rdma_region *regions; /* directory of the remote machine */
+};
+
+/* registered buffers of one thread, carved out of its message slot */
+struct BufPool {
+    char *base;
+    uint64_t buf_size;
+    int count;
+    int top;        /* free_list[0, top) are free */
+    int *free_list; /* buffer indices */
 };
 
 struct normal_op_req {
     ibv_wr_opcode opcode;
     char *local_buf;
     int size; // default set to sizeof(uint64_t)
-    int remote_offset;
+    uint64_t remote_offset; // may carry a region, see RDMA_REGION_OFF
 
     // for atomicity operations
     uint64_t compare_and_add;
@@ -105,12 +158,22 @@ class RdmaResource {
     int _total_partition = -1;
     int _total_threads = -1;
     int _current_partition = -1;
+    // threads sharing one QP to each machine, and QP rows in res
+    int qp_group = 1;
+    int qp_rows = 0;
+    // software transport, requests run on the local region in the
+    // caller, so the QP logic can be exercised without a NIC
+    bool soft = false;
 
     struct dev_resource *dev0; // for remote usage
     struct dev_resource *dev1; // for local usage
 
     struct QP **res;
     struct QP *own_res;
+    uint64_t **last_ticket; // [thread][machine], last post of a thread
+    struct BufPool *pools;  // [thread]
+    struct rdma_region **regions;                 // [machine][region]
+    struct ibv_mr *region_mr[RDMA_MAX_REGIONS][2]; // on dev0 and dev1
 
     uint64_t
         size; // The size of the rdma region,should be the same across machines!
@@ -133,11 +196,21 @@ class RdmaResource {
     Network_Node *node;
 
     // for testing
+    // qp_group threads share each QP, both sides must use the same value
     RdmaResource(int t_partition, int t_threads, int current, char *_buffer,
-                 uint64_t _size, uint64_t _slotsize, uint64_t _off = 0);
+                 uint64_t _size, uint64_t _slotsize, uint64_t _off = 0,
+                 int _qp_group = 1, bool _soft = false);
+
+    inline struct QP *GetQP(int t_id, int m_id) {
+        return res[t_id / qp_group] + m_id;
+    }
 
     void Connect();
     void Servicing();
+    // software transport only: requests to machine m_id go to the region
+    // mapped at addr, e.g. the shared memory region of a partition running
+    // as another process of the host
+    void SoftMap(int m_id, char *addr);
 
     // 0 on success,-1 otherwise
     int RdmaRead(int t_id, int m_id, char *local, uint64_t size,
@@ -146,12 +219,86 @@ class RdmaResource {
                   uint64_t remote_offset);
     int RdmaCmpSwap(int t_id, int m_id, char *local, uint64_t compare,
                     uint64_t swap, uint64_t size, uint64_t off);
+    // the old value is in local on return
+    int RdmaFetchAdd(int t_id, int m_id, char *local, uint64_t add,
+                     uint64_t off);
+    // post does not wait and signals selectively, poll waits until every
+    // request posted to the QP has completed
     int post(int t_id, int machine_id, char *local, uint64_t size,
              uint64_t remote_offset, int op);
     int poll(int t_id, int machine_id);
+    inline uint64_t Outstanding(int t_id, int m_id) {
+        struct QP *r = GetQP(t_id, m_id);
+        return r->shared ? r->inflight : r->posted - r->completed;
+    }
+
+    // Asynchronous operations. Post returns a ticket of the QP (t_id, m_id)
+    // and never waits. Completions of one RC send queue arrive in order, so a
+    // ticket is done once a completion of it or a later request is polled.
+    uint64_t PostAsync(int t_id, int m_id, char *local, uint64_t size,
+                       uint64_t remote_offset, int op);
+    uint64_t PostCmpSwapAsync(int t_id, int m_id, char *local,
+                              uint64_t compare, uint64_t swap, uint64_t off);
+    uint64_t PostFetchAddAsync(int t_id, int m_id, char *local, uint64_t add,
+                               uint64_t off);
+    // reap the available completions, returns how many
+    int PollAsync(int t_id, int m_id);
+    inline bool Done(int t_id, int m_id, uint64_t ticket) {
+        struct QP *r = GetQP(t_id, m_id);
+        // a slot is only reused once its older ticket has completed
+        if (r->shared)
+            return r->done[ticket % RDMA_DONE_RING] >= ticket;
+        return r->completed >= ticket;
+    }
+    void Wait(int t_id, int m_id, uint64_t ticket);
+
+    // Post n requests as one chain with a single doorbell, only the last one
+    // is signaled. Writes up to MaxInline bytes are sent inline, so their
+    // local buffer need not be registered and may be reused right away.
+    uint64_t PostOpsAsync(int t_id, int m_id, normal_op_req *reqs, int n);
+    int RdmaOps(int t_id, int m_id, normal_op_req *reqs, int n);
+    // Fill reqs[0, 2) for the chain: a write of size bytes of val to val_off,
+    // then of word to word_off, e.g. a record written back and its lock
+    // cleared. Writes of one QP are placed in order, so the word is never
+    // seen before the value. buf is a pool buffer, the word is sent from its
+    // first 8 bytes and a value above MaxInline is staged after them.
+    // Returns the number of requests.
+    int FillWritePair(int t_id, int m_id, normal_op_req *reqs, char *val,
+                      uint64_t size, uint64_t val_off, uint64_t word,
+                      uint64_t word_off, char *buf);
+    inline int MaxInline(int t_id, int m_id) {
+        return GetQP(t_id, m_id)->max_inline;
+    }
+
+    // Buffer pool of a thread, one buffer per request it may have in flight.
+    // The first reserved bytes of the slot stay with GetMsgAddr, the rest is
+    // split into RDMA_MAX_OUTSTANDING buffers. Called by the owning thread.
+    void InitBufPool(int t_id, uint64_t reserved);
+    inline uint64_t BufSize(int t_id) { return pools[t_id].buf_size; }
+    // NULL when every buffer is in use
+    inline char *AcquireBuf(int t_id) {
+        struct BufPool *p = &pools[t_id];
+        if (p->top == 0)
+            return NULL;
+        return p->base + p->free_list[--p->top] * p->buf_size;
+    }
+    inline void ReleaseBuf(int t_id, char *buf) {
+        struct BufPool *p = &pools[t_id];
+        assert(buf >= p->base && p->top < p->count);
+        p->free_list[p->top++] = (buf - p->base) / p->buf_size;
+    }
+
+    // Register memory at runtime, e.g. for a table created after Connect.
+    // Every machine has to use the same r_id for the same data, remote
+    // requests address it with RDMA_REGION_OFF(r_id, off) once the peer has
+    // installed the entry from GetRegion through SetRegion. Registering an
+    // id again replaces it, which needs every request on it to be finished.
+    int RegisterRegion(int r_id, char *addr, uint64_t size);
+    void GetRegion(int r_id, struct rdma_region *entry);
+    void SetRegion(int m_id, int r_id, const struct rdma_region *entry);
 
     // TODO what if batched?
-    inline char *RdmaResource::GetMsgAddr(int t_id) {
+    inline char *GetMsgAddr(int t_id) {
         return (char *)(buffer + off + t_id * bufferEntrySize);
     }
 
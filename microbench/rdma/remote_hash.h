@@ -0,0 +1,379 @@
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA
+ * for speedy distributed in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+/*
+ *  One interface over the remote hash tables of the micro benchmarks, so a
+ *  run can compare them on the same keys. A remote lookup is a sequence of
+ *  stages: post tells which bytes of the table the current stage reads, poll
+ *  consumes them and moves to the next stage. The driver decides how the
+ *  reads are issued (blocking, windowed post/poll or coroutines).
+ */
+
+#ifndef RDMA_REMOTE_HASH_H
+#define RDMA_REMOTE_HASH_H
+
+#include <algorithm>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pilaf.h"
+#include "rdma_clusterhash.h"
+#include "rdma_hophash.h"
+
+#define REMOTE_HASH_NAMES "read, cuckoo, hop, cluster"
+
+// lookup stages, the tables use 0, 1, ... for their own
+#define RH_VALUE 100 // read the value at loc
+#define RH_DONE -1   // the value has been read
+#define RH_MISS -2   // the key is not in the table
+
+struct RemoteLookup {
+    uint64_t key;
+    uint64_t loc; // offset of the value in the table, once known
+    int stage;
+};
+
+struct RemoteHash {
+    const char *name;
+    void *table;
+    uint64_t base;      // offset of the table in the registered region
+    uint64_t entrysize; // bytes of a value
+    uint64_t max_read;  // largest read of a lookup
+
+    bool (*insert)(void *table, uint64_t key, void *val); // false when full
+    uint64_t *(*get)(void *table, uint64_t key);
+    void *(*del)(void *table, uint64_t key);
+    uint64_t (*footprint)(void *table);
+    void (*stats)(void *table, HashStats *s);
+    // offset and size of the read of the current stage, relative to the table
+    void (*post)(void *table, RemoteLookup *l, uint64_t *off, uint64_t *size);
+    // buf holds what the current stage read
+    void (*poll)(void *table, RemoteLookup *l, const char *buf);
+};
+
+inline void RemoteHash_start(RemoteLookup *l, uint64_t key) {
+    l->key = key;
+    l->loc = 0;
+    l->stage = 0;
+}
+
+inline void RemoteHash_post(RemoteHash *h, RemoteLookup *l, uint64_t *off,
+                            uint64_t *size) {
+    if (l->stage != RH_VALUE)
+        h->post(h->table, l, off, size);
+    // the table may have known the location right away
+    if (l->stage == RH_VALUE) {
+        *off = l->loc;
+        *size = h->entrysize;
+    }
+    *off += h->base;
+}
+
+inline void RemoteHash_poll(RemoteHash *h, RemoteLookup *l, const char *buf) {
+    if (l->stage == RH_VALUE)
+        l->stage = RH_DONE;
+    else
+        h->poll(h->table, l, buf);
+}
+
+// plain array of values indexed by key, the baseline without an index
+
+struct RdmaPlainArray {
+    char *array;
+    uint64_t length;
+    uint64_t entrysize;
+    uint64_t size;
+};
+
+static bool plain_insert(void *t, uint64_t key, void *val) {
+    RdmaPlainArray *it = (RdmaPlainArray *)t;
+    memcpy(it->array + (key % it->length) * it->entrysize, val, it->entrysize);
+    return true;
+}
+static uint64_t *plain_get(void *t, uint64_t key) {
+    RdmaPlainArray *it = (RdmaPlainArray *)t;
+    return (uint64_t *)(it->array + (key % it->length) * it->entrysize);
+}
+static void *plain_del(void *t, uint64_t key) { return NULL; }
+static uint64_t plain_footprint(void *t) { return ((RdmaPlainArray *)t)->size; }
+// every slot holds the value of some key
+static void plain_stats(void *t, HashStats *s) {
+    RdmaPlainArray *it = (RdmaPlainArray *)t;
+    HashStats_init(s);
+    s->capacity = it->length;
+    for (uint64_t i = 0; i < it->length; i++)
+        HashStats_key(s, 1);
+    HashStats_finish(s, it->size, it->entrysize);
+}
+static void plain_post(void *t, RemoteLookup *l, uint64_t *off,
+                       uint64_t *size) {
+    RdmaPlainArray *it = (RdmaPlainArray *)t;
+    l->loc = (l->key % it->length) * it->entrysize;
+    l->stage = RH_VALUE;
+}
+static void plain_poll(void *t, RemoteLookup *l, const char *buf) {}
+
+// 3-1 cuckoo hashing of pilaf.h, stages 0-2 read the buckets of the three
+// hash functions. An entry of the key failing its checksum was read while
+// being written, its bucket is read again.
+
+static bool cuckoo_insert(void *t, uint64_t key, void *val) {
+    return Insert((Rdma_3_1_CuckooHash *)t, key, val);
+}
+static uint64_t *cuckoo_get(void *t, uint64_t key) {
+    return Get((Rdma_3_1_CuckooHash *)t, key);
+}
+static void *cuckoo_del(void *t, uint64_t key) {
+    return Delete((Rdma_3_1_CuckooHash *)t, key);
+}
+static void cuckoo_stats(void *t, HashStats *s) {
+    Stats((Rdma_3_1_CuckooHash *)t, s);
+}
+static uint64_t cuckoo_footprint(void *t) {
+    return ((Rdma_3_1_CuckooHash *)t)->size;
+}
+static void cuckoo_post(void *t, RemoteLookup *l, uint64_t *off,
+                        uint64_t *size) {
+    Rdma_3_1_CuckooHash *it = (Rdma_3_1_CuckooHash *)t;
+    uint64_t hash = l->stage == 0   ? GetHash(it, l->key)
+                    : l->stage == 1 ? GetHash2(it, l->key)
+                                    : GetHash3(it, l->key);
+    *off = hash * it->bucketsize;
+    *size = it->bucketsize;
+}
+static void cuckoo_poll(void *t, RemoteLookup *l, const char *buf) {
+    Rdma_3_1_CuckooHash *it = (Rdma_3_1_CuckooHash *)t;
+    const RdmaArrayNode *node = (const RdmaArrayNode *)buf;
+    for (int i = 0; i < SLOT_PER_BUCKET; i++) {
+        if (node[i].valid && node[i].key == l->key) {
+            if (!entry_ok(&node[i]))
+                return;
+            l->loc = get_dataloc(it, node[i].index);
+            l->stage = RH_VALUE;
+            return;
+        }
+    }
+    l->stage = l->stage == 2 ? RH_MISS : l->stage + 1;
+}
+
+// hopscotch hashing, stage 0 reads the neighborhood of two buckets with their
+// values, stage 1 the second bucket when it wraps around, stage 2 the overflow
+// chain node at loc
+
+static uint64_t hop_bucket_size(RdmaHopHash *it) {
+    return sizeof(RdmaHopNode) + it->entrysize * HOP_H / 2;
+}
+static bool hop_insert(void *t, uint64_t key, void *val) {
+    return Insert((RdmaHopHash *)t, key, val);
+}
+static uint64_t *hop_get(void *t, uint64_t key) {
+    return Get((RdmaHopHash *)t, key);
+}
+static void *hop_del(void *t, uint64_t key) {
+    return Delete((RdmaHopHash *)t, key);
+}
+static void hop_stats(void *t, HashStats *s) {
+    Stats((RdmaHopHash *)t, s);
+}
+static uint64_t hop_footprint(void *t) { return ((RdmaHopHash *)t)->size; }
+static void hop_post(void *t, RemoteLookup *l, uint64_t *off, uint64_t *size) {
+    RdmaHopHash *it = (RdmaHopHash *)t;
+    uint64_t hash = GetHash(it, l->key);
+    if (l->stage == 0) {
+        *off = get_headernod_loc(it, hash);
+        *size = hop_bucket_size(it) * (hash + 1 < it->hash_length ? 2 : 1);
+    } else if (l->stage == 1) {
+        *off = get_headernod_loc(it, 0);
+        *size = hop_bucket_size(it);
+    } else {
+        *off = l->loc;
+        *size = sizeof(RdmaChainNode) + it->entrysize * 2;
+    }
+}
+// the value follows the node, returns whether the key is in it
+static bool hop_find(RdmaHopHash *it, RemoteLookup *l, const uint64_t *keys,
+                     const bool *valid, int n, uint64_t node_loc,
+                     uint64_t node_size) {
+    for (int i = 0; i < n; i++) {
+        if (valid[i] && keys[i] == l->key) {
+            l->loc = node_loc + node_size + it->entrysize * i;
+            l->stage = RH_DONE;
+            return true;
+        }
+    }
+    return false;
+}
+static void hop_poll(void *t, RemoteLookup *l, const char *buf) {
+    RdmaHopHash *it = (RdmaHopHash *)t;
+    uint64_t hash = GetHash(it, l->key);
+    if (l->stage == 0 || l->stage == 1) {
+        uint64_t first = l->stage == 0 ? hash : 0;
+        int buckets = (l->stage == 0 && hash + 1 < it->hash_length) ? 2 : 1;
+        for (int b = 0; b < buckets; b++) {
+            const RdmaHopNode *node =
+                (const RdmaHopNode *)(buf + b * hop_bucket_size(it));
+            if (hop_find(it, l, node->keys, node->valid, HOP_H / 2,
+                         get_headernod_loc(it, first + b),
+                         sizeof(RdmaHopNode)))
+                return;
+        }
+        // keep the chain of the home bucket while reading the wrapped one
+        uint64_t next = l->stage == 0 ? ((const RdmaHopNode *)buf)->next : l->loc;
+        if (l->stage == 0 && buckets == 1) {
+            l->loc = next;
+            l->stage = 1;
+            return;
+        }
+        if (next == 0) {
+            l->stage = RH_MISS;
+            return;
+        }
+        l->loc = get_chainnod_loc(it, next);
+        l->stage = 2;
+        return;
+    }
+    const RdmaChainNode *node = (const RdmaChainNode *)buf;
+    if (hop_find(it, l, node->keys, node->valid, 2, l->loc,
+                 sizeof(RdmaChainNode)))
+        return;
+    if (node->next == 0) {
+        l->stage = RH_MISS;
+        return;
+    }
+    l->loc = get_chainnod_loc(it, node->next);
+}
+
+// clustered hashing, stage 0 reads the home header node, stage 1 the overflow
+// header node at loc
+
+static bool cluster_insert(void *t, uint64_t key, void *val) {
+    return Insert((RdmaClusterHash *)t, key, val);
+}
+static uint64_t *cluster_get(void *t, uint64_t key) {
+    return Get((RdmaClusterHash *)t, key);
+}
+static void *cluster_del(void *t, uint64_t key) {
+    return Delete((RdmaClusterHash *)t, key);
+}
+static void cluster_stats(void *t, HashStats *s) {
+    Stats((RdmaClusterHash *)t, s);
+}
+static uint64_t cluster_footprint(void *t) {
+    return ((RdmaClusterHash *)t)->size;
+}
+static void cluster_post(void *t, RemoteLookup *l, uint64_t *off,
+                         uint64_t *size) {
+    RdmaClusterHash *it = (RdmaClusterHash *)t;
+    *off = l->stage == 0 ? getHeaderNode_loc(it, GetHash(it, l->key)) : l->loc;
+    *size = sizeof(HeaderNode);
+}
+static void cluster_poll(void *t, RemoteLookup *l, const char *buf) {
+    RdmaClusterHash *it = (RdmaClusterHash *)t;
+    const HeaderNode *node = (const HeaderNode *)buf;
+    for (int i = 0; i < CLUSTER_H; i++) {
+        if (node->indexes[i] != 0 && node->keys[i] == l->key) {
+            l->loc = getDataNode_loc(it, node->indexes[i]) + sizeof(DataNode);
+            l->stage = RH_VALUE;
+            return;
+        }
+    }
+    if (node->next == 0) {
+        l->stage = RH_MISS;
+        return;
+    }
+    l->loc = getHeaderNode_loc(it, node->next);
+    l->stage = 1;
+}
+
+// The table named name, with len entries of esize bytes in arr, which is at
+// offset base of the registered region. NULL for an unknown name.
+inline RemoteHash *RemoteHash_new(const char *name, uint64_t esize,
+                                  uint64_t len, char *arr, uint64_t base) {
+    RemoteHash *h = (RemoteHash *)malloc(sizeof(RemoteHash));
+    h->base = base;
+    h->entrysize = (((esize - 1) >> 3) + 1) << 3;
+    if (strcmp(name, "read") == 0) {
+        RdmaPlainArray *it = (RdmaPlainArray *)malloc(sizeof(RdmaPlainArray));
+        it->array = arr;
+        it->length = len;
+        it->entrysize = h->entrysize;
+        it->size = len * h->entrysize;
+        h->name = "read";
+        h->table = it;
+        h->max_read = h->entrysize;
+        h->insert = plain_insert;
+        h->get = plain_get;
+        h->del = plain_del;
+        h->footprint = plain_footprint;
+        h->stats = plain_stats;
+        h->post = plain_post;
+        h->poll = plain_poll;
+    } else if (strcmp(name, "cuckoo") == 0) {
+        Rdma_3_1_CuckooHash *it = Rdma_3_1_CuckooHash_new(esize, len, arr);
+        h->name = "cuckoo";
+        h->table = it;
+        h->max_read = std::max(it->bucketsize, h->entrysize);
+        h->insert = cuckoo_insert;
+        h->get = cuckoo_get;
+        h->del = cuckoo_del;
+        h->footprint = cuckoo_footprint;
+        h->stats = cuckoo_stats;
+        h->post = cuckoo_post;
+        h->poll = cuckoo_poll;
+    } else if (strcmp(name, "hop") == 0) {
+        RdmaHopHash *it = RdmaHopHash_new(esize, len, arr);
+        h->name = "hop";
+        h->table = it;
+        h->max_read = 2 * hop_bucket_size(it);
+        h->insert = hop_insert;
+        h->get = hop_get;
+        h->del = hop_del;
+        h->footprint = hop_footprint;
+        h->stats = hop_stats;
+        h->post = hop_post;
+        h->poll = hop_poll;
+    } else if (strcmp(name, "cluster") == 0) {
+        RdmaClusterHash *it = RdmaClusterHash_new(esize, len, arr);
+        h->name = "cluster";
+        h->table = it;
+        h->max_read = std::max((uint64_t)sizeof(HeaderNode), h->entrysize);
+        h->insert = cluster_insert;
+        h->get = cluster_get;
+        h->del = cluster_del;
+        h->footprint = cluster_footprint;
+        h->stats = cluster_stats;
+        h->post = cluster_post;
+        h->poll = cluster_poll;
+    } else {
+        free(h);
+        return NULL;
+    }
+    // the tables tell free slots by zeroed headers
+    memset(arr, 0, h->footprint(h->table));
+    return h;
+}
+
+#endif
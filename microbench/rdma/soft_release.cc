@@ -0,0 +1,130 @@
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA
+ * for speedy distributed in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+// Check of the one-sided release of DBSSTX on the software transport. A
+// partition registers a table region at runtime, the other one locks records
+// of it and releases them the way DBSSTX::Release does: the write pair of
+// FillWritePair on commit, a CAS on abort. Records sit below 2 GB, past 2 GB
+// and past 4 GB of the region, so an offset cut to 32 bits or losing its
+// region id writes somewhere else. Exits non-zero on the first mismatch.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "network_node.h"
+#include "rdma_resource.h"
+
+#define LOCKED (1UL << 63)
+#define TABLE_REGION 3
+#define MSG_SLOT (1 << 20) // message area of the thread, holds its pool
+
+size_t current_partition = 0;
+size_t total_partition = 2;
+
+// lock word followed by the value, as in a DBSSTX record
+struct Record {
+    uint64_t lock;
+    char value[];
+};
+
+int failures = 0;
+
+void check(bool ok, const char *what, uint64_t off, uint64_t vlen) {
+    if (ok)
+        return;
+    fprintf(stderr, "FAIL %s off %lu vlen %lu\n", what, off, vlen);
+    failures++;
+}
+
+// lock the record at off of the table, then release it as DBSSTX does
+void release(RdmaResource *rdma, char *table, uint64_t off, uint64_t vlen,
+             bool commit) {
+    Record *rec = (Record *)(table + off);
+    memset(rec->value, 'a', vlen);
+    rec->lock = LOCKED;
+
+    char *buf = rdma->AcquireBuf(0);
+    assert(buf != NULL);
+    uint64_t loc = RDMA_REGION_OFF(TABLE_REGION, off);
+    if (commit) {
+        char value[1024];
+        memset(value, 'b', vlen);
+        normal_op_req reqs[2];
+        int n = rdma->FillWritePair(0, 1, reqs, value, vlen, loc + 8, 0, loc,
+                                    buf);
+        rdma->RdmaOps(0, 1, reqs, n);
+    } else {
+        rdma->RdmaCmpSwap(0, 1, buf, LOCKED, 0, sizeof(uint64_t), loc);
+        check(*(uint64_t *)buf == LOCKED, "cas result", off, vlen);
+    }
+    rdma->ReleaseBuf(0, buf);
+
+    check(rec->lock == 0, "lock cleared", off, vlen);
+    char expect = commit ? 'b' : 'a';
+    for (uint64_t i = 0; i < vlen; i++) {
+        if (rec->value[i] != expect) {
+            check(false, "value", off, vlen);
+            break;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    // region 0 is the message area, the table is a region of its own
+    uint64_t rdma_size = 2 * MSG_SLOT;
+    char *buffer = (char *)calloc(1, rdma_size);
+    RdmaResource *rdma = new RdmaResource(total_partition, 1, current_partition,
+                                          buffer, rdma_size, MSG_SLOT, 0, 1,
+                                          true);
+    rdma->InitBufPool(0, 0);
+
+    // untouched pages cost nothing
+    uint64_t table_size = (5UL << 30) + 4096;
+    char *table = (char *)mmap(NULL, table_size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+                               0);
+    assert(table != MAP_FAILED);
+
+    // the owner registers the table, the peer learns it as DBSSTX does
+    // with REGION_REQ
+    rdma->RegisterRegion(TABLE_REGION, table, table_size);
+    struct rdma_region entry;
+    rdma->GetRegion(TABLE_REGION, &entry);
+    rdma->SetRegion(1, TABLE_REGION, &entry);
+    rdma->SoftMap(1, buffer);
+
+    uint64_t offs[] = {4096, (2UL << 30) + 4096, (4UL << 30) + 8192};
+    uint64_t vlens[] = {64, 1000}; // inline and staged in the pool buffer
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 2; j++) {
+            release(rdma, table, offs[i], vlens[j], true);
+            release(rdma, table, offs[i], vlens[j], false);
+        }
+    }
+    printf("%s\n", failures == 0 ? "ok" : "failed");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,229 @@
+/*
+ *  The code is part of our project called DrTM, which leverages HTM and RDMA
+ * for speedy distributed in-memory transactions.
+ *
+ *
+ * Copyright (C) 2015 Institute of Parallel and Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University All rights reserved.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  For more about this software, visit:  http://ipads.se.sjtu.edu.cn/drtm.html
+ *
+ */
+
+// Throughput of K interleaved transactions per worker thread over the
+// loopback QPs of one partition. A transaction reads some records, locks
+// and writes back others with the same one-sided operations DBSSTX uses
+// (CAS on the lock word, read/write of the value), so the gain comes only
+// from overlapping the round trips of the K transactions.
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "keygen.h"
+#include "latency_hist.h"
+#include "network_node.h"
+#include "rdma_coroutine.h"
+#include "rdma_resource.h"
+
+#define MAXTHREADS 16
+#define RECORD_SIZE 64 // lock word followed by the value
+#define LOCKED (1UL << 63)
+#define SLICE_SIZE 4096 // registered buffer of one transaction slot
+#define COUNTER_OFF (records * RECORD_SIZE) // commit counter, past the keys
+
+size_t current_partition = 0;
+size_t total_partition = 1;
+
+RdmaResource *rdma = NULL;
+int thrnum = 1;
+int kmax = 16;
+int reads = 4;
+int writes = 2;
+uint64_t records = 1000 * 1000;
+int txns = 200000; // per thread and K
+int qp_group = 1;  // threads sharing a QP
+bool soft = false; // software transport, no NIC needed
+KeyGen keygen;     // parsed -dist, every worker copies it
+uint64_t cycles_per_second;
+
+inline uint64_t rdtsc(void) {
+    uint32_t hi, lo;
+    __asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)lo) | (((uint64_t)hi) << 32);
+}
+
+struct Worker {
+    int id;
+    int k;
+    KeyGen gen;
+    int issued;
+    int commits;
+    int aborts;
+    uint64_t cycles;
+    LatencyHist *hist; // from the first attempt to the commit, ns
+};
+
+void txn_co(RdmaScheduler *sched, int cid, void *arg) {
+    Worker *w = (Worker *)arg;
+    char *buf = rdma->GetMsgAddr(w->id) + cid * SLICE_SIZE;
+    uint64_t wkeys[64];
+
+    while (w->issued < txns) {
+        w->issued++;
+        uint64_t start = rdtsc();
+        while (true) {
+            for (int i = 0; i < reads; i++) {
+                uint64_t key = KeyGen_next(&w->gen);
+                sched->Read(0, buf, RECORD_SIZE, key * RECORD_SIZE);
+            }
+            int locked = 0;
+            for (; locked < writes; locked++) {
+                wkeys[locked] = KeyGen_next(&w->gen);
+                uint64_t off = wkeys[locked] * RECORD_SIZE;
+                if (sched->CmpSwap(0, buf, 0, LOCKED, off) != 0)
+                    break;
+                sched->Read(0, buf + 8, RECORD_SIZE - 8, off + 8);
+            }
+            // write back and release what we hold, either way
+            for (int i = 0; i < locked; i++) {
+                uint64_t off = wkeys[i] * RECORD_SIZE;
+                if (locked == writes)
+                    sched->Write(0, buf + 8, RECORD_SIZE - 8, off + 8);
+                sched->CmpSwap(0, buf, LOCKED, 0, off);
+            }
+            if (locked == writes)
+                break;
+            w->aborts++;
+        }
+        // a commit number, the way DBSSTX::RdmaFetchAdd bumps a counter
+        sched->FetchAdd(0, buf, 1, COUNTER_OFF);
+        w->commits++;
+        LatencyHist_record(w->hist,
+                           (rdtsc() - start) * 1e9 / cycles_per_second);
+    }
+}
+
+void *Run(void *arg) {
+    Worker *w = (Worker *)arg;
+    RdmaScheduler sched(rdma, w->id);
+    for (int i = 0; i < w->k; i++)
+        sched.Spawn(txn_co, w);
+    uint64_t start = rdtsc();
+    sched.Run();
+    w->cycles = rdtsc() - start;
+    return NULL;
+}
+
+void usage() {
+    fprintf(stderr, "usage: txn_interleave [-thr=N] [-k=MAX] [-reads=N] "
+                    "[-writes=N] [-txns=N] [-group=N] [-soft] [-dist=SPEC]\n"
+                    "  -dist key distribution (default uniform), one of\n"
+                    "        %s\n",
+            KEYGEN_NAMES);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *dist = "uniform";
+    for (int i = 1; i < argc; i++) {
+        int n;
+        char junk;
+        if (sscanf(argv[i], "-thr=%d%c", &n, &junk) == 1) {
+            thrnum = n;
+        } else if (sscanf(argv[i], "-k=%d%c", &n, &junk) == 1) {
+            kmax = n;
+        } else if (sscanf(argv[i], "-reads=%d%c", &n, &junk) == 1) {
+            reads = n;
+        } else if (sscanf(argv[i], "-writes=%d%c", &n, &junk) == 1) {
+            writes = n;
+        } else if (sscanf(argv[i], "-txns=%d%c", &n, &junk) == 1) {
+            txns = n;
+        } else if (sscanf(argv[i], "-group=%d%c", &n, &junk) == 1) {
+            qp_group = n;
+        } else if (strcmp(argv[i], "-soft") == 0) {
+            soft = true;
+        } else if (strncmp(argv[i], "-dist=", 6) == 0) {
+            dist = argv[i] + 6;
+        } else {
+            usage();
+        }
+    }
+    if (!KeyGen_parse(&keygen, dist))
+        usage();
+    assert(thrnum <= MAXTHREADS && kmax <= CO_MAX && writes <= 64);
+
+    if (!soft)
+        ibv_fork_init();
+    uint64_t start_t = rdtsc();
+    sleep(1);
+    cycles_per_second = rdtsc() - start_t;
+
+    // the commit counter sits in one more record past the keys
+    uint64_t rdma_size = (records + 1) * RECORD_SIZE;
+    uint64_t slot = (uint64_t)CO_MAX * SLICE_SIZE;
+    uint64_t total_size = rdma_size + thrnum * slot;
+    char *buffer = (char *)malloc(total_size);
+    memset(buffer, 0, total_size);
+
+    // a single partition only connects its loopback QPs
+    rdma = new RdmaResource(total_partition, thrnum, current_partition, buffer,
+                            total_size, slot, rdma_size, qp_group, soft);
+    rdma->node = Network_Node_new(current_partition, thrnum, NULL);
+    rdma->Connect();
+
+    Worker workers[MAXTHREADS];
+    pthread_t tid[MAXTHREADS];
+    LatencyHist *hists = new LatencyHist[thrnum];
+    LatencyHist hist;
+    printf("dist %s\n", dist);
+    printf("k\tthroughput\tabort\tlatency (us)\n");
+    volatile uint64_t *counter = (uint64_t *)(buffer + COUNTER_OFF);
+    for (int k = 1; k <= kmax; k *= 2) {
+        uint64_t counted = *counter;
+        for (int i = 0; i < thrnum; i++) {
+            memset(&workers[i], 0, sizeof(Worker));
+            workers[i].id = i;
+            workers[i].k = k;
+            workers[i].gen = keygen;
+            workers[i].hist = &hists[i];
+            LatencyHist_init(&hists[i]);
+            KeyGen_init(&workers[i].gen, records, i * 7919 + k);
+            pthread_create(&tid[i], NULL, Run, &workers[i]);
+        }
+        double throughput = 0;
+        uint64_t commits = 0, aborts = 0;
+        LatencyHist_init(&hist);
+        for (int i = 0; i < thrnum; i++) {
+            pthread_join(tid[i], NULL);
+            throughput += workers[i].commits * 1.0 * cycles_per_second /
+                          workers[i].cycles;
+            commits += workers[i].commits;
+            aborts += workers[i].aborts;
+            LatencyHist_merge(&hist, &hists[i]);
+        }
+        printf("%d\t%.0f\t%.4f\t", k, throughput,
+               aborts * 1.0 / (commits + aborts));
+        LatencyHist_print(&hist, "txn", stdout);
+        if (*counter - counted != commits) {
+            fprintf(stderr, "counter moved %lu for %lu commits\n",
+                    *counter - counted, commits);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -26,11 +26,74 @@
 #define RTMRegion_H_
 
 #include <immintrin.h>
+#include <cpuid.h>
+#include <stdio.h>
 #include <sys/time.h>
 
 #define likely(x)   __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
+// abort code used when a transaction finds the fallback lock held
+#define RTM_LOCK_HELD 0xff
+// abort code of RTMRegion::Abort, handed back to the caller, never retried
+#define RTM_USER_ABORT 0x1
+
+/*
+ * Runtime dispatch between hardware RTM and a lock-elision fallback.
+ * Most hosts have TSX disabled by microcode, in which case _xbegin() never
+ * succeeds (or faults). CPUID.(EAX=7,ECX=0) reports RTM in EBX[11], and
+ * microcode that forces every transaction to abort sets RTM_ALWAYS_ABORT in
+ * EDX[11] while leaving EBX[11] on, so both are checked once. Without RTM,
+ * regions are serialized on a single global spinlock.
+ * Hardware transactions read the same lock word, so a lock holder aborts them.
+ */
+inline bool rtm_supported() {
+  static int cached = -1;
+  if(unlikely(cached < 0)) {
+    unsigned int eax, ebx, ecx, edx;
+    cached = 0;
+    if(__get_cpuid_max(0, NULL) >= 7) {
+      __cpuid_count(7, 0, eax, ebx, ecx, edx);
+      cached = ((ebx >> 11) & 0x1) && !((edx >> 11) & 0x1);
+    }
+  }
+  return cached;
+}
+
+// Set to true to measure the lock-based path on RTM capable hosts
+inline bool &rtm_force_fallback() {
+  static bool force = false;
+  return force;
+}
+
+inline bool rtm_enabled() {
+  return rtm_supported() && !rtm_force_fallback();
+}
+
+struct RTMFallbackLock {
+  char padding0[64];
+  volatile int lock;
+  char padding1[64];
+};
+
+inline RTMFallbackLock *rtm_fallback_lock() {
+  static RTMFallbackLock l;
+  return &l;
+}
+
+inline void rtm_fallback_acquire() {
+  volatile int *l = &rtm_fallback_lock()->lock;
+  while(true) {
+    if(*l == 0 && __sync_bool_compare_and_swap(l, 0, 1))
+      return;
+    while(*l != 0)
+      _mm_pause();
+  }
+}
+
+inline void rtm_fallback_release() {
+  __sync_lock_release(&rtm_fallback_lock()->lock);
+}
 
 
 struct RTMRegionProfile {
@@ -40,15 +103,17 @@ struct RTMRegionProfile {
   int capacity;
   int zero;
   int nest;
+  int fallback;
 
 RTMRegionProfile():
-  abort(0), succ(0), conflict(0), capacity(0), zero(0), nest(0){}
+  abort(0), succ(0), conflict(0), capacity(0), zero(0), nest(0), fallback(0){}
 
   void ReportProfile()
   {
-    printf("Avg Abort %.5f [Conflict %.5f : Capacity %.5f Zero: %.5f Nest: %.5f] \n",
+    printf("Avg Abort %.5f [Conflict %.5f : Capacity %.5f Zero: %.5f Nest: %.5f] Fallback %.5f (%s)\n",
 	   abort/(double)(abort+succ), conflict/(double)succ, capacity/(double)succ,
-	   zero/(double)succ, nest/(double)succ);
+	   zero/(double)succ, nest/(double)succ, fallback/(double)succ,
+	   rtm_enabled() ? "rtm" : "lock");
   }
 
   void Reset(){
@@ -58,12 +123,28 @@ RTMRegionProfile():
     capacity = 0;
     zero = 0;
     nest = 0;
+    fallback = 0;
   }
 };
 
 
-#define MAXRETRY 10000000
+// Aborts a region may take before it runs under the fallback lock. Only
+// aborts the hardware reports as worth retrying count, others fall back at once.
+#define MAXRETRY 64
 
+/*
+ * A region whose body calls Abort() is not run again. Under RTM the abort
+ * rolls the body back and the constructor returns with Aborted() set, so the
+ * code after the constructor runs a second time and has to check it first:
+ *
+ *   RTMRegion rtm(&prof);
+ *   if(!rtm.Aborted()) {
+ *     ... checks, rtm.Abort() on a failed one, then the writes ...
+ *   }
+ *
+ * On the lock-based path Abort() only sets Aborted(), the body goes on and
+ * must not have written anything yet.
+ */
 class RTMRegion {
 
  public:
@@ -74,24 +155,33 @@ class RTMRegion {
   int capacity;
   int zero;
   int nest;
+  bool fallback;
+  bool aborted;
 
   inline RTMRegion(RTMRegionProfile *p) {
 
+    fallback = false;
+    aborted = false;
 #ifdef PROF
     abort = 0;
     conflict = 0;
     capacity = 0;
     zero = 0;
+    nest = 0;
     prof = p;
 #endif
+    int retry = 0;
 
-    while(true) {
-      register unsigned stat;
+    while(likely(rtm_enabled())) {
+      unsigned stat;
       stat = _xbegin();
 
       //Likely is just make assembling code more readable
       if(likely(stat == _XBEGIN_STARTED)) {
-	return;
+	//Put the fallback lock in our read set, a lock holder will abort us
+	if(likely(rtm_fallback_lock()->lock == 0))
+	  return;
+	_xabort(RTM_LOCK_HELD);
 
       } else {
 
@@ -110,22 +200,47 @@ class RTMRegion {
 
 	if(stat == 0)
 	  zero++;
-
-	if(abort > MAXRETRY)
-	  return;
 #endif
+	if((stat & _XABORT_EXPLICIT) && _XABORT_CODE(stat) == RTM_USER_ABORT) {
+	  aborted = true;
+	  return;
+	}
+
+	if(++retry > MAXRETRY)
+	  break;
+
+	if((stat & _XABORT_EXPLICIT) && _XABORT_CODE(stat) == RTM_LOCK_HELD) {
+	  while(rtm_fallback_lock()->lock != 0)
+	    _mm_pause();
+	} else if((stat & _XABORT_CAPACITY) || !(stat & _XABORT_RETRY)) {
+	  //retrying would abort again
+	  break;
+	}
       }
     }
 
+    //No RTM or too many aborts, run the region under the global lock
+    rtm_fallback_acquire();
+    fallback = true;
   }
 
   void Abort() {
 
-    _xabort(0x1);
+    //The lock-based path cannot roll back, the caller has to undo by itself
+    if(!fallback)
+      _xabort(RTM_USER_ABORT);
+    aborted = true;
 
   }
+
+  inline bool Aborted() const {
+    return aborted;
+  }
+
   inline  ~RTMRegion() {
-    if(_xtest())
+    if(unlikely(fallback))
+      rtm_fallback_release();
+    else if(_xtest())
       _xend ();
     else
       return;
@@ -136,6 +251,7 @@ class RTMRegion {
       prof->conflict += conflict;
       prof->zero += zero;
       prof->nest += nest;
+      prof->fallback += fallback;
       prof->succ++;
     }
 #endif
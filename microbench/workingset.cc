@@ -24,6 +24,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <string.h>
 #include <malloc.h>
@@ -35,8 +36,6 @@
 
 #define PROF
 #include "rtmRegion.h"
-#include "../util/random.h"
-typedef unsigned long uint64_t;
 
 #define PAGESIZE 4*1024 //4KB
 
@@ -44,6 +43,15 @@ typedef unsigned long uint64_t;
 #define ARRAYSIZE 8*1024*1024
 #define CASHELINESIZE 64 //64 bytes
 
+#define MAXTHREADS 64
+
+// benchmark modes
+#define SEQ_READ   1
+#define SEQ_WRITE  2
+#define MIX        3
+#define RAND_WRITE 4
+#define RAND_READ  5
+
 struct Cacheline {
   char data[CASHELINESIZE];
 };
@@ -55,15 +63,35 @@ int readset = 16*1024;
 int writeset = 16*1024;
 char padding[64];
 int workingset = 16 * 1024; //Default ws: 16KB
-__thread char *array;
+__thread char *array;
 char padding1[64];
 
 volatile int ready = 0;
-volatile int epoch = 0;
+volatile int epoch = 0; // 1: warmup 2: measure 3: stop
 int thrnum = 1;
-int bench = 1; // 1: read 2: write 3: mix
+int bench = SEQ_READ;
 int length = ARRAYSIZE/4;
 
+// sweep and run configuration
+int ws_min = 16;  //KB
+int ws_max = 16;  //KB
+int ws_step = 0;  //KB, 0 means doubling
+int duration = 1; //seconds per point
+int warmup = 200; //ms
+bool csv = false;
+bool sibling = false;
+int cpus[MAXTHREADS];
+int ncpus = 0;
+
+struct ThreadResult {
+  uint64_t ops;
+  int time_ms;
+  int count;
+  RTMRegionProfile prof;
+  char padding[64];
+};
+ThreadResult results[MAXTHREADS];
+
 inline int Read(char * data) {
   register int res = 0;
   register int ws  = workingset / sizeof(int);
@@ -85,8 +113,7 @@ inline int RandomRead(char * data) {
 }
 
 
-inline int RandomWrite2(char * data) {
-  register int res = 0;
+inline void RandomWrite2(char * data) {
   for(register int i = 0;i < workingset / sizeof(int);++i){
     register int index = (i*i) % (ARRAYSIZE / sizeof(int));
     ((int *)data)[index]++;
@@ -160,14 +187,55 @@ diff_timespec(const struct timespec &end, const struct timespec &start)
   return diff;
 }
 
+const char *bench_name(int b) {
+  switch(b) {
+  case SEQ_READ:   return "read";
+  case SEQ_WRITE:  return "write";
+  case MIX:        return "mix";
+  case RAND_WRITE: return "rwrite";
+  case RAND_READ:  return "rread";
+  }
+  return "unknown";
+}
+
+// Hyper-thread sibling of a cpu, from sysfs. Returns -1 if there is none.
+int sibling_of(int cpu) {
+  char path[128];
+  snprintf(path, sizeof(path),
+	   "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+  FILE *f = fopen(path, "r");
+  if(f == NULL)
+    return -1;
+  int a = -1, b = -1;
+  char sep;
+  int n = fscanf(f, "%d%c%d", &a, &sep, &b);
+  fclose(f);
+  if(n < 3)
+    return -1;
+  return (a == cpu) ? b : a;
+}
+
+// Place threads on the explicit cpu list, or on cores 0,1,2... by default.
+// With sibling placement, thread 2k+1 shares the physical core of thread 2k.
+int cpu_of(int tid) {
+  int base = sibling ? tid / 2 : tid;
+  int cpu = (ncpus > 0) ? cpus[base % ncpus] : base;
+  if(sibling && (tid & 1)) {
+    int s = sibling_of(cpu);
+    if(s >= 0)
+      return s;
+  }
+  return cpu;
+}
+
 void thread_init(){
   //Allocate the array at heap
   array = (char *)malloc(ARRAYSIZE);
   int *data = (int*)array;
-  leveldb::Random r(0xdead);
+  unsigned int seed = 0xdead;
 
   for (int i =0; i < length; i++) {
-    data[i] = r.Next() % length ;
+    data[i] = rand_r(&seed) % length ;
     //data[i] -= data[i] % 64;
     //printf("%d\n",data[i]);
   }
@@ -178,137 +246,228 @@ void thread_init(){
 
 void* thread_body(void *x) {
 
-  RTMRegionProfile prof;
+  uint64_t tid = (uint64_t)x;
+  ThreadResult *res = &results[tid];
+  RTMRegionProfile &prof = res->prof;
   int count = 0;
-  int lbench = 4;
-  int lepoch = 0;
+  uint64_t ops = 0;
+  int lbench = bench;
 
   struct timespec start, end;
-
-  uint64_t tid = (uint64_t)x;
-  int cpu = 1;
-  if(tid == 1)
-    cpu = 5;
+  start.tv_sec = 0;
 
   cpu_set_t  mask;
   CPU_ZERO(&mask);
-  CPU_SET(tid, &mask);
+  CPU_SET(cpu_of(tid), &mask);
   sched_setaffinity(0, sizeof(mask), &mask);
 
   thread_init();
-  printf("init\n");
   __sync_fetch_and_add(&ready, 1);
 
   while(epoch == 0);
 
-  clock_gettime(CLOCK_REALTIME, &start);
-
-
-  lepoch = epoch;
-
-  while(true) {
+  while(epoch < 3) {
 
     {
       RTMRegion rtm(&prof);
-      if(lbench == 1)
+      if(lbench == RAND_READ)
 	count += RandomRead((char *)array);
-      //count += Read((char *)array);
-      else if(lbench == 2) {
+      else if(lbench == SEQ_READ)
+	count += Read((char *)array);
+      else if(lbench == SEQ_WRITE) {
 	Write((int *)array);
       }
-      else if(lbench == 3)
+      else if(lbench == MIX)
 	count += ReadWrite((char *)array);
-      else if(lbench == 4)
+      else if(lbench == RAND_WRITE)
 	RandomWrite2((char *)array);
 
 
     }
+    ops++;
 
-    if(lepoch < epoch) {
-
+    if(unlikely(epoch == 2 && start.tv_sec == 0)) {
+      //warmup is over, start counting
+      prof.Reset();
+      ops = 0;
+      clock_gettime(CLOCK_REALTIME, &start);
+    }
+  }
 
+  clock_gettime(CLOCK_REALTIME, &end);
+  res->time_ms = (start.tv_sec == 0) ? 0 : diff_timespec(end, start);
+  res->ops = ops;
+  res->count = count;
+  free(array);
+  return NULL;
+}
 
-      clock_gettime(CLOCK_REALTIME, &end);
-      printf("Thread [%d] Time: %.2f s \n",
-	     tid, diff_timespec(end, start)/1000.0);
+void run_point() {
 
-      prof.ReportProfile();
-      prof.Reset();
-      printf("count %d\n", count);
+  ready = 0;
+  epoch = 0;
+  for(int i = 0; i < thrnum; i++)
+    results[i] = ThreadResult();
 
-      clock_gettime(CLOCK_REALTIME, &start);
+  pthread_t *th = new pthread_t[thrnum];
+  for(int i = 0; i < thrnum; i++)
+    pthread_create(&th[i], NULL, thread_body, (void *)(uint64_t)i);
 
+  //Barriar to wait all threads become ready
+  while (ready < thrnum);
 
-      lepoch = epoch;
-    }
+  //Begin at the first epoch
+  epoch = 1;
+  usleep(warmup * 1000); //for warmup
+  epoch = 2;
+  sleep(duration);
+  epoch = 3;
 
+  for(int i = 0; i < thrnum; i++)
+    pthread_join(th[i], NULL);
+  delete[] th;
+
+  //aggregate and report
+  RTMRegionProfile total;
+  double throughput = 0;
+  for(int i = 0; i < thrnum; i++) {
+    RTMRegionProfile &p = results[i].prof;
+    total.abort += p.abort;
+    total.succ += p.succ;
+    total.conflict += p.conflict;
+    total.capacity += p.capacity;
+    total.zero += p.zero;
+    total.nest += p.nest;
+    total.fallback += p.fallback;
+    if(results[i].time_ms > 0)
+      throughput += results[i].ops * 1000.0 / results[i].time_ms;
   }
 
-  prof.ReportProfile();
-
+  double attempts = (double)(total.abort + total.succ);
+  if(attempts == 0)
+    attempts = 1;
+  int ws_kb = (bench == MIX) ? (readset + writeset) / 1024 : workingset / 1024;
+  if(csv) {
+    printf("%s,%s,%d,%d,%d,%d,%.2f,%.5f,%.5f,%.5f,%.5f,%.5f,%.5f\n",
+	   bench_name(bench), rtm_enabled() ? "rtm" : "lock", ws_kb,
+	   readset / 1024, writeset / 1024, thrnum, throughput,
+	   total.abort / attempts, total.conflict / attempts,
+	   total.capacity / attempts, total.zero / attempts,
+	   total.nest / attempts, total.fallback / (double)(total.succ ? total.succ : 1));
+  } else {
+    printf("%s ws %d KB threads %d : %.2f regions/s\n",
+	   bench_name(bench), ws_kb, thrnum, throughput);
+    total.ReportProfile();
+  }
+  fflush(stdout);
 }
 
+void usage() {
+  printf("./workingset [options]\n"
+	 "  -r | -w | -m | -rr | -rw   seq read, seq write, mix, random read, random write\n"
+	 "  -ws=KB                     working set size (default 16KB)\n"
+	 "  -ws-min=KB -ws-max=KB      sweep working set, doubling unless -ws-step is set\n"
+	 "  -ws-step=KB                linear sweep step\n"
+	 "  -rset=KB -wset=KB          read/write set of the mix model\n"
+	 "  -thr=N                     number of threads (default 1)\n"
+	 "  -cpus=a,b,c                cores to pin threads on (default 0,1,2...)\n"
+	 "  -ht                        put thread pairs on sibling hyper-threads\n"
+	 "  -dur=S                     seconds per point (default 1)\n"
+	 "  -warmup=MS                 warmup per point (default 200ms)\n"
+	 "  -lock                      lock-based baseline instead of RTM\n"
+	 "  -csv                       machine readable output\n");
+}
 
 int main(int argc, char** argv) {
 
   //Parse args
-  if(argc >= 1)
-    workingset = atoi(argv[1]) ;
-  /*
-    for(int i = 1; i < argc; i++) {
+  for(int i = 1; i < argc; i++) {
 
     int n = 0;
     char junk;
-    if (strcmp(argv[i], "--help") == 0){
-    printf("./a.out --ws=working set size (KB default:16KB)\n");
-    return 1;
+    if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0){
+      usage();
+      return 1;
     }
     else if(sscanf(argv[i], "-ws=%d%c", &n, &junk) == 1) {
-    workingset = n;// = n * 1024;
+      ws_min = ws_max = n;
+    }else if(sscanf(argv[i], "-ws-min=%d%c", &n, &junk) == 1) {
+      ws_min = n;
+    }else if(sscanf(argv[i], "-ws-max=%d%c", &n, &junk) == 1) {
+      ws_max = n;
+    }else if(sscanf(argv[i], "-ws-step=%d%c", &n, &junk) == 1) {
+      ws_step = n;
     }else if(sscanf(argv[i], "-wset=%d%c", &n, &junk) == 1) {
-    writeset = n * 1024;
+      writeset = n * 1024;
     }else if(sscanf(argv[i], "-thr=%d%c", &n, &junk) == 1) {
-    thrnum = n;
+      thrnum = n;
     }else if(sscanf(argv[i], "-rset=%d%c", &n, &junk) == 1) {
-    readset= n * 1024;
+      readset= n * 1024;
+    }else if(sscanf(argv[i], "-dur=%d%c", &n, &junk) == 1) {
+      duration = n;
+    }else if(sscanf(argv[i], "-warmup=%d%c", &n, &junk) == 1) {
+      warmup = n;
+    }else if(strncmp(argv[i], "-cpus=", 6) == 0) {
+      char *p = argv[i] + 6;
+      while(*p != 0 && ncpus < MAXTHREADS) {
+	cpus[ncpus++] = strtol(p, &p, 10);
+	if(*p == ',')
+	  p++;
+      }
     }else if(strcmp(argv[i], "-ht") == 0) {
-    thrnum = 2;
+      sibling = true;
     }else if(strcmp(argv[i], "-r") == 0) {
-    bench = 1;
+      bench = SEQ_READ;
     }else if(strcmp(argv[i], "-w") == 0) {
-    bench = 2;
+      bench = SEQ_WRITE;
     }else if(strcmp(argv[i], "-m") == 0) {
-    bench = 3;
+      bench = MIX;
+    }else if(strcmp(argv[i], "-rr") == 0) {
+      bench = RAND_READ;
+    }else if(strcmp(argv[i], "-rw") == 0) {
+      bench = RAND_WRITE;
+    }else if(strcmp(argv[i], "-lock") == 0) {
+      rtm_force_fallback() = true;
+    }else if(strcmp(argv[i], "-csv") == 0) {
+      csv = true;
+    }else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      usage();
+      return 1;
     }
-    }
-  */
-
-  if(bench != 3)
-    printf("Touch Work Set %d\n", workingset);
-  else
-    printf("Read %d Write %d\n", readset, writeset);
-
-  pthread_t *th = new pthread_t[thrnum];
-  for(int i = 0; i < thrnum; i++)
-    pthread_create(&th[i], NULL, thread_body, (void *)i);
-
-  //Barriar to wait all threads become ready
-  while (ready < 1);
+  }
 
-  //Begin at the first epoch
-  epoch = 1;
+  if(thrnum < 1 || thrnum > MAXTHREADS) {
+    fprintf(stderr, "thread number should be in [1,%d]\n", MAXTHREADS);
+    return 1;
+  }
+  //the sweep doubles or steps up from ws_min, it has to move
+  if(ws_min <= 0 || ws_step < 0) {
+    fprintf(stderr, "working set should be at least 1 KB and -ws-step not negative\n");
+    return 1;
+  }
+  if(ws_max < ws_min)
+    ws_max = ws_min;
+  if(ws_max * 1024 > ARRAYSIZE || readset + writeset > ARRAYSIZE) {
+    fprintf(stderr, "working set should not exceed %d KB\n", ARRAYSIZE / 1024);
+    return 1;
+  }
 
-  sleep(1); //for warmup
-  epoch++;
+  if(csv)
+    printf("mode,sync,ws_kb,rset_kb,wset_kb,threads,throughput,abort,conflict,capacity,zero,nest,fallback\n");
 
-  while(true) {
-    sleep(1);
-    epoch++;
+  if(bench == MIX) {
+    printf(csv ? "" : "Read %d Write %d\n", readset, writeset);
+    run_point();
+    return 0;
   }
 
-  for(int i = 0; i < thrnum; i++)
-    pthread_join(th[i], NULL);
-
+  for(int ws = ws_min; ws <= ws_max; ws = ws_step ? ws + ws_step : ws * 2) {
+    workingset = ws * 1024;
+    if(!csv)
+      printf("Touch Work Set %d\n", workingset);
+    run_point();
+  }
 
-  return 1;
+  return 0;
 }